@@ -10,7 +10,8 @@ CFLAGS=-fPIE -fPIC -DDEBUG -std=c99 -DANDROID ${OPTIONS} \
 	-I${PREFIX}/include/glib-2.0 \
 	-I${PREFIX}/lib/glib-2.0/include \
 	-I${PREFIX}/include/gssdp-1.0 \
-	-DIFADDRS_NOT_SUPPORTED=1
+	-DIFADDRS_NOT_SUPPORTED=1 \
+	-DEVENTFD_NOT_SUPPORTED=1
 MQTT_LIBS=/home/federico/urmetiotc/libs.android/12_mosquitto_1.4.2/lib
 MQTT_OBJS=${MQTT_LIBS}/will_mosq.o \
 	${MQTT_LIBS}/util_mosq.o \
@@ -0,0 +1,273 @@
+/*
+ * Copyright (C) 2015 CSP Innovazione nelle ICT s.c.a r.l. (http://www.csp.it/)
+ * All rights reserved.
+ *
+ * [any text provided by the client]
+ *
+ * dns.c
+ *	Urmet IoT host name resolution
+ *
+ * Authors:
+ *	Matteo Di Leo <matteo.dileo@csp.it>
+ */
+
+#include "library.h"
+#include "dns.h"
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+struct dnsCacheEntry {
+	char *host;
+	GList *addresses;	// NULL if resolution failed
+	gint64 expire;		// monotonic time
+	struct dnsCacheEntry *next;
+};
+
+struct dnsRequest {
+	char *host;
+	GCancellable *cancellable;
+	GList *addresses;	// taken from cache
+	void (*onResolved)(GList *addresses, void *userData);
+	void *userData;
+};
+
+// most recently used first
+IOTC_PRIVATE struct dnsCacheEntry *dnsCache = NULL;
+IOTC_PRIVATE pthread_mutex_t dnsCacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+IOTC_PRIVATE GList *dnsCopyAddresses(GList *addresses) {
+	return g_list_copy_deep(addresses, (GCopyFunc)g_object_ref, NULL);
+}
+
+IOTC_PRIVATE void dnsCacheEntryFree(struct dnsCacheEntry *entry) {
+	if(entry->addresses != NULL)
+		g_resolver_free_addresses(entry->addresses);
+	g_free(entry->host);
+	free(entry);
+}
+
+// returns true if host is in cache, addresses is set to a copy of its addresses (NULL if it failed)
+IOTC_PRIVATE bool dnsCacheGet(const char *host, GList **addresses) {
+	struct dnsCacheEntry **prev, *entry;
+	gint64 now = g_get_monotonic_time();
+	pthread_mutex_lock(&dnsCacheLock);
+	for(prev=&dnsCache; *prev!=NULL; prev=&((*prev)->next)) {
+		entry = *prev;
+		if(strcmp(entry->host, host) != 0)
+			continue;
+		*prev = entry->next;
+		if(entry->expire < now) {
+			dnsCacheEntryFree(entry);
+			break;
+		}
+		entry->next = dnsCache;
+		dnsCache = entry;
+		(*addresses) = dnsCopyAddresses(entry->addresses);
+		pthread_mutex_unlock(&dnsCacheLock);
+		return true;
+	}
+	pthread_mutex_unlock(&dnsCacheLock);
+	return false;
+}
+
+// keep a copy of addresses (NULL if resolution failed)
+IOTC_PRIVATE void dnsCacheStore(const char *host, GList *addresses) {
+	struct dnsCacheEntry **prev, *entry;
+	int count = 0;
+	entry = (struct dnsCacheEntry *)malloc(sizeof(struct dnsCacheEntry));
+	if(entry == NULL) {
+#ifdef DEBUG
+		printf("Malloc error: entry\n");
+#endif
+		return;
+	}
+	entry->host = g_strdup(host);
+	entry->addresses = dnsCopyAddresses(addresses);
+	entry->expire = g_get_monotonic_time() +
+			(gint64)(addresses != NULL ? DNS_TTL : DNS_NEGATIVE_TTL) * G_USEC_PER_SEC;
+	pthread_mutex_lock(&dnsCacheLock);
+	entry->next = dnsCache;
+	dnsCache = entry;
+	// drop old result of the same host and least recently used ones
+	prev = &(entry->next);
+	while(*prev != NULL) {
+		if(strcmp((*prev)->host, host) == 0 || count >= DNS_CACHE_SIZE - 1) {
+			entry = *prev;
+			*prev = entry->next;
+			dnsCacheEntryFree(entry);
+		} else {
+			count++;
+			prev = &((*prev)->next);
+		}
+	}
+	pthread_mutex_unlock(&dnsCacheLock);
+}
+
+/*
+ * Blocking resolution. getaddrinfo is used instead of GResolver because it maps ipv4 addresses
+ * to ipv6 on networks that need it (ex.: iOS on NAT64).
+ */
+IOTC_PRIVATE GList *dnsResolve(const char *host) {
+	struct addrinfo hints, *dnsResults, *dnsResult;
+	GList *addresses = NULL;
+
+	// set connection hints
+	memset(&hints, 0, sizeof(struct addrinfo));
+	hints.ai_family = AF_UNSPEC; // Allow IPv4 or IPv6
+	hints.ai_socktype = SOCK_STREAM; // TCP
+	hints.ai_flags = 0;
+	hints.ai_protocol = 0;
+
+	if(getaddrinfo(host, NULL, &hints, &dnsResults) != 0) {
+#ifdef DEBUG
+		printf("Cannot resolve host name %s\n", host);
+#endif
+		return NULL;
+	}
+	for(dnsResult = dnsResults; dnsResult != NULL; dnsResult = dnsResult->ai_next) {
+		if(dnsResult->ai_family != PF_INET && dnsResult->ai_family != PF_INET6)
+			continue;
+		GSocketAddress *sockAddr = g_socket_address_new_from_native(dnsResult->ai_addr,
+				dnsResult->ai_addrlen);
+		if(sockAddr == NULL)
+			continue;
+		addresses = g_list_append(addresses,
+				g_object_ref(g_inet_socket_address_get_address(G_INET_SOCKET_ADDRESS(sockAddr))));
+		g_object_unref(sockAddr);
+	}
+	freeaddrinfo(dnsResults);
+	return addresses;
+}
+
+GList *dnsLookup(const char *host) {
+	GList *addresses;
+	if(dnsCacheGet(host, &addresses))
+		return addresses;
+	addresses = dnsResolve(host);
+	dnsCacheStore(host, addresses);
+	return addresses;
+}
+
+IOTC_PRIVATE void dnsRequestEnd(struct dnsRequest *request, GList *addresses) {
+	if(request->onResolved != NULL)
+		request->onResolved(addresses, request->userData);
+	if(request->cancellable != NULL)
+		g_object_unref(request->cancellable);
+	g_free(request->host);
+	free(request);
+}
+
+IOTC_PRIVATE gboolean dnsCachedCb(gpointer userData) {
+	struct dnsRequest *request = (struct dnsRequest *)userData;
+	GList *addresses = request->addresses;
+	bool cancelled = request->cancellable != NULL && g_cancellable_is_cancelled(request->cancellable);
+	dnsRequestEnd(request, cancelled ? NULL : addresses);
+	if(addresses != NULL)
+		g_resolver_free_addresses(addresses);
+	return G_SOURCE_REMOVE;
+}
+
+IOTC_PRIVATE void dnsResolvedCb(GObject *sourceObject, GAsyncResult *res, gpointer userData) {
+	struct dnsRequest *request = (struct dnsRequest *)userData;
+	GError *error = NULL;
+	GList *addresses = g_resolver_lookup_by_name_finish(G_RESOLVER(sourceObject), res, &error);
+	if(error != NULL) {
+#ifdef DEBUG
+		printf("Cannot resolve host name %s: %s\n", request->host, error->message);
+#endif
+		// a cancelled request says nothing about host
+		if(!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+			dnsCacheStore(request->host, NULL);
+		g_error_free(error);
+	} else {
+		dnsCacheStore(request->host, addresses);
+	}
+	dnsRequestEnd(request, addresses);
+	if(addresses != NULL)
+		g_resolver_free_addresses(addresses);
+}
+
+void dnsLookupAsync(const char *host, GCancellable *cancellable,
+		void (*onResolved)(GList *addresses, void *userData), void *userData) {
+	struct dnsRequest *request = (struct dnsRequest *)malloc(sizeof(struct dnsRequest));
+	if(request == NULL) {
+#ifdef DEBUG
+		printf("Malloc error: request\n");
+#endif
+		if(onResolved != NULL)
+			onResolved(NULL, userData);
+		return;
+	}
+	request->host = g_strdup(host);
+	request->cancellable = cancellable != NULL ? g_object_ref(cancellable) : NULL;
+	request->addresses = NULL;
+	request->onResolved = onResolved;
+	request->userData = userData;
+	if(dnsCacheGet(host, &(request->addresses))) {
+		g_idle_add(dnsCachedCb, request);
+		return;
+	}
+	GResolver *resolver = g_resolver_get_default();
+	g_resolver_lookup_by_name_async(resolver, host, cancellable, dnsResolvedCb, request);
+	g_object_unref(resolver);
+}
+
+void dnsPrefetch(const char *host) {
+	GList *addresses;
+	if(host == NULL || g_hostname_is_ip_address(host))
+		return;
+	if(dnsCacheGet(host, &addresses)) {
+		if(addresses != NULL)
+			g_resolver_free_addresses(addresses);
+		return;
+	}
+#ifdef DEBUG
+	printf("[DEBUG] Prefetching host name %s\n", host);
+#endif
+	dnsLookupAsync(host, NULL, NULL, NULL);
+}
+
+int dnsConnect(const char *host, unsigned short port) {
+	int sock = -1;
+	GList *addresses, *address;
+	struct sockaddr_storage native;
+
+	addresses = dnsLookup(host);
+	if(addresses == NULL)
+		return -1;
+
+	// try to connect to one of the results gave by dns
+	for(address = addresses; address != NULL; address = address->next) {
+		GSocketAddress *sockAddr = g_inet_socket_address_new(G_INET_ADDRESS(address->data), port);
+		gssize len = g_socket_address_get_native_size(sockAddr);
+		if(len <= 0 || !g_socket_address_to_native(sockAddr, &native, sizeof(native), NULL)) {
+			g_object_unref(sockAddr);
+			continue;
+		}
+		g_object_unref(sockAddr);
+		sock = socket(((struct sockaddr *)&native)->sa_family, SOCK_STREAM, 0);
+		if(sock == -1)
+			continue;
+		if(connect(sock, (struct sockaddr *)&native, len) != -1)
+			break;
+		close(sock);
+		sock = -1;
+	}
+	g_resolver_free_addresses(addresses);
+#ifdef DEBUG
+	if(sock < 0)
+		printf("Cannot establish socket connection\n");
+#endif
+	return sock;
+}
+
+void dnsClearCache() {
+	pthread_mutex_lock(&dnsCacheLock);
+	while(dnsCache != NULL) {
+		struct dnsCacheEntry *entry = dnsCache;
+		dnsCache = entry->next;
+		dnsCacheEntryFree(entry);
+	}
+	pthread_mutex_unlock(&dnsCacheLock);
+}
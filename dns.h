@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2015 CSP Innovazione nelle ICT s.c.a r.l. (http://www.csp.it/)
+ * All rights reserved.
+ *
+ * [any text provided by the client]
+ *
+ */
+
+/**
+ * @file dns.h
+ * @author Matteo Di Leo <matteo.dileo@csp.it>
+ * @date 19/10/2026
+ * @brief Urmet IoT host name resolution
+ *
+ * Here are placed the functions used by http, https and mqtt connections to resolve host names.
+ * Results are kept in a cache shared by all connections: successful resolutions for DNS_TTL
+ * seconds, failed ones for DNS_NEGATIVE_TTL seconds.
+ */
+
+#ifndef __DNS_H__
+#define __DNS_H__
+
+#include <stdbool.h>
+#include <gio/gio.h>
+
+#define DNS_CACHE_SIZE 16 // host names kept in cache
+#define DNS_TTL 300 // seconds a resolved host name is kept
+#define DNS_NEGATIVE_TTL 30 // seconds a failed resolution is kept
+
+/**
+ * @brief Resolve a host name, waiting for DNS if it is not in cache
+ *
+ * This function may block: on main loop prefer dnsLookupAsync().
+ * @param host The host name or the ip as string
+ * @return A list of GInetAddress, to be deallocated using g_resolver_free_addresses(),
+ *	or NULL if host cannot be resolved
+ */
+GList *dnsLookup(const char *host);
+
+/**
+ * @brief Resolve a host name without blocking
+ *
+ * Callback is always invoked on main loop after this function returns, also when host is in cache.
+ * @param host The host name or the ip as string
+ * @param cancellable A GCancellable to stop resolution (can be NULL). A cancelled resolution
+ *	invokes callback with NULL
+ * @param onResolved The callback invoked with result (can be NULL). Params are:
+ *	- addresses The list of GInetAddress, NULL if host cannot be resolved. The list is valid
+ *	only until callback returns
+ *	- userData The user data provided as parameter in this function
+ * @param userData A pointer to data passed back to callback
+ */
+void dnsLookupAsync(const char *host, GCancellable *cancellable,
+		void (*onResolved)(GList *addresses, void *userData), void *userData);
+
+/**
+ * @brief Resolve a host name in background, so that next lookups find it in cache
+ *
+ * @param host The host name or the ip as string
+ */
+void dnsPrefetch(const char *host);
+
+/**
+ * @brief Open a TCP connection to a host
+ *
+ * Addresses of host are tried in order until one accepts the connection.
+ * This function blocks until connection is established.
+ * @param host The host name or the ip as string
+ * @param port The port to connect to
+ * @return The connected socket or -1 if an error occurred
+ */
+int dnsConnect(const char *host, unsigned short port);
+
+/**
+ * @brief Forget all resolved host names
+ *
+ * Invoke this when network changes, so that next lookups ask DNS again.
+ */
+void dnsClearCache();
+
+#endif /* __DNS_H__ */
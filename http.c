@@ -0,0 +1,324 @@
+/*
+ * Copyright (C) 2015 CSP Innovazione nelle ICT s.c.a r.l. (http://www.csp.it/)
+ * All rights reserved.
+ *
+ * [any text provided by the client]
+ *
+ * http.c
+ *	Urmet IoT HTTP response parsing
+ *
+ * Authors:
+ *	Matteo Di Leo <matteo.dileo@csp.it>
+ */
+
+#include "library.h"
+#include "http.h"
+#include "rtsp.h"
+#include <stdlib.h>
+#include <string.h>
+#include <glib/glib.h>
+
+#define HTTP_CHUNK_LINE 32 // max length of a chunk size line, extensions included
+
+enum httpParserState {
+	HTTP_PARSER_HEADER,
+	HTTP_PARSER_LENGTH,		// body delimited by Content-Length
+	HTTP_PARSER_CHUNK_SIZE,
+	HTTP_PARSER_CHUNK_DATA,
+	HTTP_PARSER_CHUNK_END,		// line terminator after chunk data
+	HTTP_PARSER_TRAILER,
+	HTTP_PARSER_CLOSE,		// body delimited by end of connection
+	HTTP_PARSER_DONE
+};
+
+struct httpParser {
+	enum httpParserState state;
+	char *buf;			// header section followed by body collected
+	int len;
+	int size;
+	int bodyLen;
+	int remaining;			// bytes of body or chunk still to be read
+	char line[HTTP_CHUNK_LINE];	// chunk size or trailer line being read
+	int lineLen;
+	int status;
+	bool keepAlive;
+	void (*onBody)(const char *data, int len, void *userData);
+	void *userData;
+};
+
+IOTC_PRIVATE bool httpParserReserve(HttpParser *parser, int size) {
+	char *buf;
+	int newSize = parser->size > 0 ? parser->size : HTTP_READ_CHUNK;
+	if(size < parser->size)
+		return true;
+	while(newSize <= size)
+		newSize *= 2;
+	buf = (char *)realloc(parser->buf, newSize);
+	if(buf == NULL) {
+#ifdef DEBUG
+		printf("Malloc error: parser->buf\n");
+#endif
+		return false;
+	}
+	parser->buf = buf;
+	parser->size = newSize;
+	return true;
+}
+
+IOTC_PRIVATE bool httpParserBody(HttpParser *parser, const char *data, int len) {
+	if(parser->bodyLen + len > HTTP_MAX_BODY) {
+#ifdef DEBUG
+		printf("HTTP body too long\n");
+#endif
+		return false;
+	}
+	parser->bodyLen += len;
+	if(parser->onBody != NULL) {
+		parser->onBody(data, len, parser->userData);
+		return true;
+	}
+	if(!httpParserReserve(parser, parser->len + len))
+		return false;
+	memcpy(parser->buf + parser->len, data, len);
+	parser->len += len;
+	parser->buf[parser->len] = '\0';
+	return true;
+}
+
+// offset after the empty line closing the header section, 0 if not found
+IOTC_PRIVATE int httpHeaderEnd(const char *buf, int len) {
+	int i;
+	for(i=0; i<len; i++) {
+		if(buf[i] != '\n')
+			continue;
+		if(i+1 < len && buf[i+1] == '\n')
+			return i+2;
+		if(i+2 < len && buf[i+1] == '\r' && buf[i+2] == '\n')
+			return i+3;
+	}
+	return 0;
+}
+
+// read status line and headers (RTSP headers have the same syntax) and choose how body ends
+IOTC_PRIVATE bool httpParserHeaderDone(HttpParser *parser) {
+	const char *value;
+	char number[16];
+	int valueLen;
+	if(parser->len < 12 || strncmp(parser->buf, "HTTP/1.", 7) != 0 || parser->buf[8] != ' ') {
+#ifdef DEBUG
+		printf("Cannot read HTTP status code\n");
+#endif
+		return false;
+	}
+	parser->status = atoi(parser->buf + 9);
+	parser->keepAlive = parser->buf[7] == '1';
+	value = rtspGetHeader(parser->buf, parser->len, "Connection", &valueLen);
+	if(value != NULL && valueLen >= 5 && g_ascii_strncasecmp(value, "close", 5) == 0)
+		parser->keepAlive = false;
+
+	if(parser->status >= 100 && parser->status < 200) {
+		// interim response: the real one follows
+		parser->len = 0;
+		parser->status = -1;
+		return true;
+	}
+	if(parser->status == 204 || parser->status == 304) {
+		parser->state = HTTP_PARSER_DONE;
+		return true;
+	}
+	value = rtspGetHeader(parser->buf, parser->len, "Transfer-Encoding", &valueLen);
+	if(value != NULL && g_strstr_len(value, valueLen, "chunked") != NULL) {
+		parser->state = HTTP_PARSER_CHUNK_SIZE;
+		parser->lineLen = 0;
+		return true;
+	}
+	value = rtspGetHeader(parser->buf, parser->len, "Content-Length", &valueLen);
+	if(value != NULL) {
+		if(valueLen <= 0 || valueLen >= sizeof(number))
+			return false;
+		memcpy(number, value, valueLen);
+		number[valueLen] = '\0';
+		parser->remaining = atoi(number);
+		if(parser->remaining < 0 || parser->remaining > HTTP_MAX_BODY)
+			return false;
+		// the whole response fits in buffer without further reallocations
+		if(parser->onBody == NULL && !httpParserReserve(parser, parser->len + parser->remaining))
+			return false;
+		parser->state = parser->remaining > 0 ? HTTP_PARSER_LENGTH : HTTP_PARSER_DONE;
+		return true;
+	}
+	parser->keepAlive = false;
+	parser->state = HTTP_PARSER_CLOSE;
+	return true;
+}
+
+IOTC_PRIVATE int httpParserFeedHeader(HttpParser *parser, const char *data, int len) {
+	int start, end, prevLen;
+	int n = len < HTTP_MAX_HEADER - parser->len ? len : HTTP_MAX_HEADER - parser->len;
+	if(n <= 0) {
+#ifdef DEBUG
+		printf("HTTP header too long\n");
+#endif
+		return -1;
+	}
+	if(!httpParserReserve(parser, parser->len + n))
+		return -1;
+	prevLen = parser->len;
+	memcpy(parser->buf + parser->len, data, n);
+	parser->len += n;
+	parser->buf[parser->len] = '\0';
+	// the empty line can start in bytes received before
+	start = prevLen > 3 ? prevLen - 3 : 0;
+	end = httpHeaderEnd(parser->buf + start, parser->len - start);
+	if(end == 0)
+		return n;
+	// following bytes belong to body
+	parser->len = start + end;
+	parser->buf[parser->len] = '\0';
+	if(!httpParserHeaderDone(parser))
+		return -1;
+	return start + end - prevLen;
+}
+
+// read a chunk size line or a trailer line, returns the bytes used or -1
+IOTC_PRIVATE int httpParserFeedLine(HttpParser *parser, const char *data, int len) {
+	int i;
+	char *end;
+	for(i=0; i<len; i++) {
+		if(data[i] != '\n') {
+			if(data[i] == '\r')
+				continue;
+			if(parser->lineLen >= HTTP_CHUNK_LINE - 1)
+				return -1;
+			parser->line[parser->lineLen++] = data[i];
+			continue;
+		}
+		parser->line[parser->lineLen] = '\0';
+		if(parser->state == HTTP_PARSER_TRAILER) {
+			if(parser->lineLen == 0)
+				parser->state = HTTP_PARSER_DONE;
+			parser->lineLen = 0;
+			if(parser->state == HTTP_PARSER_DONE)
+				return i+1;
+			continue;
+		}
+		// chunk size in hex, followed by optional extensions
+		parser->remaining = strtol(parser->line, &end, 16);
+		if(end == parser->line || parser->remaining < 0 || parser->remaining > HTTP_MAX_BODY)
+			return -1;
+		parser->lineLen = 0;
+		parser->state = parser->remaining > 0 ? HTTP_PARSER_CHUNK_DATA : HTTP_PARSER_TRAILER;
+		return i+1;
+	}
+	return len;
+}
+
+HttpParser *httpParserNew(void (*onBody)(const char *data, int len, void *userData), void *userData) {
+	HttpParser *parser = (HttpParser *)malloc(sizeof(HttpParser));
+	if(parser == NULL) {
+#ifdef DEBUG
+		printf("Malloc error: parser\n");
+#endif
+		return NULL;
+	}
+	parser->state = HTTP_PARSER_HEADER;
+	parser->buf = NULL;
+	parser->len = 0;
+	parser->size = 0;
+	parser->bodyLen = 0;
+	parser->remaining = 0;
+	parser->lineLen = 0;
+	parser->status = -1;
+	parser->keepAlive = false;
+	parser->onBody = onBody;
+	parser->userData = userData;
+	return parser;
+}
+
+int httpParserFeed(HttpParser *parser, const char *data, int len) {
+	int used = 0, n;
+	while(used < len && parser->state != HTTP_PARSER_DONE) {
+		switch(parser->state) {
+			case HTTP_PARSER_HEADER:
+				n = httpParserFeedHeader(parser, data + used, len - used);
+			break;
+			case HTTP_PARSER_LENGTH:
+			case HTTP_PARSER_CHUNK_DATA:
+				n = len - used < parser->remaining ? len - used : parser->remaining;
+				if(!httpParserBody(parser, data + used, n))
+					return -1;
+				parser->remaining -= n;
+				if(parser->remaining == 0)
+					parser->state = parser->state == HTTP_PARSER_LENGTH ?
+							HTTP_PARSER_DONE : HTTP_PARSER_CHUNK_END;
+			break;
+			case HTTP_PARSER_CHUNK_END:
+				// skip CRLF after chunk data
+				for(n=0; used+n < len && data[used+n] != '\n'; n++);
+				if(used+n < len) {
+					n++;
+					parser->state = HTTP_PARSER_CHUNK_SIZE;
+				}
+			break;
+			case HTTP_PARSER_CHUNK_SIZE:
+			case HTTP_PARSER_TRAILER:
+				n = httpParserFeedLine(parser, data + used, len - used);
+			break;
+			case HTTP_PARSER_CLOSE:
+				n = len - used;
+				if(!httpParserBody(parser, data + used, n))
+					return -1;
+			break;
+			default:
+				n = -1;
+			break;
+		}
+		if(n < 0)
+			return -1;
+		used += n;
+	}
+	return used;
+}
+
+bool httpParserEnd(HttpParser *parser) {
+	if(parser->state == HTTP_PARSER_CLOSE)
+		parser->state = HTTP_PARSER_DONE;
+	parser->keepAlive = false;
+	return parser->state == HTTP_PARSER_DONE;
+}
+
+bool httpParserComplete(HttpParser *parser) {
+	return parser->state == HTTP_PARSER_DONE;
+}
+
+int httpParserStatus(HttpParser *parser) {
+	return parser->state != HTTP_PARSER_HEADER ? parser->status : -1;
+}
+
+bool httpParserKeepAlive(HttpParser *parser) {
+	return parser->state == HTTP_PARSER_DONE && parser->keepAlive;
+}
+
+char *httpParserTakeResponse(HttpParser *parser, int *len) {
+	char *response = parser->buf;
+	if(response != NULL && parser->size > parser->len + 1) {
+		// give back the space reserved for growth
+		char *shrunk = (char *)realloc(response, parser->len + 1);
+		if(shrunk != NULL)
+			response = shrunk;
+	}
+	if(len != NULL)
+		*len = parser->len;
+	parser->buf = NULL;
+	parser->len = 0;
+	parser->size = 0;
+	return response;
+}
+
+void httpParserFree(HttpParser *parser) {
+	if(parser == NULL)
+		return;
+	if(parser->buf != NULL)
+		free(parser->buf);
+	free(parser);
+}
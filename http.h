@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) 2015 CSP Innovazione nelle ICT s.c.a r.l. (http://www.csp.it/)
+ * All rights reserved.
+ *
+ * [any text provided by the client]
+ *
+ */
+
+/**
+ * @file http.h
+ * @author Matteo Di Leo <matteo.dileo@csp.it>
+ * @date 19/10/2026
+ * @brief Urmet IoT HTTP response parsing
+ *
+ * Here are placed the functions used by http and https requests to read responses.
+ * Responses are parsed as they arrive, so that no buffer must be allocated before knowing
+ * their length.
+ */
+
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+#include <stdbool.h>
+
+#define HTTP_READ_CHUNK 2048 // bytes read from socket at once
+#define HTTP_MAX_HEADER 4096 // responses with longer header sections are refused
+#define HTTP_MAX_BODY (1024*1024) // responses with longer bodies are refused
+
+/**
+ * @brief Incremental parser of a HTTP/1.x response
+ *
+ * The parser receives the bytes of a connection as they arrive, in chunks of any size.
+ * It reads the status line and headers, then the body delimited by Content-Length, by chunked
+ * transfer encoding or by the end of connection. Body is decoded (chunk sizes are taken out)
+ * and passed to a callback or collected in a buffer which grows with the response.
+ *
+ * @see httpParserNew()
+ */
+typedef struct httpParser HttpParser;
+
+/**
+ * @brief Create a HTTP response parser
+ *
+ * @param onBody Callback invoked with chunks of decoded body (can be NULL). Params are:
+ *	- data The chunk of body
+ *	- len The length of chunk
+ *	- userData The user data provided as parameter in this function
+ *	If NULL, body is collected and can be read with httpParserTakeResponse()
+ * @param userData A pointer to data passed back to onBody
+ * @return The parser, to be deallocated using httpParserFree(), or NULL if an error occurred
+ */
+HttpParser *httpParserNew(void (*onBody)(const char *data, int len, void *userData), void *userData);
+
+/**
+ * @brief Pass to parser the next bytes of the connection
+ *
+ * @param parser The parser created using httpParserNew()
+ * @param data The bytes received
+ * @param len The number of bytes
+ * @return The number of bytes read by parser, less than len if response ended before, or -1 if
+ *	response is malformed or longer than HTTP_MAX_HEADER or HTTP_MAX_BODY
+ */
+int httpParserFeed(HttpParser *parser, const char *data, int len);
+
+/**
+ * @brief Tell parser the connection has been closed by server
+ *
+ * @param parser The parser created using httpParserNew()
+ * @return true if response is complete, that is when body is delimited by the end of connection
+ *	or has already been read
+ */
+bool httpParserEnd(HttpParser *parser);
+
+/**
+ * @brief Check the whole response has been read
+ *
+ * @param parser The parser created using httpParserNew()
+ * @return true if response is complete
+ */
+bool httpParserComplete(HttpParser *parser);
+
+/**
+ * @brief Get the status code of the response
+ *
+ * @param parser The parser created using httpParserNew()
+ * @return The HTTP status code or -1 if header section has not been read yet
+ */
+int httpParserStatus(HttpParser *parser);
+
+/**
+ * @brief Check the connection can be used for next requests
+ *
+ * @param parser The parser created using httpParserNew()
+ * @return true if the response is complete and server did not ask to close the connection
+ */
+bool httpParserKeepAlive(HttpParser *parser);
+
+/**
+ * @brief Take the response collected by parser
+ *
+ * The response is made of the header section followed by the decoded body, without chunk sizes.
+ * @param parser The parser created using httpParserNew()
+ * @param[out] len The length of response (can be NULL)
+ * @return The null terminated response, to be deallocated using free(), or NULL if nothing
+ *	has been received. Following calls return NULL
+ */
+char *httpParserTakeResponse(HttpParser *parser, int *len);
+
+/**
+ * @brief Deallocate a parser created using httpParserNew()
+ *
+ * @param parser The parser to free (can be NULL)
+ */
+void httpParserFree(HttpParser *parser);
+
+#endif /* __HTTP_H__ */
@@ -13,10 +13,12 @@
 
 #include "library.h"
 #include "ice.h"
+#include "rtsp.h"
 
+#include <net/if.h>
+#include <sys/un.h>
 #ifdef IFADDRS_NOT_SUPPORTED
 #include <sys/ioctl.h>
-#include <net/if.h>
 #else
 #include <ifaddrs.h>
 #endif
@@ -25,6 +27,13 @@
 #define BUFFER_LEN 1550 // 1550
 #define ICE_TIMEOUT 30 // timeout for custom ping used to test ice connection (should be > 2*ICE_TIMEOUT_INTERVAL)
 #define ICE_TIMEOUT_INTERVAL 5 // interval for send ping used to test ice connection
+#define ICE_MAX_POOL 8 // max number of channels kept pre-opened for a single port mapping
+#define ICE_POOL_REFILL_DELAY 1 // seconds to wait before replacing a pre-opened channel closed by device
+#define FANOUT_MAX_TRACKS 4 // max number of media of a shared RTSP stream
+#define FANOUT_MAX_DESCRIBE 8192 // max size of DESCRIBE response kept for a shared RTSP stream
+#define FANOUT_URL_LEN 256
+#define FANOUT_MAX_PENDING (FANOUT_MAX_DESCRIBE*2) // max bytes of responses waiting for a slow consumer
+#define INTERLEAVED_MAX_TRACKS 4 // max number of media of a RTSP connection in interleaved mode
 
 #ifdef DEBUG
 long sentSocket = 0, recvSocket = 0, sentIce = 0, recvIce = 0;
@@ -38,9 +47,28 @@ long sentSocket = 0, recvSocket = 0, sentIce = 0, recvIce = 0;
  * |   0    | action | new ch |     src port    |     dst port    | proto  |	// P2P_TUNNEL_MAP
  * |   0    | action |   ch   |							// P2P_TUNNEL_SHUT
  * |   0    | action |								// P2P_TUNNEL_PING
+ * |   0    | action | new ch |     src port    | proto  |  type  |  len   | value (len bytes) ...	// P2P_TUNNEL_MAP_EX
  * |--------|--------|--------|--------|--------|--------|--------|--------|
+ *
+ * P2P_TUNNEL_MAP_EX maps the channel on a device endpoint that is not a TCP/UDP port on localhost,
+ * type is one of p2pEndpointTypes (ex.: P2P_ENDPOINT_UNIX with the path of an AF_UNIX socket as value).
+ * P2P_ENDPOINT_HOST value is IPv4 address and port of a LAN host (6 bytes, network order): device
+ * acts as gateway only towards hosts listed in its gateway rules (see iceSetGateway()).
+ * P2P_ENDPOINT_UNIX paths are served only if listed in device unix path rules (see iceSetUnixPaths()).
+ *
+ * A channel pool does not need any new action: client sends P2P_TUNNEL_MAP in advance, so device
+ * connects its socket immediately, and client binds the channel to a local connection when it arrives.
+ *
+ * In-process channels (iceChannelOpen()) are mapped as usual, but client has no local socket:
+ * data of the channel is handed to application callbacks and written from application buffers.
  */
 
+struct localChannel {
+	void (*onData)(int channel, char *data, int len, void *userData);
+	void (*onClose)(int channel, void *userData);
+	void *userData;
+};
+
 struct connectionInfo {
 	int channel;
 	int sock;
@@ -56,6 +84,15 @@ struct connectionInfo {
 	bool *pendingSend;
 	gulong iceCanWriteSignalHandler;
 	struct connectionList *rtpChList;
+	struct iceAgentClient *pool; // pool owning this channel while it is mapped but still unused (client only)
+	struct fanoutSession *fanout; // shared stream whose primary connection is this one (client only)
+	struct addressList *extraDst; // other local consumers of a shared RTP channel (client only)
+	RtspParser *rtspRequest; // parser of messages sent by local RTSP client (client only)
+	RtspParser *rtspResponse; // parser of messages sent by RTSP server on device (client only)
+	struct interleavedSession *interleaved; // RTP/RTCP carried inside this RTSP connection (client only)
+	struct localChannel *local; // application callbacks of an in-process channel (client only)
+	char *unixPath; // AF_UNIX socket of the service to connect instead of dstAddr (device only)
+	IceAgent *iceAgent;
 };
 typedef struct connectionInfo ConnectionInfo;
 
@@ -87,6 +124,10 @@ struct iceAgent {
 	time_t *timeout;
 	guint gsourceTimeout;
 	struct socketServiceList *socketServiceList;
+	CandidatePolicy *policy;
+	CandidateStats stats;
+	const GatewayRule *gateway;
+	const UnixPathRule *unixPaths;
 	void (*onReady)(IotcCtx *ctx, IceAgent *, char *, void *);
 	void (*onStatusChanged)(IotcCtx *ctx, IceAgent *, const char *, void *, ConnectionType, char *);
 	void *userData;
@@ -97,6 +138,89 @@ struct iceAgentClient {
 	unsigned short remotePort;
 	unsigned short localPort;
 	TunnelProtocols proto;
+	int poolSize;
+	guint poolRefillSource;
+	struct fanoutSession *fanout;
+	bool interleave;
+	char *localPath; // AF_UNIX socket listening for local connections instead of localPort
+	char *remotePath; // AF_UNIX socket of the service on device instead of remotePort
+	in_addr_t remoteHost; // LAN host reached through device, 0 for device itself
+};
+
+struct addressList {
+	struct sockaddr_in addr;
+	struct addressList *next;
+};
+
+/*
+ * Fan-out of a RTSP mapping: the first local connection (primary) talks to device as usual,
+ * the next local connections (consumers) are served by the client using DESCRIBE response and
+ * RTP channels of primary, so the stream is sent by device only once.
+ */
+struct fanoutTrack {
+	char url[FANOUT_URL_LEN];	// SETUP url used by primary connection
+	ConnectionInfo *rtp;
+	ConnectionInfo *rtcp;
+	unsigned short serverPort;
+};
+
+struct fanoutConsumer {
+	struct fanoutSession *session;
+	GSocketConnection *connection;
+	int sock;
+	guint gsource;
+	char *buffer;
+	int readedBytes;
+	char sessionId[9];
+	unsigned short clientPort[FANOUT_MAX_TRACKS];	// 0 if track has not been set up
+	bool playing;
+	bool detach;	// consumer asked another stream, it will use its own channel
+	int detachOffset;	// requests from this offset of buffer go to device once responses are sent
+	GString *pending;	// responses not accepted by socket yet
+	guint sendSource;	// G_IO_OUT watch flushing pending
+	struct fanoutConsumer *next;
+};
+
+/*
+ * Interleaved mode of a RTSP mapping: SETUP requests are rewritten to carry RTP/RTCP inside the
+ * RTSP connection, so no UDP channel is opened. The client turns SETUP responses back to UDP and
+ * exchanges RTP/RTCP with local RTSP client through local sockets.
+ */
+struct interleavedTrack {
+	ConnectionInfo *conn;		// RTSP connection carrying the track
+	int channel;			// interleaved channel of RTP, RTCP uses channel+1
+	int rtpSock;			// local socket sending RTP to local client
+	int rtcpSock;			// local socket exchanging RTCP with local client
+	struct sockaddr_in rtpAddr;
+	struct sockaddr_in rtcpAddr;
+	guint gsource;
+};
+
+// SETUP request rewritten, waiting for its response
+struct interleavedSetup {
+	int cseq;			// -1 until the whole request header has been read
+	int channel;			// interleaved channel asked to server
+	int clientPort;			// client_port asked by local client
+};
+
+struct interleavedSession {
+	struct interleavedTrack tracks[INTERLEAVED_MAX_TRACKS];
+	int trackCount;
+	struct interleavedSetup setups[INTERLEAVED_MAX_TRACKS];	// pipelined SETUPs, in request order
+	int setupCount;
+};
+
+struct fanoutSession {
+	struct iceAgentClient *iac;
+	ConnectionInfo *primary;
+	char url[FANOUT_URL_LEN];	// DESCRIBE url of primary connection
+	char setupUrl[FANOUT_URL_LEN];	// last SETUP url of primary connection waiting for response
+	char *describe;			// DESCRIBE response received by primary connection
+	int describeLen;
+	int describeSize;
+	struct fanoutTrack tracks[FANOUT_MAX_TRACKS];
+	int trackCount;
+	struct fanoutConsumer *consumers;
 };
 
 IOTC_PRIVATE const gchar *candidateTypeName[] = {"host", "srflx", "prflx", "relay"};
@@ -125,7 +249,16 @@ IOTC_PRIVATE void stats(IceAgent *iceAgent) {
 #endif
 
 IOTC_PRIVATE int portMapInternal(IceAgent *iceAgent, unsigned short localPort, unsigned short remotePort,
-		TunnelProtocols proto);
+		TunnelProtocols proto, int poolSize);
+IOTC_PRIVATE void poolRefillLater(struct iceAgentClient *iac);
+IOTC_PRIVATE void freeAddressList(struct addressList *l);
+IOTC_PRIVATE void fanoutSessionReset(struct fanoutSession *fs);
+IOTC_PRIVATE void fanoutInspectRequest(struct fanoutSession *fs, const char *msg, int len);
+IOTC_PRIVATE void fanoutResponseHeader(struct fanoutSession *fs, const char *header, int len);
+IOTC_PRIVATE void fanoutResponseBody(struct fanoutSession *fs, const char *data, int len);
+IOTC_PRIVATE void fanoutAddTrack(struct fanoutSession *fs, ConnectionInfo *rtp, ConnectionInfo *rtcp,
+		unsigned short serverPort);
+IOTC_PRIVATE void interleavedSessionFree(struct interleavedSession *is);
 
 IOTC_PRIVATE gboolean timeoutCb(gpointer userData) {
 	IceAgent *iceAgent = (IceAgent *)userData;
@@ -154,6 +287,186 @@ IOTC_PRIVATE gboolean timeoutCb(gpointer userData) {
 	return G_SOURCE_CONTINUE;
 }
 
+IOTC_PRIVATE bool interfaceMatches(char **list, const char *ifName) {
+	int i;
+	if(list == NULL || ifName == NULL)
+		return false;
+	for(i=0; list[i] != NULL; i++) {
+		if(strncmp(ifName, list[i], strlen(list[i])) == 0)
+			return true;
+	}
+	return false;
+}
+
+IOTC_PRIVATE bool interfaceAllowed(const CandidatePolicy *policy, const char *ifName) {
+	if(policy->interfaceAllow != NULL && !interfaceMatches(policy->interfaceAllow, ifName))
+		return false;
+	return !interfaceMatches(policy->interfaceDeny, ifName);
+}
+
+IOTC_PRIVATE bool familyAllowed(const CandidatePolicy *policy, int family) {
+	if(policy->ipPreference == IP_ONLY_V4)
+		return family == AF_INET;
+	if(policy->ipPreference == IP_ONLY_V6)
+		return family == AF_INET6;
+	return true;
+}
+
+// Restrict gathering to the addresses of allowed interfaces: libnice gathers on all
+// interfaces when no local address has been added, so nothing is added if policy does not filter
+IOTC_PRIVATE void applyInterfacePolicy(IceAgent *iceAgent) {
+	const CandidatePolicy *policy = iceAgent->policy;
+	NiceAddress address;
+	int added = 0, skipped = 0;
+	if(policy == NULL || (policy->interfaceAllow == NULL && policy->interfaceDeny == NULL
+			&& policy->ipPreference != IP_ONLY_V4 && policy->ipPreference != IP_ONLY_V6))
+		return;
+#ifdef IFADDRS_NOT_SUPPORTED
+	struct ifconf ifc;
+	struct ifreq ifr[10];
+	int i, ifcNum;
+
+	int sock = socket(PF_INET, SOCK_DGRAM, 0);
+	if(sock < 0)
+		return;
+	ifc.ifc_len = sizeof(ifr);
+	ifc.ifc_ifcu.ifcu_buf = (caddr_t)ifr;
+	if(ioctl(sock, SIOCGIFCONF, &ifc) == 0) {
+		ifcNum = ifc.ifc_len / sizeof(struct ifreq);
+		for(i=0; i < ifcNum; ++i) {
+			if(ifr[i].ifr_addr.sa_family != AF_INET
+					|| (ntohl(((struct sockaddr_in *)&ifr[i].ifr_addr)->sin_addr.s_addr) >> 24) == 127)
+				continue;
+			if(!familyAllowed(policy, AF_INET) || !interfaceAllowed(policy, ifr[i].ifr_name)) {
+				skipped++;
+				continue;
+			}
+			nice_address_init(&address);
+			nice_address_set_from_sockaddr(&address, &ifr[i].ifr_addr);
+			if(nice_agent_add_local_address(iceAgent->agent, &address))
+				added++;
+		}
+	}
+	close(sock);
+#else
+	struct ifaddrs *ifAddrStruct, *ifa;
+	if(getifaddrs(&ifAddrStruct) != 0)
+		return;
+
+	for(ifa=ifAddrStruct; ifa!=NULL; ifa=ifa->ifa_next) {
+		if(!ifa->ifa_addr || !(ifa->ifa_flags & IFF_UP) || (ifa->ifa_flags & IFF_LOOPBACK))
+			continue;
+		if(ifa->ifa_addr->sa_family != AF_INET && (ifa->ifa_addr->sa_family != AF_INET6
+				|| IN6_IS_ADDR_LINKLOCAL(&((struct sockaddr_in6 *)ifa->ifa_addr)->sin6_addr)))
+			continue;
+		if(!familyAllowed(policy, ifa->ifa_addr->sa_family) || !interfaceAllowed(policy, ifa->ifa_name)) {
+			skipped++;
+			continue;
+		}
+		nice_address_init(&address);
+		nice_address_set_from_sockaddr(&address, ifa->ifa_addr);
+		if(nice_agent_add_local_address(iceAgent->agent, &address))
+			added++;
+	}
+	freeifaddrs(ifAddrStruct);
+#endif
+	if(added == 0) {
+#ifdef DEBUG
+		printf("[DEBUG] No interface allowed by candidate policy, gathering on all interfaces\n");
+#endif
+		skipped = 0;
+	}
+	iceAgent->stats.addressesSkipped = skipped;
+}
+
+IOTC_PRIVATE gint candidatePriorityCmp(gconstpointer a, gconstpointer b) {
+	guint32 priorityA = ((const NiceCandidate *)a)->priority;
+	guint32 priorityB = ((const NiceCandidate *)b)->priority;
+	return priorityA < priorityB ? 1 : (priorityA > priorityB ? -1 : 0);
+}
+
+IOTC_PRIVATE int policyMaxCandidates(const CandidatePolicy *policy, NiceCandidateType type) {
+	switch(type) {
+		case NICE_CANDIDATE_TYPE_HOST:
+			return policy->maxHost;
+		case NICE_CANDIDATE_TYPE_SERVER_REFLEXIVE:
+			return policy->maxSrflx;
+		case NICE_CANDIDATE_TYPE_RELAYED:
+			return policy->maxRelay;
+		default:
+			return 0;
+	}
+}
+
+// Remove from list candidates not allowed by policy, best candidates (higher priority) are kept.
+// Returns the new head of the list
+IOTC_PRIVATE GSList *filterCandidates(const CandidatePolicy *policy, GSList *cands, bool local, int *pruned) {
+	GSList *item, *next;
+	int count[G_N_ELEMENTS(candidateTypeName)] = {0};
+	bool hasV4[G_N_ELEMENTS(candidateTypeName)] = {false};
+	bool hasV6[G_N_ELEMENTS(candidateTypeName)] = {false};
+	*pruned = 0;
+	if(policy == NULL)
+		return cands;
+
+	cands = g_slist_sort(cands, candidatePriorityCmp);
+	for(item = cands; item != NULL; item = item->next) {
+		NiceCandidate *cand = (NiceCandidate *)item->data;
+		if(cand->type >= G_N_ELEMENTS(candidateTypeName))
+			continue;
+		if(nice_address_ip_version(&cand->addr) == 4)
+			hasV4[cand->type] = true;
+		else
+			hasV6[cand->type] = true;
+	}
+
+	for(item = cands; item != NULL; item = next) {
+		NiceCandidate *cand = (NiceCandidate *)item->data;
+		int version = nice_address_ip_version(&cand->addr);
+		int max = policyMaxCandidates(policy, cand->type);
+		bool keep = true;
+		next = item->next;
+		if(cand->type >= G_N_ELEMENTS(candidateTypeName))
+			keep = false;
+		else if(policy->relayMode == RELAY_NONE && cand->type == NICE_CANDIDATE_TYPE_RELAYED)
+			keep = false;
+		else if(local && policy->relayMode == RELAY_ONLY && cand->type != NICE_CANDIDATE_TYPE_RELAYED)
+			keep = false;
+		else if(!familyAllowed(policy, version == 4 ? AF_INET : AF_INET6))
+			keep = false;
+		else if(policy->ipPreference == IP_PREFER_V4 && version != 4 && hasV4[cand->type])
+			keep = false;
+		else if(policy->ipPreference == IP_PREFER_V6 && version == 4 && hasV6[cand->type])
+			keep = false;
+		else if(max > 0 && count[cand->type] >= max)
+			keep = false;
+
+		if(keep) {
+			count[cand->type]++;
+		} else {
+			nice_candidate_free(cand);
+			cands = g_slist_delete_link(cands, item);
+			(*pruned)++;
+		}
+	}
+	return cands;
+}
+
+// pairs are known only when both local and remote candidates are available.
+// Local candidates not published are still checked by libnice: only discarded remote ones prune pairs
+IOTC_PRIVATE void updatePairsPruned(IceAgent *iceAgent) {
+	CandidateStats *stats = &iceAgent->stats;
+	if(stats->localGathered == 0 || stats->remoteAccepted + stats->remotePruned == 0)
+		return;
+	stats->pairsPruned = stats->localGathered * stats->remotePruned;
+#ifdef DEBUG
+	printf("[DEBUG] Candidate policy: local %d published of %d gathered (%d addresses skipped), "
+			"remote %d/%d, %d pairs pruned\n", stats->localPublished, stats->localGathered,
+			stats->addressesSkipped, stats->remoteAccepted, stats->remoteAccepted + stats->remotePruned,
+			stats->pairsPruned);
+#endif
+}
+
 IOTC_PRIVATE void candidateGatheringDoneCb(NiceAgent *agent, guint streamId, gpointer data) {
 	IceAgent *iceAgent = (IceAgent *)data;
 	int offset = 0;
@@ -182,6 +495,13 @@ IOTC_PRIVATE void candidateGatheringDoneCb(NiceAgent *agent, guint streamId, gpo
 		return;
 	}
 
+	int pruned, gathered = g_slist_length(cands);
+	cands = filterCandidates(iceAgent->policy, cands, true, &pruned);
+	iceAgent->stats.localGathered = gathered;
+	iceAgent->stats.localPruned = pruned;
+	iceAgent->stats.localPublished = gathered - pruned;
+	updatePairsPruned(iceAgent);
+
 	if(iceAgent->timeout == NULL) {
 		iceAgent->timeout = (time_t *)malloc(sizeof(time_t));
 #ifdef DEBUG
@@ -374,6 +694,30 @@ IOTC_PRIVATE void closeChannelAndSocket(ConnectionInfo *conn, bool sendToOtherAg
 		g_object_unref(conn->connection);
 		conn->connection = NULL;
 	}
+	// consumers sharing the stream of this connection cannot be served anymore
+	if(conn->fanout != NULL)
+		fanoutSessionReset(conn->fanout);
+	freeAddressList(conn->extraDst);
+	conn->extraDst = NULL;
+	rtspParserFree(conn->rtspRequest);
+	conn->rtspRequest = NULL;
+	rtspParserFree(conn->rtspResponse);
+	conn->rtspResponse = NULL;
+	if(conn->interleaved != NULL) {
+		interleavedSessionFree(conn->interleaved);
+		conn->interleaved = NULL;
+	}
+	if(conn->unixPath != NULL) {
+		g_free(conn->unixPath);
+		conn->unixPath = NULL;
+	}
+	if(conn->local != NULL) {
+		struct localChannel *local = conn->local;
+		conn->local = NULL;
+		if(local->onClose != NULL)
+			local->onClose(conn->channel, local->userData);
+		free(local);
+	}
 #ifdef DEBUG
 	sentIce += 5;
 	printf("Socket read error: closing socket and deallocating recv callback\n");
@@ -384,6 +728,41 @@ IOTC_PRIVATE void closeChannelAndSocket(ConnectionInfo *conn, bool sendToOtherAg
 #endif
 }
 
+// send on ice the len bytes placed in conn->buffer after channel header, what cannot be sent now is sent by niceCanWriteCb
+IOTC_PRIVATE void sendBuffer(ConnectionInfo *conn, int len) {
+	conn->buffer[0] = conn->channel;
+	conn->buffer[1] = (unsigned char)(len >> 8);
+	conn->buffer[2] = (unsigned char)len;
+
+	int sent = nice_agent_send(conn->agent, 1, 1, len+3, conn->buffer);
+	if(sent < 0) {
+#ifdef DEBUG
+		printf("Not sent, retry\n");
+#endif
+		*(conn->pendingSend) = true;
+		conn->sentBytes = 0;
+		conn->unsentBytes = len+3;
+		conn->iceCanWriteSignalHandler = g_signal_connect(G_OBJECT(conn->agent), "reliable-transport-writable", G_CALLBACK(niceCanWriteCb), conn);
+		return;
+	} else if(sent<(len+3)) {
+#ifdef DEBUG
+		sentIce += sent;
+		printf("Partially sent [%d/%d]...should resend %d bytes\n", sent, len+3, len+3-sent);
+#endif
+		*(conn->pendingSend) = true;
+		conn->sentBytes = sent;
+		conn->unsentBytes = len-sent+3;
+		conn->iceCanWriteSignalHandler = g_signal_connect(G_OBJECT(conn->agent), "reliable-transport-writable", G_CALLBACK(niceCanWriteCb), conn);
+		return;
+	}
+#ifdef DEBUG
+	sentIce += sent;
+	printf("Nice sent [%d] [%ld]\n", len+3, sentIce);
+	stats(NULL);
+#endif
+	conn->unsentBytes = 0;
+}
+
 IOTC_PRIVATE gboolean socketRecvCb(GObject *sourceObject, GAsyncResult *res, gpointer userData) {
 	int readed;
 	ConnectionInfo *conn = (ConnectionInfo *)userData;
@@ -399,44 +778,23 @@ IOTC_PRIVATE gboolean socketRecvCb(GObject *sourceObject, GAsyncResult *res, gpo
 	}
 	struct sockaddr_in addr;
 	socklen_t slen = sizeof(struct sockaddr);
-	if((readed = recvfrom(conn->sock, (conn->buffer)+3, BUFFER_LEN-3, MSG_DONTWAIT, (struct sockaddr *)&addr, &slen)) > 0) {
-#ifdef DEBUG
-		recvSocket += readed;
-#endif
-		conn->buffer[0] = conn->channel;
-		conn->buffer[1] = (unsigned char)(readed >> 8);
-		conn->buffer[2] = (unsigned char)readed;
-
-		int sent;
-
-		// TODO nice send should be unified in a single function
-		sent = nice_agent_send(conn->agent, 1, 1, readed+3, conn->buffer);
-		if(sent < 0) {
-#ifdef DEBUG
-			printf("Not sent, retry\n");
-#endif
-			*(conn->pendingSend) = true;
-			conn->sentBytes = 0;
-			conn->unsentBytes = readed+3;
-			conn->iceCanWriteSignalHandler = g_signal_connect(G_OBJECT(conn->agent), "reliable-transport-writable", G_CALLBACK(niceCanWriteCb), conn);
-			return TRUE;
-		} else if(sent<(readed+3)) {
-#ifdef DEBUG
-			sentIce += sent;
-			printf("Partially sent [%d/%d]...should resend %d bytes\n", sent, readed+3, readed+3-sent);
-#endif
-			*(conn->pendingSend) = true;
-			conn->sentBytes = sent;
-			conn->unsentBytes = readed-sent+3;
-			conn->iceCanWriteSignalHandler = g_signal_connect(G_OBJECT(conn->agent), "reliable-transport-writable", G_CALLBACK(niceCanWriteCb), conn);
+	// in interleaved mode requests are rewritten, so they are read leaving room for rewrite
+	char request[conn->interleaved != NULL ? BUFFER_LEN-3-RTSP_REWRITE_SPACE : 1];
+	if(conn->interleaved != NULL) {
+		readed = recvfrom(conn->sock, request, sizeof(request), MSG_DONTWAIT, (struct sockaddr *)&addr, &slen);
+		// data is kept by parser until its line is complete, nothing to send yet
+		if(readed > 0 && (readed = rtspParserRewrite(conn->rtspRequest, request, readed, conn->buffer+3, BUFFER_LEN-3)) == 0)
 			return TRUE;
-		}
+	} else {
+		readed = recvfrom(conn->sock, (conn->buffer)+3, BUFFER_LEN-3, MSG_DONTWAIT, (struct sockaddr *)&addr, &slen);
+	}
+	if(readed > 0) {
 #ifdef DEBUG
-		sentIce += sent;
-		printf("Nice sent [%d] [%ld]\n", readed+3, sentIce);
-		stats(NULL);
+		recvSocket += readed;
 #endif
-		conn->unsentBytes = 0;
+		if(conn->rtspRequest != NULL && conn->interleaved == NULL)
+			rtspParserFeed(conn->rtspRequest, conn->buffer+3, readed);
+		sendBuffer(conn, readed);
 	} else if(readed == 0 || (readed == -1 && errno != EAGAIN && errno != EWOULDBLOCK)) {
 		// if it is RTSP close RTP channels too
 		if(conn->proto == P2P_RTSP) {
@@ -487,7 +845,9 @@ IOTC_PRIVATE bool initSocket(ConnectionInfo *conn) {
 			return false;
 		}
 	} else if(conn->proto == P2P_TCP || conn->proto == P2P_RTSP) {
-		conn->sock = socket(AF_INET, SOCK_STREAM, 0);
+		struct sockaddr_un unixAddr;
+		int ret;
+		conn->sock = socket(conn->unixPath != NULL ? AF_UNIX : AF_INET, SOCK_STREAM, 0);
 		if(conn->sock == -1) {
 #ifdef DEBUG
 			printf("Socket initialization failed: cannot create socket\n");
@@ -495,11 +855,20 @@ IOTC_PRIVATE bool initSocket(ConnectionInfo *conn) {
 			return false;
 		}
 
-		int ret = connect(conn->sock, (struct sockaddr *)&(conn->dstAddr), sizeof(struct sockaddr));
+		if(conn->unixPath != NULL) {
+			memset(&unixAddr, 0, sizeof(struct sockaddr_un));
+			unixAddr.sun_family = AF_UNIX;
+			strncpy(unixAddr.sun_path, conn->unixPath, sizeof(unixAddr.sun_path)-1);
+			ret = connect(conn->sock, (struct sockaddr *)&unixAddr, sizeof(struct sockaddr_un));
+		} else {
+			ret = connect(conn->sock, (struct sockaddr *)&(conn->dstAddr), sizeof(struct sockaddr));
+		}
 		if(ret < 0) {
 #ifdef DEBUG
 			printf("Socket initialization failed: cannot connect to server socket\n");
 #endif
+			close(conn->sock);
+			conn->sock = -1;
 			return false;
 		}
 	} else {
@@ -517,6 +886,320 @@ IOTC_PRIVATE bool initSocket(ConnectionInfo *conn) {
 	return true;
 }
 
+// open UDP channels for RTP and RTCP of a media set up on RTSP connection conn
+IOTC_PRIVATE void openRtpChannels(ConnectionInfo *conn, int cliPort, int srvPort) {
+	IceAgent *iceAgent = conn->iceAgent;
+	ConnectionInfo *conns = iceAgent->conns;
+#ifdef DEBUG
+	printf("Open new RTP connections on ports %d-%d %d-%d\n", cliPort, srvPort, cliPort+1, srvPort+1);
+#endif
+	// open portMap and save RTP channel for deallocation
+	int rtpChannel = portMapInternal(iceAgent, cliPort, srvPort, P2P_UDP, 0);
+	int rtcpChannel = portMapInternal(iceAgent, cliPort+1, srvPort+1, P2P_UDP, 0);
+	struct connectionList *rtpCh;
+	if(rtpChannel >= 0) {
+		rtpCh = (struct connectionList *)malloc(sizeof(struct connectionList));
+#ifdef DEBUG
+		if(rtpCh == NULL)
+			printf("Malloc error: rtpCh\n");
+#endif
+		rtpCh->value = &conns[rtpChannel];
+		rtpCh->next = conn->rtpChList;
+		conn->rtpChList = rtpCh;
+	}
+	if(rtcpChannel >= 0) {
+		rtpCh = (struct connectionList *)malloc(sizeof(struct connectionList));
+#ifdef DEBUG
+		if(rtpCh == NULL)
+			printf("Malloc error: rtpCh2\n");
+#endif
+		rtpCh->value = &conns[rtcpChannel];
+		rtpCh->next = conn->rtpChList;
+		conn->rtpChList = rtpCh;
+	}
+	if(conn->fanout != NULL && rtpChannel >= 0 && rtcpChannel >= 0)
+		fanoutAddTrack(conn->fanout, &conns[rtpChannel], &conns[rtcpChannel], srvPort);
+}
+
+IOTC_PRIVATE void interleavedSetupRemove(struct interleavedSession *is, int i);
+IOTC_PRIVATE int interleavedSetupFind(struct interleavedSession *is, int cseq, int channel);
+
+IOTC_PRIVATE void rtspResponseHeaderCb(const char *header, int len, void *userData) {
+	ConnectionInfo *conn = (ConnectionInfo *)userData;
+	int transportLen, cliPort, srvPort, i;
+	// SETUP refused by server, or answered without interleaved transport
+	if(conn->interleaved != NULL && (i = interleavedSetupFind(conn->interleaved, rtspGetCSeq(header, len), -1)) >= 0)
+		interleavedSetupRemove(conn->interleaved, i);
+	const char *transport = rtspGetHeader(header, len, "Transport", &transportLen);
+	// when server send client and server port for RTP
+	if(transport != NULL) {
+		cliPort = rtspTransportPort(transport, transportLen, "client_port");
+		srvPort = rtspTransportPort(transport, transportLen, "server_port");
+		if(cliPort > 0 && srvPort > 0)
+			openRtpChannels(conn, cliPort, srvPort);
+	}
+	if(conn->fanout != NULL)
+		fanoutResponseHeader(conn->fanout, header, len);
+}
+
+IOTC_PRIVATE void rtspResponseBodyCb(const char *data, int len, void *userData) {
+	ConnectionInfo *conn = (ConnectionInfo *)userData;
+	if(conn->fanout != NULL)
+		fanoutResponseBody(conn->fanout, data, len);
+}
+
+IOTC_PRIVATE void rtspRequestHeaderCb(const char *header, int len, void *userData) {
+	ConnectionInfo *conn = (ConnectionInfo *)userData;
+	int i;
+	// CSeq can follow Transport line, so SETUP rewritten is known only now
+	if(conn->interleaved != NULL)
+		for(i=0; i<conn->interleaved->setupCount; i++)
+			if(conn->interleaved->setups[i].cseq == -1)
+				conn->interleaved->setups[i].cseq = rtspGetCSeq(header, len);
+	if(conn->fanout != NULL)
+		fanoutInspectRequest(conn->fanout, header, len);
+}
+
+// parse the value of a Transport header line
+IOTC_PRIVATE const char *transportLineValue(const char *line, int len, int *valueLen) {
+	const char *value;
+	if(len < 10 || strncasecmp(line, "Transport:", 10) != 0)
+		return NULL;
+	for(value=line+10; value<line+len && (*value == ' ' || *value == '\t'); value++);
+	for(*valueLen=line+len-value; *valueLen>0 && (value[*valueLen-1] == '\r' || value[*valueLen-1] == '\n'); (*valueLen)--);
+	return value;
+}
+
+// first even channel not used by tracks or by SETUPs waiting for response
+IOTC_PRIVATE int interleavedFreeChannel(struct interleavedSession *is) {
+	int channel, i;
+	for(channel=0; ; channel+=2) {
+		for(i=0; i<is->trackCount && is->tracks[i].channel != channel; i++);
+		if(i < is->trackCount)
+			continue;
+		for(i=0; i<is->setupCount && is->setups[i].channel != channel; i++);
+		if(i == is->setupCount)
+			return channel;
+	}
+}
+
+// SETUP waiting for response with cseq, or asking channel if cseq is unknown, -1 if not found
+IOTC_PRIVATE int interleavedSetupFind(struct interleavedSession *is, int cseq, int channel) {
+	int i;
+	for(i=0; i<is->setupCount; i++)
+		if(cseq >= 0 ? is->setups[i].cseq == cseq : (channel >= 0 && is->setups[i].channel == channel))
+			return i;
+	return -1;
+}
+
+IOTC_PRIVATE void interleavedSetupRemove(struct interleavedSession *is, int i) {
+	memmove(&is->setups[i], &is->setups[i+1], sizeof(struct interleavedSetup)*(is->setupCount-i-1));
+	is->setupCount--;
+}
+
+// SETUP requests ask RTP/RTCP inside RTSP connection instead of UDP
+IOTC_PRIVATE int interleavedRequestLine(const char *header, int headerLen, const char *line, int len,
+		char *out, int outSize, void *userData) {
+	ConnectionInfo *conn = (ConnectionInfo *)userData;
+	struct interleavedSession *is = conn->interleaved;
+	struct interleavedSetup *setup;
+	int valueLen, clientPort, channel, n;
+	const char *value;
+	if(headerLen < 6 || strncmp(header, "SETUP ", 6) != 0 || (value = transportLineValue(line, len, &valueLen)) == NULL)
+		return -1;
+	// already interleaved (or multicast) requests and tracks over the limit are left unchanged
+	clientPort = rtspTransportPort(value, valueLen, "client_port");
+	if(clientPort == 0 || is->trackCount + is->setupCount >= INTERLEAVED_MAX_TRACKS)
+		return -1;
+	// every pipelined SETUP gets its own channel pair
+	channel = interleavedFreeChannel(is);
+	n = snprintf(out, outSize, "Transport: RTP/AVP/TCP;unicast;interleaved=%d-%d\r\n", channel, channel+1);
+	if(n >= outSize)
+		return -1;
+	setup = &is->setups[is->setupCount++];
+	setup->cseq = rtspGetCSeq(header, headerLen);
+	setup->channel = channel;
+	setup->clientPort = clientPort;
+	return n;
+}
+
+IOTC_PRIVATE void interleavedTrackClose(struct interleavedTrack *track) {
+	if(track->gsource > 0) {
+		g_source_remove(track->gsource);
+		track->gsource = 0;
+	}
+	if(track->rtpSock != -1) {
+		close(track->rtpSock);
+		track->rtpSock = -1;
+	}
+	if(track->rtcpSock != -1) {
+		close(track->rtcpSock);
+		track->rtcpSock = -1;
+	}
+}
+
+IOTC_PRIVATE void interleavedSessionFree(struct interleavedSession *is) {
+	int i;
+	for(i=0; i<is->trackCount; i++)
+		interleavedTrackClose(&is->tracks[i]);
+	free(is);
+}
+
+// RTCP sent by local client is put into RTSP connection as interleaved frame
+IOTC_PRIVATE gboolean interleavedRtcpCb(GIOChannel *source, GIOCondition condition, gpointer userData) {
+	struct interleavedTrack *track = (struct interleavedTrack *)userData;
+	ConnectionInfo *conn = track->conn;
+	char frame[BUFFER_LEN-3];
+	int readed = recv(track->rtcpSock, frame+4, sizeof(frame)-4, MSG_DONTWAIT);
+	if(readed <= 0)
+		return TRUE;
+	// a frame can be sent only between two requests, otherwise the report is lost
+	if(conn->rtspRequest == NULL || !rtspParserIdle(conn->rtspRequest) || *(conn->pendingSend)) {
+#ifdef DEBUG
+		printf("Interleaved: RTCP report of channel %d discarded\n", track->channel+1);
+#endif
+		return TRUE;
+	}
+	frame[0] = '$';
+	frame[1] = track->channel+1;
+	frame[2] = (unsigned char)(readed >> 8);
+	frame[3] = (unsigned char)readed;
+	iceSend(conn->iceAgent, conn->channel, readed+4, frame);
+	return TRUE;
+}
+
+// open local UDP sockets used to exchange RTP/RTCP of a track with local client
+IOTC_PRIVATE bool interleavedTrackOpen(struct interleavedTrack *track, ConnectionInfo *conn, int channel,
+		int clientPort, unsigned short *rtpPort, unsigned short *rtcpPort) {
+	struct sockaddr_in addr;
+	socklen_t addrLen = sizeof(struct sockaddr_in);
+	track->conn = conn;
+	track->channel = channel;
+	track->gsource = 0;
+	track->rtpSock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	track->rtcpSock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	addr.sin_family = AF_INET;
+	addr.sin_port = 0;
+	addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+	if(track->rtpSock == -1 || track->rtcpSock == -1 ||
+			bind(track->rtpSock, (struct sockaddr *)&addr, sizeof(struct sockaddr)) == -1 ||
+			getsockname(track->rtpSock, (struct sockaddr *)&addr, &addrLen) == -1) {
+#ifdef DEBUG
+		printf("Interleaved: cannot open RTP socket\n");
+#endif
+		interleavedTrackClose(track);
+		return false;
+	}
+	*rtpPort = ntohs(addr.sin_port);
+	// RTCP on next port as usual, or any port if it is busy
+	addr.sin_port = htons(*rtpPort+1);
+	if(bind(track->rtcpSock, (struct sockaddr *)&addr, sizeof(struct sockaddr)) == -1) {
+		addr.sin_port = 0;
+		if(bind(track->rtcpSock, (struct sockaddr *)&addr, sizeof(struct sockaddr)) == -1 ||
+				getsockname(track->rtcpSock, (struct sockaddr *)&addr, &addrLen) == -1) {
+#ifdef DEBUG
+			printf("Interleaved: cannot open RTCP socket\n");
+#endif
+			interleavedTrackClose(track);
+			return false;
+		}
+	}
+	*rtcpPort = ntohs(addr.sin_port);
+	track->rtpAddr.sin_family = AF_INET;
+	track->rtpAddr.sin_port = htons(clientPort);
+	track->rtpAddr.sin_addr.s_addr = inet_addr("127.0.0.1");
+	track->rtcpAddr = track->rtpAddr;
+	track->rtcpAddr.sin_port = htons(clientPort+1);
+
+	GIOChannel* ioChannel = g_io_channel_unix_new(track->rtcpSock);
+	track->gsource = g_io_add_watch(ioChannel, G_IO_IN, interleavedRtcpCb, track);
+	g_io_channel_unref(ioChannel);
+	return true;
+}
+
+// SETUP responses are turned back to UDP, using local sockets for RTP/RTCP of the track
+IOTC_PRIVATE int interleavedResponseLine(const char *header, int headerLen, const char *line, int len,
+		char *out, int outSize, void *userData) {
+	ConnectionInfo *conn = (ConnectionInfo *)userData;
+	struct interleavedSession *is = conn->interleaved;
+	struct interleavedTrack *track = &is->tracks[is->trackCount];
+	int valueLen, channel, clientPort, i, ssrcLen = 0, n;
+	unsigned short rtpPort, rtcpPort;
+	const char *value, *ssrc;
+	if(is->setupCount == 0 || is->trackCount == INTERLEAVED_MAX_TRACKS ||
+			(value = transportLineValue(line, len, &valueLen)) == NULL)
+		return -1;
+	// server did not accept interleaved transport
+	if((channel = rtspTransportChannel(value, valueLen)) < 0)
+		return -1;
+	// responses are matched by CSeq, by channel when CSeq follows Transport line
+	if((i = interleavedSetupFind(is, rtspGetCSeq(header, headerLen), channel)) < 0)
+		return -1;
+	clientPort = is->setups[i].clientPort;
+	interleavedSetupRemove(is, i);
+	if(!interleavedTrackOpen(track, conn, channel, clientPort, &rtpPort, &rtcpPort))
+		return -1;
+	// keep ssrc chosen by server
+	ssrc = g_strstr_len(value, valueLen, "ssrc=");
+	if(ssrc != NULL)
+		for(ssrcLen=0; ssrc+ssrcLen<value+valueLen && ssrc[ssrcLen] != ';'; ssrcLen++);
+	n = snprintf(out, outSize, "Transport: RTP/AVP;unicast;client_port=%d-%d;server_port=%d-%d%s%.*s\r\n",
+			clientPort, clientPort+1, rtpPort, rtcpPort,
+			ssrcLen > 0 ? ";" : "", ssrcLen, ssrcLen > 0 ? ssrc : "");
+	if(n >= outSize) {
+		interleavedTrackClose(track);
+		return -1;
+	}
+#ifdef DEBUG
+	printf("Interleaved: channel %d sent to local port %d\n", channel, clientPort);
+#endif
+	is->trackCount++;
+	return n;
+}
+
+IOTC_PRIVATE bool interleavedTakeChannel(int channel, void *userData) {
+	ConnectionInfo *conn = (ConnectionInfo *)userData;
+	int i;
+	for(i=0; i<conn->interleaved->trackCount; i++)
+		if(channel == conn->interleaved->tracks[i].channel || channel == conn->interleaved->tracks[i].channel+1)
+			return true;
+	return false;
+}
+
+IOTC_PRIVATE void interleavedFrame(int channel, const char *data, int len, void *userData) {
+	ConnectionInfo *conn = (ConnectionInfo *)userData;
+	struct interleavedTrack *track;
+	int i;
+	for(i=0; i<conn->interleaved->trackCount; i++) {
+		track = &conn->interleaved->tracks[i];
+		if(channel == track->channel)
+			sendto(track->rtpSock, data, len, 0, (struct sockaddr *)&(track->rtpAddr), sizeof(struct sockaddr));
+		else if(channel == track->channel+1)
+			sendto(track->rtcpSock, data, len, 0, (struct sockaddr *)&(track->rtcpAddr), sizeof(struct sockaddr));
+	}
+}
+
+// check a LAN host (4 bytes address + 2 bytes port, network order) is allowed by gateway rules
+IOTC_PRIVATE bool gatewayAllowed(const GatewayRule *rules, const char *host) {
+	in_addr_t addr;
+	unsigned short port;
+	memcpy(&addr, host, 4);
+	memcpy(&port, host+4, 2);
+	for(; rules!=NULL; rules=rules->next)
+		if((addr & rules->netmask) == (rules->network & rules->netmask) &&
+				(rules->port == 0 || rules->port == ntohs(port)))
+			return true;
+	return false;
+}
+
+// check an AF_UNIX socket is listed among the paths device lets clients reach
+IOTC_PRIVATE bool unixPathAllowed(const UnixPathRule *rules, const char *path) {
+	for(; rules!=NULL; rules=rules->next)
+		if(strcmp(rules->path, path) == 0)
+			return true;
+	return false;
+}
+
 IOTC_PRIVATE void niceRecvCb(NiceAgent *agent, guint streamId, guint componentId, guint len, gchar *buf, gpointer data) {
 	char *packet;
 	int ch, copyBytes = 0;
@@ -604,7 +1287,7 @@ IOTC_PRIVATE void niceRecvCb(NiceAgent *agent, guint streamId, guint componentId
 		if(iceAgent->timeout != NULL)
 			time(iceAgent->timeout);
 		if(ch == 0) { // control channel
-			int newCh;
+			int newCh, srcPort;
 			int action = packet[0];
 			char request[1]; // used for pong
 			switch(action) {
@@ -616,7 +1299,7 @@ IOTC_PRIVATE void niceRecvCb(NiceAgent *agent, guint streamId, guint componentId
 						return;
 					}
 					newCh = (int)packet[1];
-					if(newCh<=0 || ch>=ICE_MAX_CH) {
+					if(newCh<=0 || newCh>=ICE_MAX_CH) {
 #ifdef DEBUG
 						printf("Agent recv: tunnel mapping to invalid channel\n");
 #endif
@@ -628,7 +1311,7 @@ IOTC_PRIVATE void niceRecvCb(NiceAgent *agent, guint streamId, guint componentId
 #endif
 						return;
 					}
-					int srcPort = ((unsigned char)packet[3]) + (((unsigned int)packet[2])<<8);
+					srcPort = ((unsigned char)packet[3]) + (((unsigned int)packet[2])<<8);
 					int dstPort = ((unsigned char)packet[5]) + (((unsigned int)packet[4])<<8);
 					int proto = packet[6];
 					// init dest sockaddr
@@ -643,13 +1326,83 @@ IOTC_PRIVATE void niceRecvCb(NiceAgent *agent, guint streamId, guint componentId
 					conns[newCh].channel = newCh;
 					conns[newCh].proto = proto;
 					conns[newCh].agent = agent;
-					initSocket(&(conns[newCh]));
+					// let client know this channel is unusable (it could be kept in a pool)
+					if(!initSocket(&(conns[newCh])))
+						closeChannelAndSocket(&conns[newCh], true);
+				break;
+				case P2P_TUNNEL_MAP_EX:
+					if(iceAgent->packetSize<7 || iceAgent->packetSize<7+(unsigned char)packet[6]) {
+#ifdef DEBUG
+						printf("Agent recv: not enough arguments to start a tunnel mapping\n");
+#endif
+						return;
+					}
+					newCh = (int)packet[1];
+					if(newCh<=0 || newCh>=ICE_MAX_CH || conns[newCh].sock != -1) {
+#ifdef DEBUG
+						printf("Agent recv: tunnel mapping to invalid channel\n");
+#endif
+						return;
+					}
+					conns[newCh].channel = newCh;
+					conns[newCh].proto = packet[4];
+					conns[newCh].agent = agent;
+					srcPort = ((unsigned char)packet[3]) + (((unsigned int)packet[2])<<8);
+					conns[newCh].srcAddr.sin_family = AF_INET;
+					conns[newCh].srcAddr.sin_port = htons(srcPort);
+					conns[newCh].srcAddr.sin_addr.s_addr = INADDR_ANY;
+					if(packet[5] == P2P_ENDPOINT_HOST) {
+						if(packet[6] != 6 || !gatewayAllowed(iceAgent->gateway, packet+7)) {
+#ifdef DEBUG
+							printf("Agent recv: tunnel mapping to host not allowed\n");
+#endif
+							closeChannelAndSocket(&conns[newCh], true);
+							break;
+						}
+						conns[newCh].dstAddr.sin_family = AF_INET;
+						memcpy(&(conns[newCh].dstAddr.sin_addr.s_addr), packet+7, 4);
+						memcpy(&(conns[newCh].dstAddr.sin_port), packet+11, 2);
+						if(!initSocket(&(conns[newCh])))
+							closeChannelAndSocket(&conns[newCh], true);
+						break;
+					}
+					if(packet[5] != P2P_ENDPOINT_UNIX || (unsigned char)packet[6] == 0 ||
+							(unsigned char)packet[6] >= sizeof(((struct sockaddr_un *)NULL)->sun_path) ||
+							(conns[newCh].proto != P2P_TCP && conns[newCh].proto != P2P_RTSP)) {
+#ifdef DEBUG
+						printf("Agent recv: tunnel mapping to unsupported endpoint\n");
+#endif
+						closeChannelAndSocket(&conns[newCh], true);
+						break;
+					}
+					conns[newCh].unixPath = g_strndup(packet+7, (unsigned char)packet[6]);
+					if(!unixPathAllowed(iceAgent->unixPaths, conns[newCh].unixPath)) {
+#ifdef DEBUG
+						printf("Agent recv: tunnel mapping to path %s not allowed\n", conns[newCh].unixPath);
+#endif
+						closeChannelAndSocket(&conns[newCh], true);
+						break;
+					}
+					if(!initSocket(&(conns[newCh])))
+						closeChannelAndSocket(&conns[newCh], true);
 				break;
 				case P2P_TUNNEL_SHUT:
 #ifdef DEBUG
 					printf("[DEBUG] Received tunnel shut\n");
 #endif
 					newCh = (int)packet[1];
+					if(newCh<=0 || newCh>=ICE_MAX_CH) {
+#ifdef DEBUG
+						printf("Agent recv: tunnel shut of invalid channel\n");
+#endif
+						break;
+					}
+					// device closed a pre-opened channel: release it and open another one later
+					if(conns[newCh].pool != NULL) {
+						poolRefillLater(conns[newCh].pool);
+						conns[newCh].pool = NULL;
+						break;
+					}
 					closeChannelAndSocket(&conns[newCh], false);
 //					shutdown(conns[newCh].sock, SHUT_WR);
 //					close(conns[newCh].sock);
@@ -681,69 +1434,45 @@ IOTC_PRIVATE void niceRecvCb(NiceAgent *agent, guint streamId, guint componentId
 #endif
 				break;
 			}
+		} else if(ch>0 && ch<ICE_MAX_CH && conns[ch].local != NULL) {
+			// in-process channel: application reads packet in place, no socket involved
+			conns[ch].local->onData(ch, packet, iceAgent->packetSize, conns[ch].local->userData);
+		} else if(ch>0 && ch<ICE_MAX_CH && conns[ch].pool != NULL) {
+			// server spoke before any local connection has been bound to this pre-opened channel
+#ifdef DEBUG
+			printf("Agent recv: data on unused pool channel %d discarded\n", ch);
+#endif
 		} else if(ch>0 && ch<ICE_MAX_CH) { // one of communications channels
+			// data to write on socket, changed by rewrite of interleaved mode
+			char *payload = packet;
+			int payloadLen = iceAgent->packetSize;
+			char rewritten[conns[ch].interleaved != NULL ? iceAgent->packetSize+RTSP_REWRITE_SPACE : 1];
 			if(conns[ch].sock == -1) {
 				initSocket(&(conns[ch]));
 			}
 			sent = 0;
-			// if it is RTSP do packet inspection
+			// if it is RTSP do stream inspection
 			if(conns[ch].proto == P2P_RTSP) {
 #ifdef DEBUG
 				printf("Received %d RTSP: %.*s", iceAgent->packetSize, iceAgent->packetSize, packet);
 #endif
-				// to permit strstr to not read over the end of packet (because it is not null
-				// null terminated) replace last character with \0, so it can be consider
-				// as a string
-				char lastChar = packet[iceAgent->packetSize-1];
-				packet[iceAgent->packetSize-1] = '\0';
-				// when server send client and server port for RTP
-				if(strstr(packet, "client_port=") != NULL && strstr(packet, "server_port=") != NULL) {
-					char *rtpClientPort = strstr(packet, "client_port=");
-					char *rtpServerPort = strstr(packet, "server_port=");
-					rtpClientPort += 12;
-					rtpServerPort += 12;
-					int i=0, j=0;
-					// just a check to control string has expected syntax
-					while(rtpClientPort[i] != '\0' && rtpClientPort[i] != ';'
-							&& rtpClientPort[i] != '-') {
-						i++;
-					}
-					while(rtpServerPort[j] != '\0' && rtpServerPort[j] != ';'
-							&& rtpServerPort[j] != '-') {
-						j++;
-					}
-					if(i != 0 && j != 0) {
-						int cliPort = atoi(rtpClientPort);
-						int srvPort = atoi(rtpServerPort);
-#ifdef DEBUG
-						printf("Open new RTP connections on ports %d-%d %d-%d\n", cliPort, srvPort, cliPort+1, srvPort+1);
-#endif
-						// open portMap and save RTP channel for deallocation
-						struct connectionList *rtpCh = (struct connectionList *)malloc(sizeof(struct connectionList));
-#ifdef DEBUG
-						if(rtpCh == NULL)
-							printf("Malloc error: rtpCh\n");
-#endif
-						rtpCh->value = &conns[portMapInternal(iceAgent, cliPort, srvPort, P2P_UDP)];
-						rtpCh->next = conns[ch].rtpChList;
-						conns[ch].rtpChList = rtpCh;
-
-						rtpCh  = (struct connectionList *)malloc(sizeof(struct connectionList));
-#ifdef DEBUG
-						if(rtpCh == NULL)
-							printf("Malloc error: rtpCh2\n");
-#endif
-						rtpCh->value = &conns[portMapInternal(iceAgent, cliPort+1, srvPort+1, P2P_UDP)];
-						rtpCh->next = conns[ch].rtpChList;
-						conns[ch].rtpChList = rtpCh;
-					}
+				// RTP/RTCP are taken out of the stream and sent to local sockets
+				if(conns[ch].interleaved != NULL) {
+					payloadLen = rtspParserRewrite(conns[ch].rtspResponse, packet, iceAgent->packetSize,
+							rewritten, sizeof(rewritten));
+					payload = rewritten;
+				// messages sent by server are inspected to open RTP channels on SETUP responses
+				} else if(conns[ch].rtspResponse != NULL) {
+					rtspParserFeed(conns[ch].rtspResponse, packet, iceAgent->packetSize);
 				}
-				// put character back
-				packet[iceAgent->packetSize-1] = lastChar;
 			}
 
-			while(sent < iceAgent->packetSize) {
-				err = sendto(conns[ch].sock, packet+sent, iceAgent->packetSize-sent, 0, (struct sockaddr *)&(conns[ch].dstAddr), sizeof(struct sockaddr));
+			while(sent < payloadLen) {
+				// connected AF_UNIX sockets refuse a destination address
+				if(conns[ch].proto == P2P_UDP)
+					err = sendto(conns[ch].sock, payload+sent, payloadLen-sent, 0, (struct sockaddr *)&(conns[ch].dstAddr), sizeof(struct sockaddr));
+				else
+					err = send(conns[ch].sock, payload+sent, payloadLen-sent, 0);
 				if(err == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
 #ifdef DEBUG
 					printf("Socket send error: EAGAIN\n");
@@ -789,13 +1518,19 @@ IOTC_PRIVATE void niceRecvCb(NiceAgent *agent, guint streamId, guint componentId
 					sent += err;
 #ifdef DEBUG
 					sentSocket += err;
-					if(sent < iceAgent->packetSize)
+					if(sent < payloadLen)
 						printf("Socket send error: partially sent [%ld] [%ld]\n", err, sentSocket);
 					else
 						printf("Socket send: sent [%ld] [%ld]\n", err, sentSocket);
 #endif
 				}
 			}
+			// copy RTP/RTCP to the other local consumers of a shared stream
+			if(conns[ch].sock != -1 && conns[ch].extraDst != NULL) {
+				struct addressList *d;
+				for(d=conns[ch].extraDst; d!=NULL; d=d->next)
+					sendto(conns[ch].sock, packet, iceAgent->packetSize, 0, (struct sockaddr *)&(d->addr), sizeof(struct sockaddr));
+			}
 		} else { // invalid channel
 #ifdef DEBUG
 			printf("Agent recv channel invalid\n");
@@ -806,6 +1541,7 @@ IOTC_PRIVATE void niceRecvCb(NiceAgent *agent, guint streamId, guint componentId
 
 IceAgent *iceNew(IotcCtx *ctx, GMainLoop *gloop,
 		const char *host, int port, const char *turnUser, const char *turnPassword,
+		const CandidatePolicy *policy,
 		void (*onReady)(IotcCtx *ctx, IceAgent *, char *, void *),
 		void (*onStatusChanged)(IotcCtx *ctx, IceAgent *, const char *, void *, ConnectionType, char *),
 		void *userData) {
@@ -858,6 +1594,10 @@ IceAgent *iceNew(IotcCtx *ctx, GMainLoop *gloop,
 	iceAgent->packetSize = 0;
 	iceAgent->timeout = NULL;
 	iceAgent->socketServiceList = NULL;
+	iceAgent->policy = iceCandidatePolicyDup(policy);
+	memset(&iceAgent->stats, 0, sizeof(CandidateStats));
+	iceAgent->gateway = NULL;
+	iceAgent->unixPaths = NULL;
 	// ConnectionInfo intiliazation
 	conns = (ConnectionInfo *)malloc(sizeof(ConnectionInfo)*ICE_MAX_CH);
 #ifdef DEBUG
@@ -879,6 +1619,15 @@ IceAgent *iceNew(IotcCtx *ctx, GMainLoop *gloop,
 #endif
 		conns[i].unsentBytes = 0;
 		conns[i].rtpChList = NULL;
+		conns[i].pool = NULL;
+		conns[i].fanout = NULL;
+		conns[i].extraDst = NULL;
+		conns[i].rtspRequest = NULL;
+		conns[i].rtspResponse = NULL;
+		conns[i].interleaved = NULL;
+		conns[i].local = NULL;
+		conns[i].unixPath = NULL;
+		conns[i].iceAgent = iceAgent;
 	}
 	iceAgent->conns = conns;
 
@@ -905,13 +1654,19 @@ IceAgent *iceNew(IotcCtx *ctx, GMainLoop *gloop,
 	}
 
 	// For each component add turn info needed. Now we have just 1 component...
-	if(!nice_agent_set_relay_info(agent, streamId, 1, host, port, turnUser, turnPassword, NICE_RELAY_TYPE_TURN_UDP)) {
+	// (relay is not allocated at all when policy does not allow it)
+	if((iceAgent->policy == NULL || iceAgent->policy->relayMode != RELAY_NONE) &&
+			!nice_agent_set_relay_info(agent, streamId, 1, host, port, turnUser, turnPassword, NICE_RELAY_TYPE_TURN_UDP)) {
 #ifdef DEBUG
 		printf("Invalid turn address for ICE agent\n");
 #endif
 		g_object_unref(agent);
 		return NULL;
 	}
+	if(iceAgent->policy != NULL && iceAgent->policy->relayMode == RELAY_ONLY &&
+			g_object_class_find_property(G_OBJECT_GET_CLASS(agent), "force-relay") != NULL)
+		g_object_set(G_OBJECT(agent), "force-relay", TRUE, NULL);
+	applyInterfacePolicy(iceAgent);
 
 	// Start gather candidates. It is an async call, but local candidates are found immediatly or
 	// an error occurred
@@ -1012,6 +1767,11 @@ bool iceSetRemoteSdp(IceAgent *iceAgent, const char *remoteSdp) {
 			remoteCandidates = g_slist_prepend(remoteCandidates, cand);
 		}
 	}
+	int pruned, received = g_slist_length(remoteCandidates);
+	remoteCandidates = filterCandidates(iceAgent->policy, remoteCandidates, false, &pruned);
+	iceAgent->stats.remotePruned = pruned;
+	iceAgent->stats.remoteAccepted = received - pruned;
+	updatePairsPruned(iceAgent);
 	if(!ufrag || !password || !remoteCandidates ||
 		(!nice_agent_set_remote_credentials(agent, 1, ufrag, password)) ||
 		(nice_agent_set_remote_candidates(agent, 1, 1, remoteCandidates) < 1)) {
@@ -1044,44 +1804,183 @@ int iceSend(IceAgent *iceAgent, char channel, int msgLen, char *msg) {
 	return 0;
 }
 
-gboolean socketListenCb(GSocketService *service, GSocketConnection *connection, GObject *sourceObject, gpointer userData) {
+bool iceGetCandidateStats(IceAgent *iceAgent, CandidateStats *stats) {
+	if(iceAgent == NULL || stats == NULL)
+		return false;
+	memcpy(stats, &iceAgent->stats, sizeof(CandidateStats));
+	return true;
+}
+
+CandidatePolicy *iceCandidatePolicyDup(const CandidatePolicy *policy) {
+	if(policy == NULL)
+		return NULL;
+	CandidatePolicy *copy = (CandidatePolicy *)malloc(sizeof(CandidatePolicy));
+	if(copy == NULL) {
 #ifdef DEBUG
-	printf("Socket server new incoming connection\n");
+		printf("Malloc error: policy\n");
 #endif
-	struct iceAgentClient *iac = (struct iceAgentClient *)userData;
-	IceAgent *iceAgent = iac->iceAgent;
+		return NULL;
+	}
+	memcpy(copy, policy, sizeof(CandidatePolicy));
+	copy->interfaceAllow = g_strdupv(policy->interfaceAllow);
+	copy->interfaceDeny = g_strdupv(policy->interfaceDeny);
+	return copy;
+}
+
+void iceCandidatePolicyFree(CandidatePolicy *policy) {
+	if(policy == NULL)
+		return;
+	g_strfreev(policy->interfaceAllow);
+	g_strfreev(policy->interfaceDeny);
+	free(policy);
+}
+
+// find first free channel, channels reserved by a pool or in-process are not free. Returns ICE_MAX_CH if none
+IOTC_PRIVATE int findFreeChannel(IceAgent *iceAgent) {
 	int i;
-	// find first free channel
 	for(i=1; i<ICE_MAX_CH; i++)
-		if(iceAgent->conns[i].sock == -1)
+		if(iceAgent->conns[i].sock == -1 && iceAgent->conns[i].pool == NULL && iceAgent->conns[i].local == NULL)
 			break;
-	// no free channel found
-	if(i == ICE_MAX_CH) {
+	return i;
+}
+
+// ask device to map channel ch on remotePort, returns false if request cannot be sent
+IOTC_PRIVATE bool sendMapRequest(IceAgent *iceAgent, int ch, unsigned short localPort,
+		unsigned short remotePort, TunnelProtocols proto) {
+	char request[7];
+	request[0] = P2P_TUNNEL_MAP;
+	request[1] = ch;
+	request[2] = (unsigned char)(localPort >> 8);
+	request[3] = (unsigned char)localPort;
+	request[4] = (unsigned char)(remotePort >> 8);
+	request[5] = (unsigned char)remotePort;
+	request[6] = proto;
+	if(iceSend(iceAgent, 0, 7, request) < 7) {
 #ifdef DEBUG
-		printf("ICE client cannot find a free channel\n");
+		printf("ICE client cannot require map on device\n");
 #endif
 		return false;
 	}
-	char *request = malloc(7);
+	return true;
+}
+
+// ask device to map channel ch on an endpoint of given type, returns false if request cannot be sent
+IOTC_PRIVATE bool sendMapExRequest(IceAgent *iceAgent, int ch, unsigned short localPort,
+		TunnelProtocols proto, p2pEndpointTypes type, const char *value, int len) {
+	char request[7+len];
+	request[0] = P2P_TUNNEL_MAP_EX;
+	request[1] = ch;
+	request[2] = (unsigned char)(localPort >> 8);
+	request[3] = (unsigned char)localPort;
+	request[4] = proto;
+	request[5] = type;
+	request[6] = len;
+	memcpy(request+7, value, len);
+	if(iceSend(iceAgent, 0, 7+len, request) < 7+len) {
 #ifdef DEBUG
-	if(request == NULL)
-		printf("Malloc error: request2\n");
+		printf("ICE client cannot require map on device\n");
 #endif
-	request[0] = P2P_TUNNEL_MAP;
-	request[1] = i;
-	request[2] = (unsigned char)(iac->localPort >> 8);
-	request[3] = (unsigned char)iac->localPort;
-	request[4] = (unsigned char)(iac->remotePort >> 8);
-	request[5] = (unsigned char)iac->remotePort;
-	request[6] = iac->proto;
-	if(iceSend(iceAgent, 0, 7, request) < 7) {
+		return false;
+	}
+	return true;
+}
+
+// ask device to map channel ch on the service of iac
+IOTC_PRIVATE bool sendClientMapRequest(struct iceAgentClient *iac, int ch) {
+	char host[6];
+	if(iac->remotePath != NULL)
+		return sendMapExRequest(iac->iceAgent, ch, iac->localPort, iac->proto, P2P_ENDPOINT_UNIX,
+				iac->remotePath, strlen(iac->remotePath));
+	if(iac->remoteHost != 0) {
+		unsigned short port = htons(iac->remotePort);
+		memcpy(host, &(iac->remoteHost), 4);
+		memcpy(host+4, &port, 2);
+		return sendMapExRequest(iac->iceAgent, ch, iac->localPort, iac->proto, P2P_ENDPOINT_HOST, host, 6);
+	}
+	return sendMapRequest(iac->iceAgent, ch, iac->localPort, iac->remotePort, iac->proto);
+}
+
+// map channels in advance until the pool of iac has poolSize unused channels
+IOTC_PRIVATE void poolFill(struct iceAgentClient *iac) {
+	IceAgent *iceAgent = iac->iceAgent;
+	int i, idle = 0;
+	for(i=1; i<ICE_MAX_CH; i++)
+		if(iceAgent->conns[i].pool == iac)
+			idle++;
+	while(idle < iac->poolSize) {
+		i = findFreeChannel(iceAgent);
+		if(i == ICE_MAX_CH) {
 #ifdef DEBUG
-		printf("ICE client cannot require map on device\n");
+			printf("ICE client cannot find a free channel for pool\n");
 #endif
-		free(request);
-		return FALSE;
+			return;
+		}
+		if(!sendClientMapRequest(iac, i))
+			return;
+		iceAgent->conns[i].channel = i;
+		iceAgent->conns[i].proto = iac->proto;
+		iceAgent->conns[i].agent = iceAgent->agent;
+		iceAgent->conns[i].pool = iac;
+		idle++;
+	}
+}
+
+IOTC_PRIVATE gboolean poolRefillCb(gpointer userData) {
+	struct iceAgentClient *iac = (struct iceAgentClient *)userData;
+	iac->poolRefillSource = 0;
+	poolFill(iac);
+	return G_SOURCE_REMOVE;
+}
+
+// refill is delayed to not loop on a device service that keeps refusing connections
+IOTC_PRIVATE void poolRefillLater(struct iceAgentClient *iac) {
+	if(iac->poolRefillSource == 0)
+		iac->poolRefillSource = g_timeout_add_seconds(ICE_POOL_REFILL_DELAY, poolRefillCb, iac);
+}
+
+// forget channels pre-opened for iac, used before iac is freed
+IOTC_PRIVATE void poolDrain(struct iceAgentClient *iac) {
+	IceAgent *iceAgent = iac->iceAgent;
+	int i;
+	if(iac->poolRefillSource > 0) {
+		g_source_remove(iac->poolRefillSource);
+		iac->poolRefillSource = 0;
+	}
+	if(iceAgent->conns == NULL)
+		return;
+	for(i=1; i<ICE_MAX_CH; i++)
+		if(iceAgent->conns[i].pool == iac)
+			iceAgent->conns[i].pool = NULL;
+}
+
+// take a channel for a new local connection of iac (from its pool or mapping a free one), returns ICE_MAX_CH if none
+IOTC_PRIVATE int takeChannel(struct iceAgentClient *iac) {
+	IceAgent *iceAgent = iac->iceAgent;
+	int i;
+	// use a channel already opened by the pool if any
+	for(i=1; i<ICE_MAX_CH; i++)
+		if(iceAgent->conns[i].pool == iac)
+			break;
+	if(i < ICE_MAX_CH) {
+		iceAgent->conns[i].pool = NULL;
+		return i;
+	}
+	i = findFreeChannel(iceAgent);
+	// no free channel found
+	if(i == ICE_MAX_CH) {
+#ifdef DEBUG
+		printf("ICE client cannot find a free channel\n");
+#endif
+		return ICE_MAX_CH;
 	}
-	free(request);
+	if(!sendClientMapRequest(iac, i))
+		return ICE_MAX_CH;
+	return i;
+}
+
+// bind a local connection to channel i already mapped on device
+IOTC_PRIVATE void bindChannel(struct iceAgentClient *iac, int i, GSocketConnection *connection) {
+	IceAgent *iceAgent = iac->iceAgent;
 	//source addr is useless...
 	iceAgent->conns[i].srcAddr.sin_family = AF_INET;
 	iceAgent->conns[i].srcAddr.sin_port = htons(iac->localPort);
@@ -1096,25 +1995,604 @@ gboolean socketListenCb(GSocketService *service, GSocketConnection *connection,
 	iceAgent->conns[i].agent = iac->iceAgent->agent;
 	g_object_ref(connection);
 	iceAgent->conns[i].connection = connection;
+	if(iac->proto == P2P_RTSP) {
+		iceAgent->conns[i].rtspRequest = rtspParserNew(rtspRequestHeaderCb, NULL, &(iceAgent->conns[i]));
+		iceAgent->conns[i].rtspResponse = rtspParserNew(rtspResponseHeaderCb, rtspResponseBodyCb,
+				&(iceAgent->conns[i]));
+	}
+	if(iac->interleave && iceAgent->conns[i].rtspRequest != NULL && iceAgent->conns[i].rtspResponse != NULL) {
+		iceAgent->conns[i].interleaved = (struct interleavedSession *)malloc(sizeof(struct interleavedSession));
+		if(iceAgent->conns[i].interleaved != NULL)
+			memset(iceAgent->conns[i].interleaved, 0, sizeof(struct interleavedSession));
+		// without rewrite buffers connection goes on with RTP over UDP channels
+		if(iceAgent->conns[i].interleaved == NULL ||
+				!rtspParserSetRewrite(iceAgent->conns[i].rtspRequest, interleavedRequestLine, NULL, NULL) ||
+				!rtspParserSetRewrite(iceAgent->conns[i].rtspResponse, interleavedResponseLine,
+						interleavedTakeChannel, interleavedFrame)) {
+#ifdef DEBUG
+			printf("Interleaved mode not available on channel %d\n", i);
+#endif
+			if(iceAgent->conns[i].interleaved != NULL)
+				free(iceAgent->conns[i].interleaved);
+			iceAgent->conns[i].interleaved = NULL;
+		}
+	}
 
 	// Init listen callback
 	GIOChannel* channel = g_io_channel_unix_new(iceAgent->conns[i].sock);
 	iceAgent->conns[i].gsource = g_io_add_watch(channel, G_IO_IN, (GIOFunc)socketRecvCb,
 			&(iceAgent->conns[i]));
 	g_io_channel_unref(channel);
+}
+
+IOTC_PRIVATE void freeAddressList(struct addressList *l) {
+	while(l != NULL) {
+		struct addressList *next = l->next;
+		free(l);
+		l = next;
+	}
+}
+
+IOTC_PRIVATE void fanoutAddDestination(ConnectionInfo *conn, unsigned short port) {
+	struct addressList *l;
+	for(l=conn->extraDst; l!=NULL; l=l->next)
+		if(ntohs(l->addr.sin_port) == port)
+			return;
+	l = (struct addressList *)malloc(sizeof(struct addressList));
+	if(l == NULL) {
+#ifdef DEBUG
+		printf("Malloc error: extraDst\n");
+#endif
+		return;
+	}
+	l->addr.sin_family = AF_INET;
+	l->addr.sin_port = htons(port);
+	l->addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+	l->next = conn->extraDst;
+	conn->extraDst = l;
+}
+
+IOTC_PRIVATE void fanoutRemoveDestination(ConnectionInfo *conn, unsigned short port) {
+	struct addressList **l;
+	for(l=&conn->extraDst; *l!=NULL; l=&(*l)->next) {
+		if(ntohs((*l)->addr.sin_port) == port) {
+			struct addressList *elem = *l;
+			*l = elem->next;
+			free(elem);
+			return;
+		}
+	}
+}
+
+// check RTP channels of the track have not been closed (and maybe reused) in the meantime
+IOTC_PRIVATE bool fanoutTrackValid(struct fanoutTrack *track) {
+	return track->rtp->sock != -1 && ntohs(track->rtp->srcAddr.sin_port) == track->serverPort &&
+			track->rtcp->sock != -1 && ntohs(track->rtcp->srcAddr.sin_port) == track->serverPort+1;
+}
+
+// start or stop copying RTP/RTCP of all tracks set up by consumer
+IOTC_PRIVATE void fanoutConsumerPlay(struct fanoutConsumer *c, bool play) {
+	struct fanoutSession *fs = c->session;
+	int i;
+	for(i=0; i<fs->trackCount; i++) {
+		if(c->clientPort[i] == 0 || !fanoutTrackValid(&fs->tracks[i]))
+			continue;
+		if(play) {
+			fanoutAddDestination(fs->tracks[i].rtp, c->clientPort[i]);
+			fanoutAddDestination(fs->tracks[i].rtcp, c->clientPort[i]+1);
+		} else {
+			fanoutRemoveDestination(fs->tracks[i].rtp, c->clientPort[i]);
+			fanoutRemoveDestination(fs->tracks[i].rtcp, c->clientPort[i]+1);
+		}
+	}
+	c->playing = play;
+}
+
+IOTC_PRIVATE void fanoutConsumerFree(struct fanoutConsumer *c) {
+	struct fanoutConsumer **l;
+	for(l=&c->session->consumers; *l!=NULL; l=&(*l)->next) {
+		if(*l == c) {
+			*l = c->next;
+			break;
+		}
+	}
+	fanoutConsumerPlay(c, false);
+	if(c->gsource > 0)
+		g_source_remove(c->gsource);
+	if(c->sendSource > 0)
+		g_source_remove(c->sendSource);
+	if(c->pending != NULL)
+		g_string_free(c->pending, TRUE);
+	free(c->buffer);
+	// channel bound to this connection (if any) keeps its own reference
+	g_object_unref(c->connection);
+	free(c);
+}
+
+// close all consumers sharing the stream of primary connection, used when primary connection is closed
+IOTC_PRIVATE void fanoutSessionReset(struct fanoutSession *fs) {
+	while(fs->consumers != NULL)
+		fanoutConsumerFree(fs->consumers);
+	if(fs->primary != NULL) {
+		fs->primary->fanout = NULL;
+		fs->primary = NULL;
+	}
+	if(fs->describe != NULL) {
+		free(fs->describe);
+		fs->describe = NULL;
+	}
+	fs->describeLen = 0;
+	fs->describeSize = 0;
+	fs->url[0] = '\0';
+	fs->setupUrl[0] = '\0';
+	fs->trackCount = 0;
+}
+
+// requests sent by primary connection to device
+IOTC_PRIVATE void fanoutInspectRequest(struct fanoutSession *fs, const char *msg, int len) {
+	char method[16], url[FANOUT_URL_LEN];
+	if(!rtspGetRequestLine(msg, len, method, sizeof(method), url, sizeof(url)))
+		return;
+	if(strcmp(method, "DESCRIBE") == 0 && fs->url[0] == '\0')
+		strcpy(fs->url, url);
+	else if(strcmp(method, "SETUP") == 0)
+		strcpy(fs->setupUrl, url);
+}
+
+// responses sent by device to primary connection, DESCRIBE response is kept for other consumers
+IOTC_PRIVATE void fanoutResponseHeader(struct fanoutSession *fs, const char *header, int len) {
+	int typeLen;
+	const char *type;
+	if(fs->describe != NULL || fs->url[0] == '\0' || len < 12 || strncmp(header, "RTSP/1.0 200", 12) != 0)
+		return;
+	type = rtspGetHeader(header, len, "Content-Type", &typeLen);
+	if(type == NULL || typeLen < 15 || strncasecmp(type, "application/sdp", 15) != 0)
+		return;
+	fs->describeSize = len + rtspContentLength(header, len);
+	if(fs->describeSize > FANOUT_MAX_DESCRIBE) {
+#ifdef DEBUG
+		printf("Fan-out: DESCRIBE response too big to be shared\n");
+#endif
+		fs->describeSize = 0;
+		return;
+	}
+	fs->describe = (char *)malloc(fs->describeSize);
+	if(fs->describe == NULL) {
+#ifdef DEBUG
+		printf("Malloc error: describe\n");
+#endif
+		fs->describeSize = 0;
+		return;
+	}
+	memcpy(fs->describe, header, len);
+	fs->describeLen = len;
+}
+
+IOTC_PRIVATE void fanoutResponseBody(struct fanoutSession *fs, const char *data, int len) {
+	// body of DESCRIBE response being kept
+	if(fs->describe != NULL && fs->describeLen < fs->describeSize) {
+		int n = len < (fs->describeSize-fs->describeLen) ? len : (fs->describeSize-fs->describeLen);
+		memcpy(fs->describe+fs->describeLen, data, n);
+		fs->describeLen += n;
+	}
+}
 
+// a SETUP of primary connection opened RTP channels for the last SETUP url
+IOTC_PRIVATE void fanoutAddTrack(struct fanoutSession *fs, ConnectionInfo *rtp, ConnectionInfo *rtcp,
+		unsigned short serverPort) {
+	if(fs->trackCount == FANOUT_MAX_TRACKS)
+		return;
+	strcpy(fs->tracks[fs->trackCount].url, fs->setupUrl);
+	fs->tracks[fs->trackCount].rtp = rtp;
+	fs->tracks[fs->trackCount].rtcp = rtcp;
+	fs->tracks[fs->trackCount].serverPort = serverPort;
+	fs->trackCount++;
+	fs->setupUrl[0] = '\0';
+}
+
+IOTC_PRIVATE void fanoutDetach(struct fanoutConsumer *c, int offset);
+
+// send responses queued for consumer, returns false if consumer must be released
+IOTC_PRIVATE bool fanoutFlush(struct fanoutConsumer *c) {
+	int err;
+	while(c->pending->len > 0) {
+		err = send(c->sock, c->pending->str, c->pending->len, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if(err == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return true;
+		if(err == -1) {
+#ifdef DEBUG
+			printf("Fan-out: cannot send response to consumer\n");
+#endif
+			return false;
+		}
+		g_string_erase(c->pending, 0, err);
+	}
+	return true;
+}
+
+IOTC_PRIVATE gboolean fanoutConsumerSendCb(GIOChannel *source, GIOCondition condition, gpointer userData) {
+	struct fanoutConsumer *c = (struct fanoutConsumer *)userData;
+	if(!fanoutFlush(c) || (condition & (G_IO_HUP | G_IO_ERR))) {
+		c->sendSource = 0;
+		fanoutConsumerFree(c);
+		return FALSE;
+	}
+	if(c->pending->len > 0)
+		return TRUE;
+	c->sendSource = 0;
+	// consumer waiting for its responses before going to device
+	if(c->detach && c->gsource == 0)
+		fanoutDetach(c, c->detachOffset);
+	return FALSE;
+}
+
+// responses are queued behind the ones socket did not accept yet, never waiting on main loop
+IOTC_PRIVATE bool fanoutReply(struct fanoutConsumer *c, const char *status, int cseq, const char *headers,
+		const char *body, int bodyLen) {
+	char *header = g_strdup_printf("RTSP/1.0 %s\r\nCSeq: %d\r\n%s\r\n", status, cseq, headers);
+	if(c->pending == NULL)
+		c->pending = g_string_new(NULL);
+	g_string_append(c->pending, header);
+	g_free(header);
+	if(body != NULL)
+		g_string_append_len(c->pending, body, bodyLen);
+	if(c->pending->len > FANOUT_MAX_PENDING) {
+#ifdef DEBUG
+		printf("Fan-out: consumer is not reading responses\n");
+#endif
+		return false;
+	}
+	if(c->sendSource > 0)
+		return true;
+	if(!fanoutFlush(c))
+		return false;
+	if(c->pending->len > 0) {
+		GIOChannel* channel = g_io_channel_unix_new(c->sock);
+		c->sendSource = g_io_add_watch(channel, G_IO_OUT | G_IO_HUP | G_IO_ERR, fanoutConsumerSendCb, c);
+		g_io_channel_unref(channel);
+	}
+	return true;
+}
+
+// serve a request of a consumer, returns false if consumer must be released
+IOTC_PRIVATE bool fanoutHandleRequest(struct fanoutConsumer *c, const char *msg, int len) {
+	struct fanoutSession *fs = c->session;
+	char method[16], url[FANOUT_URL_LEN];
+	char *headers;
+	bool ret;
+	int i, cseq = rtspGetCSeq(msg, len);
+	if(!rtspGetRequestLine(msg, len, method, sizeof(method), url, sizeof(url)))
+		return fanoutReply(c, "400 Bad Request", cseq, "", NULL, 0);
+#ifdef DEBUG
+	printf("Fan-out: %s %s served locally\n", method, url);
+#endif
+	if(strcmp(method, "OPTIONS") == 0) {
+		return fanoutReply(c, "200 OK", cseq,
+				"Public: OPTIONS, DESCRIBE, SETUP, PLAY, PAUSE, TEARDOWN, GET_PARAMETER, SET_PARAMETER\r\n",
+				NULL, 0);
+	} else if(strcmp(method, "DESCRIBE") == 0) {
+		// another stream: it is not shared, so it gets its own channel
+		if(!rtspSameUrl(url, fs->url)) {
+			c->detach = true;
+			return false;
+		}
+		int headerLen = rtspHeaderLength(fs->describe, fs->describeLen);
+		GString *cached = g_string_new(NULL);
+		// reuse headers of primary response, but the status line and CSeq
+		for(i=0; fs->describe[i] != '\n'; i++);
+		for(i++; i<headerLen-2; i++) {
+			int j;
+			for(j=i; j<headerLen && fs->describe[j] != '\n'; j++);
+			if(strncasecmp(fs->describe+i, "CSeq:", 5) != 0)
+				g_string_append_len(cached, fs->describe+i, j-i+1);
+			i = j;
+		}
+		ret = fanoutReply(c, "200 OK", cseq, cached->str, fs->describe+headerLen, fs->describeLen-headerLen);
+		g_string_free(cached, TRUE);
+		return ret;
+	} else if(strcmp(method, "SETUP") == 0) {
+		char transport[128];
+		int transportLen;
+		const char *t = rtspGetHeader(msg, len, "Transport", &transportLen);
+		if(t == NULL || transportLen >= sizeof(transport))
+			return fanoutReply(c, "461 Unsupported Transport", cseq, "", NULL, 0);
+		memcpy(transport, t, transportLen);
+		transport[transportLen] = '\0';
+		// RTP is copied on UDP only
+		if(strstr(transport, "client_port=") == NULL || strstr(transport, "TCP") != NULL)
+			return fanoutReply(c, "461 Unsupported Transport", cseq, "", NULL, 0);
+		int clientPort = atoi(strstr(transport, "client_port=")+12);
+		// find track by url, otherwise by order
+		for(i=0; i<fs->trackCount; i++)
+			if(rtspSameUrl(fs->tracks[i].url, url))
+				break;
+		if(i == fs->trackCount)
+			for(i=0; i<fs->trackCount && c->clientPort[i] != 0; i++);
+		if(i == fs->trackCount || clientPort <= 0 || !fanoutTrackValid(&fs->tracks[i]))
+			return fanoutReply(c, "404 Not Found", cseq, "", NULL, 0);
+		c->clientPort[i] = clientPort;
+		if(c->playing)
+			fanoutConsumerPlay(c, true);
+		headers = g_strdup_printf("Session: %s;timeout=60\r\n"
+				"Transport: RTP/AVP;unicast;client_port=%d-%d;server_port=%d-%d\r\n",
+				c->sessionId, clientPort, clientPort+1,
+				fs->tracks[i].serverPort, fs->tracks[i].serverPort+1);
+		ret = fanoutReply(c, "200 OK", cseq, headers, NULL, 0);
+		g_free(headers);
+		return ret;
+	} else if(strcmp(method, "PLAY") == 0 || strcmp(method, "PAUSE") == 0 ||
+			strcmp(method, "TEARDOWN") == 0) {
+		fanoutConsumerPlay(c, strcmp(method, "PLAY") == 0);
+		headers = g_strdup_printf("Session: %s\r\n%s", c->sessionId,
+				c->playing ? "Range: npt=now-\r\n" : "");
+		ret = fanoutReply(c, "200 OK", cseq, headers, NULL, 0);
+		g_free(headers);
+		return ret && strcmp(method, "TEARDOWN") != 0;
+	} else if(strcmp(method, "GET_PARAMETER") == 0 || strcmp(method, "SET_PARAMETER") == 0) {
+		headers = g_strdup_printf("Session: %s\r\n", c->sessionId);
+		ret = fanoutReply(c, "200 OK", cseq, headers, NULL, 0);
+		g_free(headers);
+		return ret;
+	}
+	return fanoutReply(c, "501 Not Implemented", cseq, "", NULL, 0);
+}
+
+// serve consumer through its own channel, sending to device the requests not served yet
+IOTC_PRIVATE void fanoutDetach(struct fanoutConsumer *c, int offset) {
+	struct iceAgentClient *iac = c->session->iac;
+	int n, i = takeChannel(iac);
+	if(i != ICE_MAX_CH) {
+		bindChannel(iac, i, c->connection);
+		for(; offset<c->readedBytes; offset+=n) {
+			n = c->readedBytes-offset > BUFFER_LEN-3 ? BUFFER_LEN-3 : c->readedBytes-offset;
+			if(iceSend(iac->iceAgent, i, n, c->buffer+offset) < n) {
+#ifdef DEBUG
+				printf("Fan-out: cannot forward request of detached consumer\n");
+#endif
+				break;
+			}
+		}
+		poolFill(iac);
+	}
+	fanoutConsumerFree(c);
+}
+
+IOTC_PRIVATE gboolean fanoutConsumerRecvCb(GIOChannel *source, GIOCondition condition, gpointer userData) {
+	struct fanoutConsumer *c = (struct fanoutConsumer *)userData;
+	int readed, msgLen, used = 0;
+	bool keep = true;
+	readed = recv(c->sock, c->buffer+c->readedBytes, BUFFER_LEN-c->readedBytes, MSG_DONTWAIT);
+	if(readed == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return TRUE;
+	if(readed <= 0) {
+		c->gsource = 0;
+		fanoutConsumerFree(c);
+		return FALSE;
+	}
+	c->readedBytes += readed;
+	while(used < c->readedBytes) {
+		char *msg = c->buffer+used;
+		int len = c->readedBytes-used;
+		// interleaved data (ex.: RTCP over TCP) is not used by fan-out, skip it
+		if(msg[0] == '$') {
+			if(len < 4)
+				break;
+			msgLen = 4 + ((unsigned char)msg[3]) + (((unsigned int)(unsigned char)msg[2])<<8);
+		} else {
+			int headerLen = rtspHeaderLength(msg, len);
+			if(headerLen == 0)
+				break;
+			msgLen = headerLen + rtspContentLength(msg, headerLen);
+		}
+		if(msgLen > len)
+			break;
+		if(msg[0] != '$' && !(keep = fanoutHandleRequest(c, msg, msgLen)))
+			break;
+		used += msgLen;
+	}
+	// message bigger than buffer cannot be served
+	if(keep && used == 0 && c->readedBytes == BUFFER_LEN)
+		keep = false;
+	if(!keep) {
+		c->gsource = 0;
+		if(c->detach && c->sendSource > 0)
+			c->detachOffset = used; // detached by fanoutConsumerSendCb
+		else if(c->detach)
+			fanoutDetach(c, used);
+		else
+			fanoutConsumerFree(c);
+		return FALSE;
+	}
+	memmove(c->buffer, c->buffer+used, c->readedBytes-used);
+	c->readedBytes -= used;
 	return TRUE;
 }
 
+// serve a new local connection with the stream of primary connection, returns false if it cannot be shared
+IOTC_PRIVATE bool fanoutAccept(struct fanoutSession *fs, GSocketConnection *connection) {
+	GSocketAddress *address;
+	bool local;
+	if(fs->primary == NULL || fs->describe == NULL || fs->describeLen < fs->describeSize || fs->trackCount == 0)
+		return false;
+	// only consumers on this host share the stream, the others are authenticated by the device
+	address = g_socket_connection_get_remote_address(connection, NULL);
+	local = address != NULL && G_IS_INET_SOCKET_ADDRESS(address) &&
+			g_inet_address_get_is_loopback(g_inet_socket_address_get_address(G_INET_SOCKET_ADDRESS(address)));
+	if(address != NULL)
+		g_object_unref(address);
+	if(!local)
+		return false;
+	struct fanoutConsumer *c = (struct fanoutConsumer *)malloc(sizeof(struct fanoutConsumer));
+	if(c == NULL) {
+#ifdef DEBUG
+		printf("Malloc error: fanoutConsumer\n");
+#endif
+		return false;
+	}
+	memset(c, 0, sizeof(struct fanoutConsumer));
+	c->buffer = (char *)malloc(BUFFER_LEN);
+	if(c->buffer == NULL) {
+#ifdef DEBUG
+		printf("Malloc error: fanoutConsumer->buffer\n");
+#endif
+		free(c);
+		return false;
+	}
+	c->session = fs;
+	g_object_ref(connection);
+	c->connection = connection;
+	c->sock = g_socket_get_fd(g_socket_connection_get_socket(connection));
+	snprintf(c->sessionId, sizeof(c->sessionId), "%08X", g_random_int());
+	GIOChannel* channel = g_io_channel_unix_new(c->sock);
+	c->gsource = g_io_add_watch(channel, G_IO_IN, fanoutConsumerRecvCb, c);
+	g_io_channel_unref(channel);
+	c->next = fs->consumers;
+	fs->consumers = c;
+#ifdef DEBUG
+	printf("Fan-out: new consumer of %s\n", fs->url);
+#endif
+	return true;
+}
+
+gboolean socketListenCb(GSocketService *service, GSocketConnection *connection, GObject *sourceObject, gpointer userData) {
+#ifdef DEBUG
+	printf("Socket server new incoming connection\n");
+#endif
+	struct iceAgentClient *iac = (struct iceAgentClient *)userData;
+	IceAgent *iceAgent = iac->iceAgent;
+	int i;
+	if(iac->fanout != NULL && fanoutAccept(iac->fanout, connection))
+		return TRUE;
+	if((i = takeChannel(iac)) == ICE_MAX_CH)
+		return FALSE;
+	bindChannel(iac, i, connection);
+	// first connection of a shared mapping is the one really talking to device
+	if(iac->fanout != NULL && iac->fanout->primary == NULL) {
+		iac->fanout->primary = &iceAgent->conns[i];
+		iceAgent->conns[i].fanout = iac->fanout;
+	}
+
+	// replace the channel just taken from the pool
+	poolFill(iac);
+
+	return TRUE;
+}
+
+// create a service listening for local connections on localPort, NULL if port cannot be used
+IOTC_PRIVATE GSocketService *listenInet(unsigned short localPort) {
+	GSocketService *service;
+	GError *error = NULL;
+	gboolean ret;
+	service = g_socket_service_new();
+	// do not use g_socket_listener_add_inet_port because cannot bind to "any" interface
+	//GInetAddress *address = g_inet_address_new_from_string("127.0.0.1");
+	GInetAddress *address = g_inet_address_new_from_string("0.0.0.0");
+	GSocketAddress *socketAddress = g_inet_socket_address_new(address, localPort);
+	ret = g_socket_listener_add_address(G_SOCKET_LISTENER(service), socketAddress,
+			G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_TCP, NULL, NULL, &error);
+//	ret = g_socket_listener_add_inet_port(G_SOCKET_LISTENER(service), localPort, NULL, &error);
+	g_object_unref(socketAddress);
+	g_object_unref(address);
+	if(!ret && error != NULL) {
+#ifdef DEBUG
+		printf("ICE client cannot allocate socket\n");
+#endif
+		g_clear_error(&error);
+		g_object_unref(service);
+		return NULL;
+	}
+	return service;
+}
+
+// create a service listening for local connections on AF_UNIX socket path, NULL if path cannot be used
+IOTC_PRIVATE GSocketService *listenUnix(const char *path) {
+	struct sockaddr_un addr;
+	GError *error = NULL;
+	GSocket *gsocket;
+	int fd;
+	if(strlen(path) >= sizeof(addr.sun_path))
+		return NULL;
+	memset(&addr, 0, sizeof(struct sockaddr_un));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path)-1);
+	// socket file left by a previous run would make bind fail
+	unlink(path);
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd == -1 || bind(fd, (struct sockaddr *)&addr, sizeof(struct sockaddr_un)) == -1 || listen(fd, 10) == -1) {
+#ifdef DEBUG
+		printf("ICE client cannot allocate socket %s\n", path);
+#endif
+		if(fd != -1)
+			close(fd);
+		return NULL;
+	}
+	// gio-unix is not needed: GSocket just takes the descriptor
+	gsocket = g_socket_new_from_fd(fd, &error);
+	if(gsocket == NULL) {
+		g_clear_error(&error);
+		close(fd);
+		unlink(path);
+		return NULL;
+	}
+	GSocketService *service = g_socket_service_new();
+	if(!g_socket_listener_add_socket(G_SOCKET_LISTENER(service), gsocket, NULL, &error)) {
+#ifdef DEBUG
+		printf("ICE client cannot listen on socket %s\n", path);
+#endif
+		g_clear_error(&error);
+		g_object_unref(gsocket);
+		g_object_unref(service);
+		unlink(path);
+		return NULL;
+	}
+	g_object_unref(gsocket);
+	return service;
+}
+
+// start a service listening for local connections, accepted connections are mapped on remotePort
+// the service is not started yet, so fields of the mapping can be set before first connection
+IOTC_PRIVATE struct iceAgentClient *newService(IceAgent *iceAgent, GSocketService *service,
+		unsigned short localPort, unsigned short remotePort, TunnelProtocols proto, int poolSize) {
+	struct iceAgentClient *iac = (struct iceAgentClient *)malloc(sizeof(struct iceAgentClient));
+#ifdef DEBUG
+	if(iac == NULL)
+		printf("Malloc error: iac\n");
+#endif
+	iac->iceAgent = iceAgent;
+	iac->remotePort = remotePort;
+	iac->localPort = localPort;
+	iac->proto = proto;
+	iac->poolSize = poolSize > ICE_MAX_POOL ? ICE_MAX_POOL : poolSize;
+	iac->poolRefillSource = 0;
+	iac->fanout = NULL;
+	iac->interleave = false;
+	iac->localPath = NULL;
+	iac->remotePath = NULL;
+	iac->remoteHost = 0;
+
+	struct socketServiceList *ssl =
+			(struct socketServiceList *)malloc(sizeof(struct socketServiceList));
+	ssl->service = service;
+	ssl->iac = iac;
+	ssl->next = iceAgent->socketServiceList;
+	iceAgent->socketServiceList = ssl;
+
+	g_signal_connect(G_OBJECT(service), "incoming", G_CALLBACK(socketListenCb), iac);
+	return iac;
+}
+
+IOTC_PRIVATE struct iceAgentClient *startService(IceAgent *iceAgent, GSocketService *service,
+		unsigned short localPort, unsigned short remotePort, TunnelProtocols proto, int poolSize) {
+	struct iceAgentClient *iac = newService(iceAgent, service, localPort, remotePort, proto, poolSize);
+	g_socket_service_start(service);
+	return iac;
+}
+
 // returns -1 if port map has not be set up, 0 or a postive integer otherwise (for udp the channel number)
 IOTC_PRIVATE int portMapInternal(IceAgent *iceAgent, unsigned short localPort, unsigned short remotePort,
-		TunnelProtocols proto) {
+		TunnelProtocols proto, int poolSize) {
 	if(proto == P2P_UDP) {
-		int i;
-		// find first free channel
-		for(i=1; i<ICE_MAX_CH; i++)
-			if(iceAgent->conns[i].sock == -1)
-				break;
+		int i = findFreeChannel(iceAgent);
 		// no free channel found
 		if(i == ICE_MAX_CH) {
 #ifdef DEBUG
@@ -1122,26 +2600,8 @@ IOTC_PRIVATE int portMapInternal(IceAgent *iceAgent, unsigned short localPort, u
 #endif
 			return -1;
 		}
-		char *request = malloc(7);
-#ifdef DEBUG
-		if(request == NULL)
-			printf("Malloc error: request3\n");
-#endif
-		request[0] = P2P_TUNNEL_MAP;
-		request[1] = i;
-		request[2] = (unsigned char)(localPort >> 8);
-		request[3] = (unsigned char)localPort;
-		request[4] = (unsigned char)(remotePort >> 8);
-		request[5] = (unsigned char)remotePort;
-		request[6] = proto;
-		if(iceSend(iceAgent, 0, 7, request) < 7) {
-#ifdef DEBUG
-			printf("ICE client cannot require map on device\n");
-#endif
-			free(request);
+		if(!sendMapRequest(iceAgent, i, localPort, remotePort, proto))
 			return -1;
-		}
-		free(request);
 
 		// init src sockaddr
 		iceAgent->conns[i].srcAddr.sin_family = AF_INET;
@@ -1185,54 +2645,294 @@ IOTC_PRIVATE int portMapInternal(IceAgent *iceAgent, unsigned short localPort, u
 
 		return i;
 	} else if(proto == P2P_TCP || proto == P2P_RTSP) {
-		GSocketService *service;
-		GError *error = NULL;
-		gboolean ret;
-		service = g_socket_service_new();
-		// do not use g_socket_listener_add_inet_port because cannot bind to "any" interface
-		//GInetAddress *address = g_inet_address_new_from_string("127.0.0.1");
-		GInetAddress *address = g_inet_address_new_from_string("0.0.0.0");
-		GSocketAddress *socketAddress = g_inet_socket_address_new(address, localPort);
-		ret = g_socket_listener_add_address(G_SOCKET_LISTENER(service), socketAddress,
-				G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_TCP, NULL, NULL, &error);
-//		ret = g_socket_listener_add_inet_port(G_SOCKET_LISTENER(service), localPort, NULL, &error);
-		g_object_unref(socketAddress);
-		g_object_unref(address);
-		if(!ret && error != NULL) {
+		GSocketService *service = listenInet(localPort);
+		if(service == NULL)
+			return -1;
+		poolFill(startService(iceAgent, service, localPort, remotePort, proto, poolSize));
+		return 0;
+	}
+	return -1;
+}
+
+bool icePortMap(IceAgent *iceAgent, unsigned short localPort, unsigned short remotePort,
+		TunnelProtocols proto) {
+	return portMapInternal(iceAgent, localPort, remotePort, proto, 0) >= 0;
+}
+
+bool icePortMapPool(IceAgent *iceAgent, unsigned short localPort, unsigned short remotePort,
+		TunnelProtocols proto, int poolSize) {
+	if(proto == P2P_UDP || poolSize < 0) {
 #ifdef DEBUG
-			printf("ICE client cannot allocate socket\n");
+		printf("ICE client cannot create a pool for this port mapping\n");
 #endif
-			g_clear_error(&error);
-			g_object_unref(service);
-			return -1;
+		return false;
+	}
+	return portMapInternal(iceAgent, localPort, remotePort, proto, poolSize) >= 0;
+}
+
+bool icePortMapPath(IceAgent *iceAgent, const char *localPath, unsigned short localPort,
+		const char *remotePath, unsigned short remotePort, TunnelProtocols proto) {
+	GSocketService *service;
+	struct iceAgentClient *iac;
+	if(proto != P2P_TCP && proto != P2P_RTSP) {
+#ifdef DEBUG
+		printf("ICE client can map only stream protocols on AF_UNIX sockets\n");
+#endif
+		return false;
+	}
+	if(remotePath != NULL && (remotePath[0] == '\0' || strlen(remotePath) >= sizeof(((struct sockaddr_un *)NULL)->sun_path)))
+		return false;
+	service = localPath != NULL ? listenUnix(localPath) : listenInet(localPort);
+	if(service == NULL)
+		return false;
+	iac = newService(iceAgent, service, localPort, remotePort, proto, 0);
+	if(localPath != NULL)
+		iac->localPath = strdup(localPath);
+	if(remotePath != NULL)
+		iac->remotePath = strdup(remotePath);
+	g_socket_service_start(service);
+	return true;
+}
+
+bool icePortMapHost(IceAgent *iceAgent, unsigned short localPort, const char *remoteHost,
+		unsigned short remotePort, TunnelProtocols proto) {
+	GSocketService *service;
+	struct iceAgentClient *iac;
+	struct in_addr host;
+	if((proto != P2P_TCP && proto != P2P_RTSP) || remoteHost == NULL || inet_aton(remoteHost, &host) == 0) {
+#ifdef DEBUG
+		printf("ICE client cannot map host %s\n", remoteHost != NULL ? remoteHost : "(null)");
+#endif
+		return false;
+	}
+	service = listenInet(localPort);
+	if(service == NULL)
+		return false;
+	iac = newService(iceAgent, service, localPort, remotePort, proto, 0);
+	iac->remoteHost = host.s_addr;
+	// RTP channels would be mapped on device ports, so media is carried by the RTSP connection
+	if(proto == P2P_RTSP)
+		iac->interleave = true;
+	g_socket_service_start(service);
+	return true;
+}
+
+bool icePortMapInterleaved(IceAgent *iceAgent, unsigned short localPort, unsigned short remotePort) {
+	if(portMapInternal(iceAgent, localPort, remotePort, P2P_RTSP, 0) < 0)
+		return false;
+	// last mapping is the first of the list
+	iceAgent->socketServiceList->iac->interleave = true;
+	return true;
+}
+
+bool icePortMapFanout(IceAgent *iceAgent, unsigned short localPort, unsigned short remotePort) {
+	struct fanoutSession *fs;
+	if(portMapInternal(iceAgent, localPort, remotePort, P2P_RTSP, 0) < 0)
+		return false;
+	fs = (struct fanoutSession *)malloc(sizeof(struct fanoutSession));
+	if(fs == NULL) {
+#ifdef DEBUG
+		printf("Malloc error: fanoutSession\n");
+#endif
+		return false;
+	}
+	memset(fs, 0, sizeof(struct fanoutSession));
+	// last mapping is the first of the list
+	fs->iac = iceAgent->socketServiceList->iac;
+	fs->iac->fanout = fs;
+	return true;
+}
+
+// get an in-process channel opened by iceChannelOpen(), NULL if ch is not one of them
+IOTC_PRIVATE ConnectionInfo *localChannelGet(IceAgent *iceAgent, int ch) {
+	if(iceAgent == NULL || iceAgent->conns == NULL || ch <= 0 || ch >= ICE_MAX_CH ||
+			iceAgent->conns[ch].local == NULL)
+		return NULL;
+	return &(iceAgent->conns[ch]);
+}
+
+int iceChannelOpen(IceAgent *iceAgent, unsigned short remotePort, TunnelProtocols proto,
+		void (*onData)(int channel, char *data, int len, void *userData),
+		void (*onClose)(int channel, void *userData), void *userData) {
+	if(iceAgent == NULL || iceAgent->conns == NULL || onData == NULL || (proto != P2P_TCP && proto != P2P_UDP))
+		return -1;
+	int i = findFreeChannel(iceAgent);
+	if(i == ICE_MAX_CH) {
+#ifdef DEBUG
+		printf("ICE client cannot find a free channel\n");
+#endif
+		return -1;
+	}
+	struct localChannel *local = (struct localChannel *)malloc(sizeof(struct localChannel));
+	if(local == NULL) {
+#ifdef DEBUG
+		printf("Malloc error: local\n");
+#endif
+		return -1;
+	}
+	// device binds UDP socket on any port, there is no local port to reply to
+	if(!sendMapRequest(iceAgent, i, 0, remotePort, proto)) {
+		free(local);
+		return -1;
+	}
+	local->onData = onData;
+	local->onClose = onClose;
+	local->userData = userData;
+	iceAgent->conns[i].channel = i;
+	iceAgent->conns[i].proto = proto;
+	iceAgent->conns[i].agent = iceAgent->agent;
+	iceAgent->conns[i].local = local;
+	return i;
+}
+
+char *iceChannelBuffer(IceAgent *iceAgent, int ch, int *size) {
+	ConnectionInfo *conn = localChannelGet(iceAgent, ch);
+	if(conn == NULL || *(conn->pendingSend))
+		return NULL;
+	if(size != NULL)
+		*size = BUFFER_LEN-3;
+	return conn->buffer+3;
+}
+
+bool iceChannelCommit(IceAgent *iceAgent, int ch, int len) {
+	ConnectionInfo *conn = localChannelGet(iceAgent, ch);
+	if(conn == NULL || *(conn->pendingSend) || len <= 0 || len > BUFFER_LEN-3)
+		return false;
+	sendBuffer(conn, len);
+	return true;
+}
+
+int iceChannelWrite(IceAgent *iceAgent, int ch, const char *data, int len) {
+	ConnectionInfo *conn = localChannelGet(iceAgent, ch);
+	int written = 0, chunk;
+	if(conn == NULL)
+		return -1;
+	// what is not sent now stays in channel buffer, so stop at first partial send
+	while(written < len && !*(conn->pendingSend)) {
+		chunk = len-written < BUFFER_LEN-3 ? len-written : BUFFER_LEN-3;
+		memcpy(conn->buffer+3, data+written, chunk);
+		sendBuffer(conn, chunk);
+		written += chunk;
+	}
+	return written;
+}
+
+void iceChannelClose(IceAgent *iceAgent, int ch) {
+	ConnectionInfo *conn = localChannelGet(iceAgent, ch);
+	if(conn == NULL)
+		return;
+	// application asked the close, it is not notified
+	free(conn->local);
+	conn->local = NULL;
+	closeChannelAndSocket(conn, true);
+}
+
+void iceSetGateway(IceAgent *iceAgent, const GatewayRule *rules) {
+	if(iceAgent != NULL)
+		iceAgent->gateway = rules;
+}
+
+GatewayRule *iceGatewayLoad(const char *file) {
+	GatewayRule *rules = NULL, *rule;
+	char line[128], *addr, *sep, *end;
+	struct in_addr network;
+	long bits, port;
+	FILE *fp = fopen(file, "r");
+	if(fp == NULL)
+		return NULL;
+	while(fgets(line, sizeof(line), fp) != NULL) {
+		addr = g_strstrip(line);
+		if(addr[0] == '\0' || addr[0] == '#')
+			continue;
+		// address[/bits][:port]
+		port = 0;
+		bits = 32;
+		if((sep = strchr(addr, ':')) != NULL) {
+			*sep = '\0';
+			port = strtol(sep+1, &end, 10);
+			if(*end != '\0' || port <= 0 || port > 65535)
+				continue;
+		}
+		if((sep = strchr(addr, '/')) != NULL) {
+			*sep = '\0';
+			bits = strtol(sep+1, &end, 10);
+			if(*end != '\0' || bits < 0 || bits > 32)
+				continue;
+		}
+		if(inet_aton(addr, &network) == 0) {
+#ifdef DEBUG
+			printf("Gateway rule ignored: %s\n", addr);
+#endif
+			continue;
 		}
-		struct iceAgentClient *iac = (struct iceAgentClient *)malloc(sizeof(struct iceAgentClient));
+		rule = (GatewayRule *)malloc(sizeof(GatewayRule));
+		if(rule == NULL) {
 #ifdef DEBUG
-		if(iac == NULL)
-			printf("Malloc error: iac\n");
+			printf("Malloc error: rule\n");
 #endif
-		iac->iceAgent = iceAgent;
-		iac->remotePort = remotePort;
-		iac->localPort = localPort;
-		iac->proto = proto;
+			break;
+		}
+		rule->network = network.s_addr;
+		rule->netmask = bits == 0 ? 0 : htonl(0xFFFFFFFFu << (32 - bits));
+		rule->port = port;
+		rule->next = rules;
+		rules = rule;
+	}
+	fclose(fp);
+	return rules;
+}
+
+void iceGatewayFree(GatewayRule *rules) {
+	while(rules != NULL) {
+		GatewayRule *next = rules->next;
+		free(rules);
+		rules = next;
+	}
+}
 
-		struct socketServiceList *ssl =
-				(struct socketServiceList *)malloc(sizeof(struct socketServiceList));
-		ssl->service = service;
-		ssl->iac = iac;
-		ssl->next = iceAgent->socketServiceList;
-		iceAgent->socketServiceList = ssl;
+void iceSetUnixPaths(IceAgent *iceAgent, const UnixPathRule *rules) {
+	if(iceAgent != NULL)
+		iceAgent->unixPaths = rules;
+}
 
-		g_signal_connect(G_OBJECT(service), "incoming", G_CALLBACK(socketListenCb), iac);
-		g_socket_service_start(service);
-		return 0;
+UnixPathRule *iceUnixPathsLoad(const char *file) {
+	UnixPathRule *rules = NULL, *rule;
+	char line[128], *path;
+	FILE *fp = fopen(file, "r");
+	if(fp == NULL)
+		return NULL;
+	while(fgets(line, sizeof(line), fp) != NULL) {
+		path = g_strstrip(line);
+		if(path[0] == '\0' || path[0] == '#')
+			continue;
+		if(path[0] != '/' || strlen(path) >= sizeof(((struct sockaddr_un *)NULL)->sun_path)) {
+#ifdef DEBUG
+			printf("Unix path rule ignored: %s\n", path);
+#endif
+			continue;
+		}
+		rule = (UnixPathRule *)malloc(sizeof(UnixPathRule));
+		if(rule == NULL) {
+#ifdef DEBUG
+			printf("Malloc error: rule\n");
+#endif
+			break;
+		}
+		rule->path = strdup(path);
+		rule->next = rules;
+		rules = rule;
 	}
-	return -1;
+	fclose(fp);
+	return rules;
 }
 
-bool icePortMap(IceAgent *iceAgent, unsigned short localPort, unsigned short remotePort,
-		TunnelProtocols proto) {
-	return portMapInternal(iceAgent, localPort, remotePort, proto) >= 0;
+void iceUnixPathsFree(UnixPathRule *rules) {
+	while(rules != NULL) {
+		UnixPathRule *next = rules->next;
+		free(rules->path);
+		free(rules);
+		rules = next;
+	}
 }
 
 void iceStop(IceAgent *iceAgent) {
@@ -1245,6 +2945,17 @@ void iceStop(IceAgent *iceAgent) {
 		ssl = ssl->next;
 		g_socket_service_stop(elem->service);
 		g_object_unref(elem->service);
+		poolDrain(elem->iac);
+		if(elem->iac->fanout != NULL) {
+			fanoutSessionReset(elem->iac->fanout);
+			free(elem->iac->fanout);
+		}
+		if(elem->iac->localPath != NULL) {
+			unlink(elem->iac->localPath);
+			free(elem->iac->localPath);
+		}
+		if(elem->iac->remotePath != NULL)
+			free(elem->iac->remotePath);
 		free(elem->iac);
 		free(elem);
 	}
@@ -1265,6 +2976,24 @@ void iceStop(IceAgent *iceAgent) {
 				free(conns[i].buffer);
 				conns[i].buffer = NULL;
 			}
+			freeAddressList(conns[i].extraDst);
+			conns[i].extraDst = NULL;
+			rtspParserFree(conns[i].rtspRequest);
+			conns[i].rtspRequest = NULL;
+			rtspParserFree(conns[i].rtspResponse);
+			conns[i].rtspResponse = NULL;
+			if(conns[i].interleaved != NULL) {
+				interleavedSessionFree(conns[i].interleaved);
+				conns[i].interleaved = NULL;
+			}
+			if(conns[i].local != NULL) {
+				free(conns[i].local);
+				conns[i].local = NULL;
+			}
+			if(conns[i].unixPath != NULL) {
+				g_free(conns[i].unixPath);
+				conns[i].unixPath = NULL;
+			}
 		}
 		free(conns);
 		iceAgent->conns = NULL;
@@ -1287,6 +3016,8 @@ void iceStop(IceAgent *iceAgent) {
 
 void iceFree(IceAgent *iceAgent) {
 	iceStop(iceAgent);
+	iceCandidatePolicyFree(iceAgent->policy);
+	iceAgent->policy = NULL;
 /*	int i;
 	// Remove all listening sockets
 	struct socketServiceList *ssl = iceAgent->socketServiceList;
@@ -43,8 +43,39 @@ typedef enum {
 	P2P_TUNNEL_PING,	/**< Ping tunnel to check connection */
 	P2P_TUNNEL_FREE,	/**< Request socket close and deallocation */
 	P2P_TUNNEL_PONG,	/**< Response to a ping request */
+	P2P_TUNNEL_MAP_EX,	/**< Request a mapping on an endpoint that is not a port (see p2pEndpointTypes) */
 } p2pActions;
 
+/**
+ * @brief List of device endpoints that can be required with P2P_TUNNEL_MAP_EX
+ */
+typedef enum {
+	P2P_ENDPOINT_UNIX,	/**< Path of an AF_UNIX stream socket */
+	P2P_ENDPOINT_HOST,	/**< IPv4 address and port of a LAN host, allowed by device gateway rules */
+} p2pEndpointTypes;
+
+/**
+ * @brief A LAN network (or host) that device can reach on behalf of clients
+ *
+ * @see iceGatewayLoad()
+ */
+typedef struct gatewayRule {
+	in_addr_t network;		/**< Network address (network order) */
+	in_addr_t netmask;		/**< Mask of network (network order), 0xFFFFFFFF for a single host */
+	unsigned short port;		/**< Allowed port, 0 for any port */
+	struct gatewayRule *next;	/**< A pointer to next rule */
+} GatewayRule;
+
+/**
+ * @brief An AF_UNIX socket of the device that clients can reach
+ *
+ * @see iceUnixPathsLoad()
+ */
+typedef struct unixPathRule {
+	char *path;			/**< Full path of the socket */
+	struct unixPathRule *next;	/**< A pointer to next rule */
+} UnixPathRule;
+
 /**
  * @brief Create an agent for ICE connection
  *
@@ -59,6 +90,7 @@ typedef enum {
  *	(can be NULL if no authentication required)
  * @param turnPassword The password for authenticating on turn service
  *	(can be NULL if no authentication required)
+ * @param policy The policy used to filter candidates (it is copied), NULL to use all candidates
  * @param onReady The callback called when agent is ready to receive connections.
  *	The callback is invoked with local SDP as input parameter
  * @param onStatusChanged The callback called when agent change its connection status,
@@ -68,6 +100,7 @@ typedef enum {
  */
 IceAgent *iceNew(IotcCtx *ctx, GMainLoop *gloop,
 		const char *host, int port, const char *turnUser, const char *turnPassword,
+		const CandidatePolicy *policy,
 		void (*onReady)(IotcCtx *ctx, IceAgent *, char *, void *),
 		void (*onStatusChanged)(IotcCtx *ctx, IceAgent *, const char *, void *, ConnectionType, char *),
 		void *userData);
@@ -113,6 +146,230 @@ int iceSend(IceAgent *iceAgent, char channel, int msgLen, char *msg);
 bool icePortMap(IceAgent *iceAgent, unsigned short localPort, unsigned short remotePort,
 		TunnelProtocols proto);
 
+/**
+ * @brief Require a port mapping with a pool of pre-opened channels
+ *
+ * Like icePortMap(), but poolSize channels are mapped in advance, so the device connects to
+ * its service before any local connection arrives. A new local connection takes a channel
+ * from the pool and the pool is refilled immediately.
+ * @param iceAgent The agent used for ice connection to the device
+ * @param localPort The port on localhost (client) on which client will listen for incoming connections
+ * @param remotePort The port on the device where the desired service is listening
+ * @param proto The protocol used between final client and final server (TCP or RTSP)
+ * @param poolSize Number of channels kept pre-opened (at most ICE_MAX_POOL)
+ * @return A boolean value, true if port mapping is correctly initialized, false otherwise
+ * @see icePortMap()
+ */
+bool icePortMapPool(IceAgent *iceAgent, unsigned short localPort, unsigned short remotePort,
+		TunnelProtocols proto, int poolSize);
+
+/**
+ * @brief Require a RTSP port mapping shared among local consumers
+ *
+ * The first local connection talks to device as with icePortMap(). While it is open, the next
+ * local connections asking the same stream are served by the client itself: DESCRIBE response
+ * of the first connection is reused and its RTP/RTCP packets are copied to every consumer.
+ * @param iceAgent The agent used for ice connection to the device
+ * @param localPort The port on localhost (client) on which client will listen for incoming connections
+ * @param remotePort The RTSP port on the device
+ * @return A boolean value, true if port mapping is correctly initialized, false otherwise
+ * @see icePortMap()
+ */
+bool icePortMapFanout(IceAgent *iceAgent, unsigned short localPort, unsigned short remotePort);
+
+/**
+ * @brief Require a RTSP port mapping carrying RTP/RTCP inside the RTSP connection
+ *
+ * SETUP requests of local connections are rewritten to ask RTP over RTSP (interleaved) to the
+ * device, so media does not need UDP channels. Responses are turned back to UDP and packets are
+ * exchanged with local client through sockets on localhost.
+ * @param iceAgent The agent used for ice connection to the device
+ * @param localPort The port on localhost (client) on which client will listen for incoming connections
+ * @param remotePort The RTSP port on the device
+ * @return A boolean value, true if port mapping is correctly initialized, false otherwise
+ * @see icePortMap()
+ */
+bool icePortMapInterleaved(IceAgent *iceAgent, unsigned short localPort, unsigned short remotePort);
+
+/**
+ * @brief Require a port mapping using AF_UNIX sockets on client, device or both
+ *
+ * @param iceAgent The agent used for ice connection to the device
+ * @param localPath The AF_UNIX socket created on client for incoming connections, or NULL to listen on localPort
+ * @param localPort The port on localhost (client), used if localPath is NULL
+ * @param remotePath The AF_UNIX socket of the service on the device, or NULL to connect remotePort
+ * @param remotePort The port on the device, used if remotePath is NULL
+ * @param proto The protocol of the service (P2P_TCP or P2P_RTSP)
+ * @return A boolean value, true if port mapping is correctly initialized, false otherwise
+ * @note Devices not supporting P2P_TUNNEL_MAP_EX ignore the request: connections to a remotePath
+ *	of these devices are never served.
+ * @see icePortMap()
+ */
+bool icePortMapPath(IceAgent *iceAgent, const char *localPath, unsigned short localPort,
+		const char *remotePath, unsigned short remotePort, TunnelProtocols proto);
+
+/**
+ * @brief Require a port mapping to a host in the LAN of the device
+ *
+ * Device acts as a gateway: connections on localPort are tunnelled to remoteHost:remotePort,
+ * if device gateway rules allow it (otherwise they are closed as soon as device answers).
+ * @param iceAgent The agent used for ice connection to the device
+ * @param localPort The port on localhost (client) on which client will listen for incoming connections
+ * @param remoteHost The IPv4 address of the host, as seen by the device (ex.: "192.168.1.20")
+ * @param remotePort The port on the host
+ * @param proto The protocol of the service (P2P_TCP or P2P_RTSP)
+ * @return A boolean value, true if port mapping is correctly initialized, false otherwise
+ * @note RTSP mappings always use interleaved transport, see icePortMapInterleaved()
+ * @see iceSetGateway()
+ */
+bool icePortMapHost(IceAgent *iceAgent, unsigned short localPort, const char *remoteHost,
+		unsigned short remotePort, TunnelProtocols proto);
+
+/**
+ * @brief Open a channel to a device port used directly by the application
+ *
+ * Unlike icePortMap() no socket is opened on the client: data sent by the device is passed to
+ * onData as soon as it arrives, and data is sent using iceChannelWrite() or
+ * iceChannelBuffer()/iceChannelCommit().
+ * @param iceAgent The agent used for ice connection to the device
+ * @param remotePort The port on the device
+ * @param proto The protocol of the port on the device (P2P_TCP or P2P_UDP)
+ * @param onData Callback invoked with every packet received on the channel. Params are:
+ *	- channel The channel returned by this function
+ *	- data The packet, owned by the agent and valid only until the callback returns
+ *	- len The length of packet
+ *	- userData The user data provided as parameter in this function
+ * @param onClose Callback invoked when the channel is closed by the device (can be NULL). Params are:
+ *	- channel The channel returned by this function
+ *	- userData The user data provided as parameter in this function
+ * @param userData A pointer to data passed back to callbacks
+ * @return The channel, or -1 if an error occurred
+ */
+int iceChannelOpen(IceAgent *iceAgent, unsigned short remotePort, TunnelProtocols proto,
+		void (*onData)(int channel, char *data, int len, void *userData),
+		void (*onClose)(int channel, void *userData), void *userData);
+
+/**
+ * @brief Send data on a channel opened using iceChannelOpen()
+ *
+ * Data is split in packets of the tunnel. When the tunnel cannot accept more data the function
+ * returns the number of bytes already taken: the rest must be written again later.
+ * @param iceAgent The agent used for ice connection to the device
+ * @param ch The channel returned by iceChannelOpen()
+ * @param data The data to send
+ * @param len The length of data
+ * @return The number of bytes taken, or -1 if channel is not open
+ */
+int iceChannelWrite(IceAgent *iceAgent, int ch, const char *data, int len);
+
+/**
+ * @brief Get the buffer of a channel, to prepare a packet without copies
+ *
+ * The application writes the packet directly in the buffer, then sends it using iceChannelCommit().
+ * @param iceAgent The agent used for ice connection to the device
+ * @param ch The channel returned by iceChannelOpen()
+ * @param[out] size The space available in the buffer
+ * @return The buffer, or NULL if channel is not open or tunnel cannot accept data now
+ */
+char *iceChannelBuffer(IceAgent *iceAgent, int ch, int *size);
+
+/**
+ * @brief Send the packet prepared in the buffer returned by iceChannelBuffer()
+ *
+ * @param iceAgent The agent used for ice connection to the device
+ * @param ch The channel returned by iceChannelOpen()
+ * @param len The length of the packet
+ * @return A boolean value, true if the packet has been taken, false otherwise
+ */
+bool iceChannelCommit(IceAgent *iceAgent, int ch, int len);
+
+/**
+ * @brief Close a channel opened using iceChannelOpen()
+ *
+ * onClose is not invoked.
+ * @param iceAgent The agent used for ice connection to the device
+ * @param ch The channel returned by iceChannelOpen()
+ */
+void iceChannelClose(IceAgent *iceAgent, int ch);
+
+/**
+ * @brief Set the LAN hosts that a device agent can reach on behalf of the client
+ *
+ * Without rules (default) the device refuses every mapping to a LAN host.
+ * @param iceAgent The agent created using iceNew()
+ * @param rules The rules, not copied: they must be valid until agent is freed (can be NULL)
+ * @see iceGatewayLoad()
+ */
+void iceSetGateway(IceAgent *iceAgent, const GatewayRule *rules);
+
+/**
+ * @brief Read gateway rules from a file
+ *
+ * The file contains one rule per line as address[/bits][:port] (ex.: "192.168.1.0/24",
+ * "192.168.1.20:554"). Empty lines and lines starting with '#' are skipped.
+ * @param file The path of the file
+ * @return The rules, to be freed using iceGatewayFree(), or NULL if file is missing or empty
+ */
+GatewayRule *iceGatewayLoad(const char *file);
+
+/**
+ * @brief Deallocate rules returned by iceGatewayLoad()
+ *
+ * @param rules The rules to free (can be NULL)
+ */
+void iceGatewayFree(GatewayRule *rules);
+
+/**
+ * @brief Set the AF_UNIX sockets that a device agent can connect on behalf of the client
+ *
+ * Without rules (default) the device refuses every mapping to an AF_UNIX socket.
+ * @param iceAgent The agent created using iceNew()
+ * @param rules The rules, not copied: they must be valid until agent is freed (can be NULL)
+ * @see iceUnixPathsLoad()
+ */
+void iceSetUnixPaths(IceAgent *iceAgent, const UnixPathRule *rules);
+
+/**
+ * @brief Read unix path rules from a file
+ *
+ * The file contains one absolute socket path per line (ex.: "/var/run/camera.sock"), matched
+ * exactly. Empty lines and lines starting with '#' are skipped.
+ * @param file The path of the file
+ * @return The rules, to be freed using iceUnixPathsFree(), or NULL if file is missing or empty
+ */
+UnixPathRule *iceUnixPathsLoad(const char *file);
+
+/**
+ * @brief Deallocate rules returned by iceUnixPathsLoad()
+ *
+ * @param rules The rules to free (can be NULL)
+ */
+void iceUnixPathsFree(UnixPathRule *rules);
+
+/**
+ * @brief Get statistics about candidates filtered by agent policy
+ *
+ * @param iceAgent The agent created using iceNew()
+ * @param[out] stats The structure filled with statistics
+ * @return A boolean value, true if stats has been filled, false otherwise
+ */
+bool iceGetCandidateStats(IceAgent *iceAgent, CandidateStats *stats);
+
+/**
+ * @brief Duplicate a candidate policy
+ *
+ * @param policy The policy to copy (can be NULL)
+ * @return A deep copy of the policy, to be freed using iceCandidatePolicyFree(), or NULL
+ */
+CandidatePolicy *iceCandidatePolicyDup(const CandidatePolicy *policy);
+
+/**
+ * @brief Deallocate a policy created by iceCandidatePolicyDup()
+ *
+ * @param policy The policy to free (can be NULL)
+ */
+void iceCandidatePolicyFree(CandidatePolicy *policy);
+
 /**
  * @brief Stop all IceAgent operations
  *
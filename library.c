@@ -16,10 +16,26 @@
 #include "sssdp.h"
 #include "web.h"
 #include "secure.h"
+#include "dns.h"
+#include <pthread.h>
+#define DEVICE_RECONNECT_SAME 4 // failed reconnections to the same broker before asking server list again
+#define DEVICE_RECONNECT_FIRST_MS 1000 // first reconnection is within this delay (spread devices after a broker restart)
+#define DEVICE_RECONNECT_MAX_MS 60000 // max delay between reconnections
+#define DEVICE_STANDBY_RETRY 10 // seconds between reconnections of standby connection
+#define DEVICE_PROBE_PARALLEL 3 // servers of the list probed at the same time before connecting
+#define DEVICE_PROBE_TIMEOUT 10 // seconds to wait for a probed server
+
+#ifdef MQTT_THREADED_LOOP
+#include "queue.h"
+
+#define DEVICE_OFFER_QUEUE 32 // offers waiting for main loop
+#define DEVICE_OFFER_MAX_SDP 4096 // longer offers are dropped
+#endif
 
 struct iotcCtx {
 	GMainLoop *gloop;
 	bool removable;
+	CandidatePolicy *policy;
 //#ifndef IOTC_CLIENT
 	char *srvIp;
 	char *turnUsername;
@@ -33,9 +49,62 @@ struct iotcCtx {
 	char *crtFile;
 	char *keyFile;
 	char *pKey;
+	GatewayRule *gateway;
+	UnixPathRule *unixPaths;
+	char *serversCache;		// file keeping servers of last registration
+	struct iotcRuntime *runtime;	// runtime hosting this device
+	struct iotcCtx *carrier;	// device whose mqtt connection carries messages of this one, NULL if own
+	struct iotcCtx *next;		// next device of the runtime
+	GSList *sessions;		// agents connected to clients
+	gint refs;			// runtime plus callbacks still pending on this ctx
+	int reconnectFailures;		// reconnections failed since last successful connection
+	MqttCtx *standbyMqtt;		// connection to the next server of the list, receiving offers too
+	struct iotcServerList *standby;	// server of standbyMqtt
+	bool standbyUp;			// standbyMqtt is subscribed
+	bool removed;			// device removed from runtime, ctx freed when refs is 0
 //#endif // IOTC_CLIENT
 };
 
+struct iotcRuntime {
+	GMainLoop *gloop;
+	IotcCtx *devices;
+	bool shareMqtt;
+	bool hotStandby;
+#ifdef MQTT_THREADED_LOOP
+	MsgQueue *offers;	// offers received by mosquitto threads, handled on main loop
+#endif
+};
+
+#ifdef MQTT_THREADED_LOOP
+// head of a queued offer, followed by remote sdp
+struct deviceOffer {
+	IotcCtx *ctx;		// held until offer is handled
+	int mqttConnectionId;
+};
+#endif
+
+// servers probed at the same time, the first answering is used
+struct probeRound {
+	IotcCtx *ctx;			// held until all probes are finished
+	GCancellable *cancellable;	// cancels the probes still pending when one succeeds
+	gint64 start;			// to measure rtt of servers
+	int pending;
+	struct iotcServerList *winner;
+	struct serverProbe {
+		struct probeRound *round;
+		struct iotcServerList *server;
+		GSocketClient *client;
+		bool failed;
+	} probes[DEVICE_PROBE_PARALLEL];
+	int count;
+};
+
+struct deviceSession {
+	IotcCtx *ctx;
+	IceAgent *iceAgent;
+	int mqttConnectionId;
+};
+
 struct iotcAgent {
 	IceAgent *iceAgent;
 	struct connectUserData *connectUserData;
@@ -46,9 +115,20 @@ struct connectUserData {
 	char *uid;
 	IotcAgent *iotcAgent;
 	const char *(*getRemoteSdp)(char *uid, char *localSdp, void *userData);
+	void (*onLocalSdp)(IotcAgent *iotcAgent, char *uid, char *localSdp, void *userData);
 	void (*connectionStatusCb)(IotcAgent *iotcAgent, const char *status,
 			ConnectionType connType, char *remoteIp, void *userData);
 	void *userData;
+	GMainContext *context;		// client loop, where remote sdp is applied
+	pthread_mutex_t lock;		// protects fields below
+	int remoteSdpPending;		// iotcSetRemoteSdp() calls not yet applied on loop
+	bool disconnected;
+};
+
+// remote sdp moving from the application thread to the client loop
+struct remoteSdpHop {
+	struct connectUserData *data;
+	char *remoteSdp;
 };
 
 extern int lPort;
@@ -56,16 +136,216 @@ extern int lPort;
 //#ifndef IOTC_CLIENT
 IOTC_PRIVATE void connectToServers(IotcCtx *ctx);
 IOTC_PRIVATE void manageSSDPServer(IotcCtx *ctx);
+IOTC_PRIVATE gboolean reconnectMqttTimeoutCb(gpointer userData);
+IOTC_PRIVATE gboolean mqttLostTimeoutCb(gpointer userData);
+IOTC_PRIVATE void deviceMqttConnectCb(MqttCtx *mqttCtx, void *userData, int result);
+IOTC_PRIVATE void deviceMqttMessageCb(MqttCtx *mqttCtx, void *userData, const struct mosquitto_message *message);
+IOTC_PRIVATE void deviceMqttDisconnectCb(MqttCtx *mqttCtx, void *userData, int rc);
+
+IOTC_PRIVATE void deviceCtxFree(IotcCtx *ctx) {
+	iceGatewayFree(ctx->gateway);
+	iceUnixPathsFree(ctx->unixPaths);
+	g_free(ctx->serversCache);
+	if(ctx->standby != NULL)
+		iotcServerListFree(ctx->standby);
+	iceCandidatePolicyFree(ctx->policy);
+	if(ctx->serversList != NULL)
+		iotcServerListFree(ctx->serversList);
+	free(ctx->srvIp);
+	free(ctx->turnUsername);
+	free(ctx->turnPassword);
+	free(ctx->pKey);
+	free(ctx->CAFile);
+	free(ctx->crtFile);
+	free(ctx->keyFile);
+	free(ctx->uid);
+	free(ctx);
+}
+
+IOTC_PRIVATE void deviceHold(IotcCtx *ctx) {
+	g_atomic_int_inc(&ctx->refs);
+}
+
+// release a reference taken by deviceHold(), returns true if device has been removed and caller must stop
+IOTC_PRIVATE bool deviceRelease(IotcCtx *ctx) {
+	bool removed = ctx->removed;
+	if(g_atomic_int_dec_and_test(&ctx->refs)) {
+		deviceCtxFree(ctx);
+		return true;
+	}
+	return removed;
+}
+
+// invoke cb on main loop after seconds, cb must start with deviceRelease()
+IOTC_PRIVATE void deviceLater(IotcCtx *ctx, guint seconds, GSourceFunc cb) {
+	deviceHold(ctx);
+	g_timeout_add_seconds(seconds, cb, ctx);
+}
+
+// same as deviceLater() with a delay in milliseconds
+IOTC_PRIVATE void deviceLaterMs(IotcCtx *ctx, guint ms, GSourceFunc cb) {
+	deviceHold(ctx);
+	g_timeout_add(ms, cb, ctx);
+}
+
+// delay before next reconnection: exponential with failures, random in its upper half
+IOTC_PRIVATE guint deviceReconnectDelay(IotcCtx *ctx) {
+	guint delay = DEVICE_RECONNECT_FIRST_MS;
+	int i;
+	// first attempt is immediate, just spread devices reconnecting after a broker restart
+	if(ctx->reconnectFailures <= 1)
+		return g_random_int_range(0, DEVICE_RECONNECT_FIRST_MS);
+	for(i=1; i<ctx->reconnectFailures && delay<DEVICE_RECONNECT_MAX_MS; i++)
+		delay <<= 1;
+	if(delay > DEVICE_RECONNECT_MAX_MS)
+		delay = DEVICE_RECONNECT_MAX_MS;
+	return g_random_int_range(delay / 2, delay + 1);
+}
+
+// the mqtt connection used by device, own or shared
+IOTC_PRIVATE MqttCtx *deviceMqtt(IotcCtx *ctx) {
+	return ctx->carrier != NULL ? ctx->carrier->mqttCtx : ctx->mqttCtx;
+}
+
+// the mqtt connection where answers are published: standby one while main one is reconnecting
+IOTC_PRIVATE MqttCtx *deviceMqttForAnswers(IotcCtx *ctx) {
+	if(ctx->reconnectFailures > 0 && ctx->standbyUp)
+		return ctx->standbyMqtt;
+	return deviceMqtt(ctx);
+}
+
+IOTC_PRIVATE void deviceStandbyFree(IotcCtx *ctx) {
+	mqttFree(ctx->standbyMqtt);
+	ctx->standbyMqtt = NULL;
+	ctx->standbyUp = false;
+	if(ctx->standby != NULL) {
+		iotcServerListFree(ctx->standby);
+		ctx->standby = NULL;
+	}
+}
+
+IOTC_PRIVATE gboolean standbyRetryTimeoutCb(gpointer userData);
+
+// open standby connection, tried again later if mosquitto cannot be set up
+IOTC_PRIVATE void deviceStandbyConnect(IotcCtx *ctx) {
+	ctx->standbyMqtt = mqttNew(ctx->uid, ctx->standby->ip, 1883,
+			ctx->CAFile, ctx->CAPath, ctx->crtFile, ctx->keyFile,
+			deviceMqttConnectCb, NULL,
+			deviceMqttMessageCb, deviceMqttDisconnectCb, ctx);
+	if(ctx->standbyMqtt == NULL) {
+#ifdef DEBUG
+		printf("[DEBUG] Cannot create standby connection, retrying\n");
+#endif
+		deviceLater(ctx, DEVICE_STANDBY_RETRY, &standbyRetryTimeoutCb);
+	}
+}
+
+// connect to the server after the registered one, so offers keep arriving if this fails
+IOTC_PRIVATE void deviceStandbyStart(IotcCtx *ctx) {
+	deviceStandbyFree(ctx);
+	if(!ctx->runtime->hotStandby || ctx->carrier != NULL || ctx->serversList == NULL ||
+			ctx->serversList->next == NULL)
+		return;
+	// rest of the list is kept: after a failover it gives the next standby server
+	ctx->standby = ctx->serversList->next;
+	ctx->serversList->next = NULL;
+#ifdef DEBUG
+	printf("[DEBUG] Standby connection to server: %s\n", ctx->standby->ip);
+#endif
+	deviceStandbyConnect(ctx);
+}
+
+IOTC_PRIVATE gboolean standbyRetryTimeoutCb(gpointer userData) {
+	IotcCtx *ctx = (IotcCtx *)userData;
+	// standby dropped or already working in the meantime
+	if(deviceRelease(ctx) || ctx->standby == NULL || ctx->standbyUp)
+		return G_SOURCE_REMOVE;
+	if(ctx->standbyMqtt == NULL)
+		deviceStandbyConnect(ctx);
+	else if(!mqttReconnect(ctx->standbyMqtt))
+		deviceLater(ctx, DEVICE_STANDBY_RETRY, &standbyRetryTimeoutCb);
+	return G_SOURCE_REMOVE;
+}
+
+IOTC_PRIVATE gboolean standbyLostTimeoutCb(gpointer userData) {
+	IotcCtx *ctx = (IotcCtx *)userData;
+	if(deviceRelease(ctx) || ctx->standbyMqtt == NULL)
+		return G_SOURCE_REMOVE;
+	ctx->standbyUp = false;
+	deviceLater(ctx, DEVICE_STANDBY_RETRY, &standbyRetryTimeoutCb);
+	return G_SOURCE_REMOVE;
+}
+
+// save parameters of connected server and register device on it
+// saveServers is false after a failover, when serversList lacks the servers before the standby one
+IOTC_PRIVATE void deviceRegistered(IotcCtx *ctx, bool saveServers) {
+	if(ctx->serversList != NULL) {
+		// next boot starts from these servers, registered one first
+		if(saveServers)
+			iotcServerListSave(ctx->serversList, ctx->serversCache);
+		deviceStandbyStart(ctx);
+		ctx->srvIp = strdup(ctx->serversList->ip);
+		ctx->turnUsername = strdup(ctx->serversList->username);
+		ctx->turnPassword = strdup(ctx->serversList->password);
+		// free the server list
+		iotcServerListFree(ctx->serversList);
+		ctx->serversList = NULL;
+	}
+	ctx->reconnectFailures = 0;
+#ifdef DEBUG
+	printf("[DEBUG] Registered to server %s\n", ctx->srvIp);
+#endif
+	// invoked on main loop: do not wait for web server
+	webDeviceRegisterAsync(ctx->srvIp, ctx->CAFile, ctx->CAPath, ctx->crtFile, ctx->keyFile, NULL, NULL);
+}
+
+IOTC_PRIVATE void deviceForgetServer(IotcCtx *ctx) {
+	if(ctx->srvIp) {
+		free(ctx->srvIp);
+		ctx->srvIp = NULL;
+	}
+	if(ctx->turnUsername) {
+		free(ctx->turnUsername);
+		ctx->turnUsername = NULL;
+	}
+	if(ctx->turnPassword) {
+		free(ctx->turnPassword);
+		ctx->turnPassword = NULL;
+	}
+}
+
+// find a device already connected to server ip whose connection can carry other devices
+IOTC_PRIVATE IotcCtx *deviceFindCarrier(IotcCtx *ctx, const char *ip) {
+	IotcCtx *c;
+	for(c=ctx->runtime->devices; c!=NULL; c=c->next)
+		if(c != ctx && c->carrier == NULL && c->mqttCtx != NULL && c->srvIp != NULL && strcmp(c->srvIp, ip) == 0)
+			return c;
+	return NULL;
+}
+
+// devices carried by a connection that is going to be closed connect again by themselves
+IOTC_PRIVATE void deviceDetachCarried(IotcCtx *carrier) {
+	IotcCtx *c;
+	for(c=carrier->runtime->devices; c!=NULL; c=c->next) {
+		if(c->carrier == carrier) {
+			c->carrier = NULL;
+			deviceForgetServer(c);
+			deviceLater(c, 1, &reconnectMqttTimeoutCb);
+		}
+	}
+}
 
 IOTC_PRIVATE void deviceStatusChangedCb(IotcCtx *ctx, IceAgent *iceAgent, const char *status, void *userData,
 		ConnectionType connType, char *remoteIp) {
 #ifdef DEBUG
 	printf("STATUS CB: %s\n", status);
 #endif
+	struct deviceSession *session = (struct deviceSession *)userData;
 	if(status != NULL &&
 			(strstr(status, "timeout") == status || strstr(status, "failed") == status)) {
+		session->ctx->sessions = g_slist_remove(session->ctx->sessions, session);
 		iceFree(iceAgent);
-		free((int *)userData);
+		free(session);
 	}
 #ifdef DEBUG
 	switch(connType) {
@@ -89,85 +369,137 @@ IOTC_PRIVATE void deviceReadyCb(IotcCtx *ctx, IceAgent *iceAgent, char *localSdp
 	// TODO (malloc strlen(uid) + strlen("/server/") + MAX_INT_STRLEN + strlen('\0'))
 	int len = strlen(ctx->uid) + 8 + 10 + 1;
 	char *topic = (char *)malloc(len);
-	snprintf(topic, len, "%s/server/%d", ctx->uid, *((int *)userData));
+	snprintf(topic, len, "%s/server/%d", ctx->uid, ((struct deviceSession *)userData)->mqttConnectionId);
 #ifdef DEBUG
 	printf("%s : %s\n", topic, localSdp);
 #endif
-	if(ctx != NULL && ctx->mqttCtx != NULL)
-		mqttPublish(ctx->mqttCtx, topic, localSdp);
+	if(ctx != NULL && deviceMqttForAnswers(ctx) != NULL)
+		mqttPublish(deviceMqttForAnswers(ctx), topic, localSdp);
 	free(topic);
 }
 
 IOTC_PRIVATE gboolean reconnectMqttTimeoutCb(gpointer userData) {
+	if(deviceRelease((IotcCtx *)userData))
+		return G_SOURCE_REMOVE;
 	connectToServers((IotcCtx *)userData);
 	return G_SOURCE_REMOVE;
 }
 
 IOTC_PRIVATE gboolean freeAndReconnectMqttTimeoutCb(gpointer userData) {
 	IotcCtx *ctx = (IotcCtx *)userData;
+	if(deviceRelease(ctx))
+		return G_SOURCE_REMOVE;
+	deviceDetachCarried(ctx);
 	mqttFree(ctx->mqttCtx);
 	ctx->mqttCtx = NULL;
-	if(ctx->srvIp) {
-		free(ctx->srvIp);
-		ctx->srvIp = NULL;
-	}
-	if(ctx->turnUsername) {
-		free(ctx->turnUsername);
-		ctx->turnUsername = NULL;
-	}
-	if(ctx->turnPassword) {
-		free(ctx->turnPassword);
-		ctx->turnPassword = NULL;
+	deviceForgetServer(ctx);
+	if(ctx->standbyUp) {
+		// standby connection becomes the main one
+#ifdef DEBUG
+		printf("[DEBUG] Switching to standby server %s\n", ctx->standby->ip);
+#endif
+		ctx->mqttCtx = ctx->standbyMqtt;
+		ctx->standbyMqtt = NULL;
+		ctx->standbyUp = false;
+		if(ctx->serversList != NULL)
+			iotcServerListFree(ctx->serversList);
+		ctx->serversList = ctx->standby;
+		ctx->standby = NULL;
+		deviceRegistered(ctx, false);
+		return G_SOURCE_REMOVE;
 	}
 	if(ctx->serversList != NULL)
 		iotcServerListDeleteFirst(&(ctx->serversList));
-	g_timeout_add_seconds(1, &reconnectMqttTimeoutCb, ctx);
+	deviceLaterMs(ctx, deviceReconnectDelay(ctx), &reconnectMqttTimeoutCb);
 	return G_SOURCE_REMOVE;
 }
 
-IOTC_PRIVATE void deviceMqttDisconnectCb(MqttCtx *mqttCtx, void *userData, int rc) {
+IOTC_PRIVATE gboolean reconnectSameMqttTimeoutCb(gpointer userData) {
 	IotcCtx *ctx = (IotcCtx *)userData;
-	// I'm on mqtt loop thread, so can not stop it from here:
-	// attach a callback on gmain loop and stop it there
-	g_timeout_add_seconds(1, &freeAndReconnectMqttTimeoutCb, ctx);
-}
-
-IOTC_PRIVATE void deviceMqttMessageCb(MqttCtx *mqttCtx, void *userData, const struct mosquitto_message *message) {
+	if(deviceRelease(ctx) || ctx->mqttCtx == NULL)
+		return G_SOURCE_REMOVE;
 #ifdef DEBUG
-	printf("MQTT Received: ");
-	fwrite(message->payload, sizeof(char), message->payloadlen, stdout);
-	printf("\n");
+	printf("[DEBUG] Reconnecting to server %s (failures: %d)\n", ctx->srvIp, ctx->reconnectFailures);
 #endif
+	if(!mqttReconnect(ctx->mqttCtx))
+		deviceLater(ctx, 0, &mqttLostTimeoutCb);
+	return G_SOURCE_REMOVE;
+}
 
+/*
+ * Connection to broker lost or reconnection failed: retry the same broker keeping mqtt instance,
+ * then after DEVICE_RECONNECT_SAME failures free it and go through servers list again.
+ */
+IOTC_PRIVATE gboolean mqttLostTimeoutCb(gpointer userData) {
 	IotcCtx *ctx = (IotcCtx *)userData;
+	if(deviceRelease(ctx) || ctx->mqttCtx == NULL)
+		return G_SOURCE_REMOVE;
+	ctx->reconnectFailures++;
+	if(ctx->srvIp != NULL && ctx->reconnectFailures < DEVICE_RECONNECT_SAME) {
+		deviceLaterMs(ctx, deviceReconnectDelay(ctx), &reconnectSameMqttTimeoutCb);
+	} else {
+		deviceLater(ctx, 0, &freeAndReconnectMqttTimeoutCb);
+	}
+	return G_SOURCE_REMOVE;
+}
 
-	// payload is ConnectionId RemoteSdp get ConnectionId to be used for publish
-	char *sdpStart = strstr((char *)(message->payload), " ");
-	if(sdpStart == NULL || sdpStart >= ((char*)message->payload + message->payloadlen)) {
+IOTC_PRIVATE void deviceMqttDisconnectCb(MqttCtx *mqttCtx, void *userData, int rc) {
+	IotcCtx *ctx = (IotcCtx *)userData;
+	if(mqttCtx == ctx->standbyMqtt) {
+		deviceLater(ctx, 0, &standbyLostTimeoutCb);
+		return;
+	}
+	// I'm inside a mosquitto call (on mqtt loop thread with MQTT_THREADED_LOOP),
+	// so can not free it from here: attach a callback on gmain loop and free it there
+	deviceLater(ctx, 0, &mqttLostTimeoutCb);
+}
+
+// start an agent answering to the offer of a client
+IOTC_PRIVATE void deviceHandleOffer(IotcCtx *ctx, int mqttConnectionId, const char *sdpStart, int sdpLength) {
+	GSList *l;
+	// with a standby connection the same offer arrives from both servers
+	for(l=ctx->sessions; l!=NULL; l=l->next) {
+		if(((struct deviceSession *)l->data)->mqttConnectionId == mqttConnectionId) {
 #ifdef DEBUG
-		printf("Cannot parse mqtt message...\n");
+			printf("Offer %d already handled\n", mqttConnectionId);
 #endif
-		return;
+			return;
+		}
 	}
-	sdpStart++;
-	int *mqttConnectionId = (int *)malloc(sizeof(int));
-	*mqttConnectionId = atoi(message->payload);
-	int sdpLength = message->payloadlen - (sdpStart-(char *)message->payload);
+	struct deviceSession *session = (struct deviceSession *)malloc(sizeof(struct deviceSession));
+#ifdef DEBUG
+	if(session == NULL)
+		printf("Malloc error: session\n");
+#endif
+	session->ctx = ctx;
+	session->mqttConnectionId = mqttConnectionId;
 
 	// initalize device agent
 	IceAgent *iceAgent = iceNew(ctx, ctx->gloop, ctx->srvIp, 3478, ctx->turnUsername, ctx->turnPassword,
-			deviceReadyCb, deviceStatusChangedCb, mqttConnectionId);
+			ctx->policy, deviceReadyCb, deviceStatusChangedCb, session);
 	if(iceAgent == NULL) {
 #ifdef DEBUG
 		printf("Agent fail...\n");
 #endif
+		free(session);
 		return;
 	}
+	session->iceAgent = iceAgent;
+	ctx->sessions = g_slist_prepend(ctx->sessions, session);
+	iceSetGateway(iceAgent, ctx->gateway);
+	iceSetUnixPaths(iceAgent, ctx->unixPaths);
 
 	// set remote sdp
-	char *remoteSdp = (char *)malloc(sdpLength + 3);
-	snprintf(remoteSdp, sdpLength + 1, "%s", sdpStart);
-	remoteSdp[sdpLength + 2] = '\0';
+	// sdp is not null terminated when taken from the offer queue
+	char *remoteSdp = (char *)malloc(sdpLength + 1);
+	if(remoteSdp == NULL) {
+#ifdef DEBUG
+		printf("Malloc error: remoteSdp\n");
+#endif
+		return;
+	}
+	memcpy(remoteSdp, sdpStart, sdpLength);
+	remoteSdp[sdpLength] = '\0';
 #ifdef DEBUG
 	printf("Setting remote sdp to: [%s]\n", remoteSdp);
 #endif
@@ -184,8 +516,63 @@ IOTC_PRIVATE void deviceMqttMessageCb(MqttCtx *mqttCtx, void *userData, const st
 	free(remoteSdp);
 }
 
+#ifdef MQTT_THREADED_LOOP
+// invoked on main loop with offers queued by deviceMqttMessageCb()
+IOTC_PRIVATE void deviceOfferCb(const char *msg, int len, void *userData) {
+	struct deviceOffer offer;
+	memcpy(&offer, msg, sizeof(struct deviceOffer));
+	if(deviceRelease(offer.ctx))
+		return;
+	deviceHandleOffer(offer.ctx, offer.mqttConnectionId, msg + sizeof(struct deviceOffer),
+			len - sizeof(struct deviceOffer));
+}
+#endif
+
+IOTC_PRIVATE void deviceMqttMessageCb(MqttCtx *mqttCtx, void *userData, const struct mosquitto_message *message) {
+#ifdef DEBUG
+	printf("MQTT Received: ");
+	fwrite(message->payload, sizeof(char), message->payloadlen, stdout);
+	printf("\n");
+#endif
+
+	IotcCtx *ctx = (IotcCtx *)userData;
+
+	// payload is ConnectionId RemoteSdp get ConnectionId to be used for publish
+	char *sdpStart = strstr((char *)(message->payload), " ");
+	if(sdpStart == NULL || sdpStart >= ((char*)message->payload + message->payloadlen)) {
+#ifdef DEBUG
+		printf("Cannot parse mqtt message...\n");
+#endif
+		return;
+	}
+	sdpStart++;
+	int sdpLength = message->payloadlen - (sdpStart-(char *)message->payload);
+#ifdef MQTT_THREADED_LOOP
+	// I'm on mqtt loop thread: agents live on main loop, pass the offer there
+	struct deviceOffer offer;
+	offer.ctx = ctx;
+	offer.mqttConnectionId = atoi(message->payload);
+	deviceHold(ctx);
+	if(sdpLength > DEVICE_OFFER_MAX_SDP ||
+			!msgQueuePush(ctx->runtime->offers, &offer, sizeof(struct deviceOffer), sdpStart, sdpLength)) {
+#ifdef DEBUG
+		printf("Offer dropped...\n");
+#endif
+		deviceRelease(ctx);
+	}
+#else
+	deviceHandleOffer(ctx, atoi(message->payload), sdpStart, sdpLength);
+#endif
+}
+
 IOTC_PRIVATE void deviceMqttConnectCb(MqttCtx *mqttCtx, void *userData, int result) {
 	IotcCtx *ctx = (IotcCtx *)userData;
+	if(ctx != NULL && mqttCtx == ctx->standbyMqtt) {
+		// standby connection only receives offers
+		if(!result && mqttSubscribe(mqttCtx, ctx->uid))
+			ctx->standbyUp = true;
+		return;
+	}
 	if(!result && ctx != NULL && ctx->mqttCtx != NULL) {
 		// connection OK
 		if(!mqttSubscribe(ctx->mqttCtx, ctx->uid)) {
@@ -194,28 +581,19 @@ IOTC_PRIVATE void deviceMqttConnectCb(MqttCtx *mqttCtx, void *userData, int resu
 #endif
 			return;
 		}
-		// save parameters of connected server
-		if(ctx->serversList != NULL) {
-			ctx->srvIp = strdup(ctx->serversList->ip);
-			ctx->turnUsername = strdup(ctx->serversList->username);
-			ctx->turnPassword = strdup(ctx->serversList->password);
-			// free the server list
-			iotcServerListFree(ctx->serversList);
-			ctx->serversList = NULL;
-		}
+		deviceRegistered(ctx, true);
+	} else {
+		// connection refused: broker closes it and deviceMqttDisconnectCb() chooses what to do
 #ifdef DEBUG
-		printf("[DEBUG] Registered to server %s\n", ctx->srvIp);
+		printf("MQTT connection refused: %d\n", result);
 #endif
-		webDeviceRegister(ctx->srvIp, ctx->CAFile, ctx->CAPath, ctx->crtFile, ctx->keyFile);
-	} else {
-		// connection failed
-		iotcServerListDeleteFirst(&(ctx->serversList));
-		g_timeout_add_seconds(1, &reconnectMqttTimeoutCb, ctx);
 	}
 }
 
 IOTC_PRIVATE void checkCertsCb(int code, char *response, void *userData) {
 	IotcCtx *ctx = (IotcCtx *)userData;
+	if(deviceRelease(ctx))
+		return;
 	if(response != NULL) {
 #ifdef DEBUG
 		if(code >= 0) {
@@ -263,6 +641,8 @@ IOTC_PRIVATE void checkCertsCb(int code, char *response, void *userData) {
 							printf("[DEBUG] Cannot create cacert file\n");
 #endif
 						}
+						// next https requests load new files
+						httpsClearCache();
 					}
 				}
 			}
@@ -272,7 +652,7 @@ IOTC_PRIVATE void checkCertsCb(int code, char *response, void *userData) {
 		free(ctx->pKey);
 		ctx->pKey = NULL;
 	}
-	g_timeout_add_seconds(1, &reconnectMqttTimeoutCb, ctx);
+	deviceLater(ctx, 1, &reconnectMqttTimeoutCb);
 }
 
 IOTC_PRIVATE void checkCerts(IotcCtx *ctx) {
@@ -282,7 +662,7 @@ IOTC_PRIVATE void checkCerts(IotcCtx *ctx) {
 		char *csrString = csrToString(bundle);
 		if(csrString == NULL) {
 			certBundleFree(bundle);
-			g_timeout_add_seconds(1, &reconnectMqttTimeoutCb, ctx);
+			deviceLater(ctx, 1, &reconnectMqttTimeoutCb);
 #ifdef DEBUG
 			printf("[DEBUG] Cannot parse csr\n");
 #endif
@@ -296,6 +676,7 @@ IOTC_PRIVATE void checkCerts(IotcCtx *ctx) {
 		ctx->pKey = pKeyToString(bundle);
 		//httpPostAsync(SERVER_NAME, 80, "/tool/devapi/public/index.php/x509_device_register",
 		//		post, checkCertsCb, ctx);
+		deviceHold(ctx);
 		httpsPostAsync(SERVER_NAME, 443, "/tool/devapi/public/index.php/x509_device_register", 
 				NULL, 
 				NULL, 
@@ -307,7 +688,7 @@ IOTC_PRIVATE void checkCerts(IotcCtx *ctx) {
 			free(csr);
 		certBundleFree(bundle);
 	} else {
-		g_timeout_add_seconds(1, &reconnectMqttTimeoutCb, ctx);
+		deviceLater(ctx, 1, &reconnectMqttTimeoutCb);
 #ifdef DEBUG
 		printf("[ERROR] Certificate generation error");
 #endif
@@ -316,46 +697,217 @@ IOTC_PRIVATE void checkCerts(IotcCtx *ctx) {
 }
 
 IOTC_PRIVATE gboolean checkCertsTimeoutCb(gpointer userData) {
+	if(deviceRelease((IotcCtx *)userData))
+		return G_SOURCE_REMOVE;
 	checkCerts((IotcCtx *)userData);
 	return G_SOURCE_REMOVE;
 }
 
+// web server does not know rtt: take the one measured by device and saved in cache
+IOTC_PRIVATE void serverListCopyRtt(struct iotcServerList *list, const char *cacheFile) {
+	struct iotcServerList *cached = iotcServerListLoad(cacheFile);
+	struct iotcServerList *server, *old;
+	for(server=list; server!=NULL; server=server->next) {
+		for(old=cached; old!=NULL; old=old->next) {
+			if(strcmp(server->ip, old->ip) == 0) {
+				server->rtt = old->rtt;
+				break;
+			}
+		}
+	}
+	iotcServerListFree(cached);
+}
+
+// servers list got while device is using cached one: update cache and turn credentials
+IOTC_PRIVATE void webRefreshServersCb(struct iotcServerList *list, void *userData) {
+	IotcCtx *ctx = (IotcCtx *)userData;
+	struct iotcServerList **prev;
+	if(deviceRelease(ctx) || list == NULL) {
+		iotcServerListFree(list);
+		return;
+	}
+#ifdef DEBUG
+	printf("[DEBUG] Servers list refreshed\n");
+#endif
+	// keep registered server first
+	for(prev=&list; ctx->srvIp!=NULL && *prev!=NULL; prev=&((*prev)->next)) {
+		struct iotcServerList *server = *prev;
+		if(strcmp(server->ip, ctx->srvIp) == 0) {
+			free(ctx->turnUsername);
+			free(ctx->turnPassword);
+			ctx->turnUsername = strdup(server->username);
+			ctx->turnPassword = strdup(server->password);
+			*prev = server->next;
+			server->next = list;
+			list = server;
+			break;
+		}
+	}
+	serverListCopyRtt(list, ctx->serversCache);
+	iotcServerListSave(list, ctx->serversCache);
+	iotcServerListFree(list);
+}
+
 IOTC_PRIVATE void webGetServersCb(struct iotcServerList *list, void *userData) {
 	IotcCtx *ctx = (IotcCtx *)userData;
+	if(deviceRelease(ctx)) {
+		iotcServerListFree(list);
+		return;
+	}
 	ctx->serversList = list;
 	if(ctx->serversList == NULL) {
-		g_timeout_add_seconds(1, &checkCertsTimeoutCb, ctx);
+		deviceLater(ctx, 1, &checkCertsTimeoutCb);
 	} else {
-		g_timeout_add_seconds(1, &reconnectMqttTimeoutCb, ctx);
+		deviceLater(ctx, 1, &reconnectMqttTimeoutCb);
+	}
+}
+
+// connect to the first server of the list
+IOTC_PRIVATE void deviceConnectFirstServer(IotcCtx *ctx) {
+	IotcCtx *carrier;
+	// another hosted device is connected to the same server: share its connection
+	if(ctx->runtime->shareMqtt && (carrier = deviceFindCarrier(ctx, ctx->serversList->ip)) != NULL &&
+			mqttAddRoute(carrier->mqttCtx, ctx->uid, deviceMqttMessageCb, ctx)) {
+#ifdef DEBUG
+		printf("[DEBUG] Sharing connection of %s to server %s\n", carrier->uid, carrier->srvIp);
+#endif
+		ctx->carrier = carrier;
+		deviceRegistered(ctx, true);
+		return;
+	}
+#ifdef DEBUG
+	printf("[DEBUG] Try to connect to server: %s %s:%s\n", ctx->serversList->ip,
+			ctx->serversList->username, ctx->serversList->password);
+#endif
+	ctx->mqttCtx = mqttNew(ctx->uid, ctx->serversList->ip, 1883,
+			ctx->CAFile, ctx->CAPath, ctx->crtFile, ctx->keyFile,
+			deviceMqttConnectCb, NULL,
+			deviceMqttMessageCb, deviceMqttDisconnectCb, ctx);
+	if(ctx->mqttCtx == NULL) {
+		// connection failed
+		iotcServerListDeleteFirst(&(ctx->serversList));
+		deviceLater(ctx, 1, &reconnectMqttTimeoutCb);
+	}
+}
+
+IOTC_PRIVATE void serverListRemove(struct iotcServerList **list, struct iotcServerList *server) {
+	for(; *list!=NULL; list=&((*list)->next)) {
+		if(*list == server) {
+			iotcServerListDeleteFirst(list);
+			return;
+		}
 	}
 }
 
+// all probes are finished: put the winner first and drop servers not answering
+IOTC_PRIVATE void probeRoundEnd(struct probeRound *round) {
+	IotcCtx *ctx = round->ctx;
+	int i;
+	g_object_unref(round->cancellable);
+	if(deviceRelease(ctx)) {
+		free(round);
+		return;
+	}
+	for(i=0; i<round->count; i++)
+		if(round->probes[i].failed)
+			serverListRemove(&(ctx->serversList), round->probes[i].server);
+	if(round->winner != NULL) {
+		struct iotcServerList **prev;
+		for(prev=&(ctx->serversList); *prev!=round->winner; prev=&((*prev)->next));
+		*prev = round->winner->next;
+		round->winner->next = ctx->serversList;
+		ctx->serversList = round->winner;
+		free(round);
+		deviceConnectFirstServer(ctx);
+		return;
+	}
+	free(round);
+	// try next servers, or ask the list again if empty
+	deviceLater(ctx, 1, &reconnectMqttTimeoutCb);
+}
+
+IOTC_PRIVATE void probeConnectCb(GObject *sourceObject, GAsyncResult *res, gpointer userData) {
+	struct serverProbe *probe = (struct serverProbe *)userData;
+	struct probeRound *round = probe->round;
+	GSocketConnection *connection = g_socket_client_connect_to_host_finish(probe->client, res, NULL);
+	if(connection != NULL) {
+		probe->server->rtt = (g_get_monotonic_time() - round->start) / 1000;
+		if(round->winner == NULL) {
+#ifdef DEBUG
+			printf("[DEBUG] Server %s answered first\n", probe->server->ip);
+#endif
+			round->winner = probe->server;
+			g_cancellable_cancel(round->cancellable);
+		}
+		// mqtt opens its own connection
+		g_object_unref(connection);
+	} else if(!g_cancellable_is_cancelled(round->cancellable)) {
+#ifdef DEBUG
+		printf("[DEBUG] Server %s not reachable\n", probe->server->ip);
+#endif
+		probe->failed = true;
+	}
+	g_object_unref(probe->client);
+	if(--round->pending == 0)
+		probeRoundEnd(round);
+}
+
+// connect to first DEVICE_PROBE_PARALLEL servers at the same time, the fastest is used
+IOTC_PRIVATE void deviceProbeServers(IotcCtx *ctx) {
+	struct iotcServerList *server;
+	struct probeRound *round = (struct probeRound *)malloc(sizeof(struct probeRound));
+	if(round == NULL) {
+#ifdef DEBUG
+		printf("Malloc error: round\n");
+#endif
+		deviceConnectFirstServer(ctx);
+		return;
+	}
+	deviceHold(ctx);
+	round->ctx = ctx;
+	round->cancellable = g_cancellable_new();
+	round->winner = NULL;
+	round->count = 0;
+	for(server=ctx->serversList; server!=NULL && round->count<DEVICE_PROBE_PARALLEL; server=server->next) {
+		struct serverProbe *probe = &(round->probes[round->count++]);
+		probe->round = round;
+		probe->server = server;
+		probe->failed = false;
+		probe->client = g_socket_client_new();
+		g_socket_client_set_timeout(probe->client, DEVICE_PROBE_TIMEOUT);
+	}
+	// all probes are counted before starting, so none can end the round early
+	round->pending = round->count;
+	round->start = g_get_monotonic_time();
+#ifdef DEBUG
+	printf("[DEBUG] Probing %d servers...\n", round->count);
+#endif
+	int i;
+	for(i=0; i<round->count; i++)
+		g_socket_client_connect_to_host_async(round->probes[i].client, round->probes[i].server->ip, 1883,
+				round->cancellable, probeConnectCb, &(round->probes[i]));
+}
+
 IOTC_PRIVATE void connectToServers(IotcCtx *ctx) {
 	if(ctx->serversList == NULL) {
 #ifdef DEBUG
 		printf("[DEBUG] Retrieving servers list...\n");
 #endif
+		deviceHold(ctx);
 		webDeviceGetServersAsync(ctx->CAFile, ctx->CAPath,
 				ctx->crtFile, ctx->keyFile, webGetServersCb, ctx);
+	} else if(ctx->serversList->next != NULL &&
+			!(ctx->runtime->shareMqtt && deviceFindCarrier(ctx, ctx->serversList->ip) != NULL)) {
+		deviceProbeServers(ctx);
 	} else {
-#ifdef DEBUG
-		printf("[DEBUG] Try to connect to server: %s %s:%s\n", ctx->serversList->ip,
-				ctx->serversList->username, ctx->serversList->password);
-#endif
-		ctx->mqttCtx = mqttNew(ctx->uid, ctx->serversList->ip, 1883,
-				ctx->CAFile, ctx->CAPath, ctx->crtFile, ctx->keyFile,
-				deviceMqttConnectCb, NULL,
-				deviceMqttMessageCb, deviceMqttDisconnectCb, ctx);
-		if(ctx->mqttCtx == NULL) {
-			// connection failed
-			iotcServerListDeleteFirst(&(ctx->serversList));
-			g_timeout_add_seconds(1, &reconnectMqttTimeoutCb, ctx);
-		}
+		deviceConnectFirstServer(ctx);
 	}
 }
 
 IOTC_PRIVATE gboolean restartSSDPServerCb(gpointer userData) {
 	IotcCtx *ctx = (IotcCtx *)userData;
+	if(deviceRelease(ctx))
+		return G_SOURCE_REMOVE;
 	manageSSDPServer(ctx);
 	return G_SOURCE_REMOVE;
 }
@@ -364,7 +916,7 @@ IOTC_PRIVATE void manageSSDPServer(IotcCtx *ctx) {
 	// Roby: originale
 	if(!startSSDPServer(ctx->gloop, "DigitalSecurityCamera", "schemas-urmet-com", "Camera", "URMET",
 			SERVER_NAME, "Model 0", "0.0.1", "", "00000000000000000001", ctx->uid))
-		g_timeout_add_seconds(5, &restartSSDPServerCb, ctx);
+		deviceLater(ctx, 5, &restartSSDPServerCb);
 
 	//Roby new
 	// if(!startSSDPServer(ctx->gloop, NULL, NULL, NULL, NULL,
@@ -388,19 +940,41 @@ void ctrlCHandler(int sig) {
 }
 */
 
-int iotcInitDevice(char *uid, char *basePath) {
-	printf("IOT v.%s\n", VERSION);
-	g_type_init();
-
+IOTC_PRIVATE IotcCtx *deviceCtxNew(IotcRuntime *runtime, const char *uid, const char *basePath) {
 	IotcCtx *ctx = (IotcCtx *)malloc(sizeof(IotcCtx));
-	ctx->gloop = g_main_loop_new(NULL, FALSE);
+	if(ctx == NULL) {
+#ifdef DEBUG
+		printf("Malloc error: ctx\n");
+#endif
+		return NULL;
+	}
+	ctx->gloop = runtime->gloop;
+	ctx->removable = false;
 	ctx->srvIp = NULL;
 	ctx->turnUsername = NULL;
 	ctx->turnPassword = NULL;
 	ctx->mqttCtx = NULL;
 	ctx->serversList = NULL;
-	ctx->uid = uid != NULL ? strdup(uid) : "DUMMY";
+	ctx->uid = strdup(uid != NULL ? uid : "DUMMY");
 	ctx->pKey = NULL;
+	ctx->policy = NULL;
+	ctx->runtime = runtime;
+	ctx->carrier = NULL;
+	ctx->next = NULL;
+	ctx->sessions = NULL;
+	ctx->refs = 1;
+	ctx->removed = false;
+	ctx->reconnectFailures = 0;
+	ctx->standbyMqtt = NULL;
+	ctx->standby = NULL;
+	ctx->standbyUp = false;
+#ifdef ICE_INTERFACE_DENY
+	CandidatePolicy policy;
+	memset(&policy, 0, sizeof(CandidatePolicy));
+	policy.interfaceDeny = g_strsplit(ICE_INTERFACE_DENY, ",", 0);
+	ctx->policy = iceCandidatePolicyDup(&policy);
+	g_strfreev(policy.interfaceDeny);
+#endif
 
 	// 11 because strlen("cacert.pem") = strlen("device.crt") = strlen("device.key") = 10 + 1 for \0
 	int length = strlen(basePath) + 11;
@@ -411,6 +985,67 @@ int iotcInitDevice(char *uid, char *basePath) {
 	snprintf(ctx->crtFile, length, "%sdevice.crt", basePath);
 	ctx->keyFile = (char *)malloc(length+11);
 	snprintf(ctx->keyFile, length, "%sdevice.key", basePath);
+	// hosts of the LAN that clients can reach through this device
+	char *gatewayFile = g_strdup_printf("%sgateway.conf", basePath);
+	ctx->gateway = iceGatewayLoad(gatewayFile);
+	g_free(gatewayFile);
+	// AF_UNIX sockets of this device that clients can reach
+	char *unixPathsFile = g_strdup_printf("%sunixpaths.conf", basePath);
+	ctx->unixPaths = iceUnixPathsLoad(unixPathsFile);
+	g_free(unixPathsFile);
+	ctx->serversCache = g_strdup_printf("%sservers.cache", basePath);
+	return ctx;
+}
+
+IotcRuntime *iotcRuntimeNew() {
+	g_type_init();
+	IotcRuntime *runtime = (IotcRuntime *)malloc(sizeof(IotcRuntime));
+	if(runtime == NULL) {
+#ifdef DEBUG
+		printf("Malloc error: runtime\n");
+#endif
+		return NULL;
+	}
+	runtime->gloop = g_main_loop_new(NULL, FALSE);
+	runtime->devices = NULL;
+	runtime->shareMqtt = false;
+	runtime->hotStandby = false;
+	// first requests find web server address in cache
+	dnsPrefetch(IOTC_VHOST);
+#ifdef MQTT_THREADED_LOOP
+	runtime->offers = msgQueueNew(DEVICE_OFFER_QUEUE, sizeof(struct deviceOffer) + DEVICE_OFFER_MAX_SDP,
+			deviceOfferCb, runtime);
+	if(runtime->offers == NULL) {
+		g_main_loop_unref(runtime->gloop);
+		free(runtime);
+		return NULL;
+	}
+#endif
+	return runtime;
+}
+
+bool iotcRuntimeAddDevice(IotcRuntime *runtime, const char *uid, const char *basePath) {
+	IotcCtx *ctx;
+	if(runtime == NULL || uid == NULL || basePath == NULL)
+		return false;
+	for(ctx=runtime->devices; ctx!=NULL; ctx=ctx->next)
+		if(strcmp(ctx->uid, uid) == 0)
+			return false;
+	ctx = deviceCtxNew(runtime, uid, basePath);
+	if(ctx == NULL)
+		return false;
+	ctx->next = runtime->devices;
+	runtime->devices = ctx;
+	// servers of last boot are used at once, list is asked again in background
+	ctx->serversList = iotcServerListLoad(ctx->serversCache);
+	if(ctx->serversList != NULL) {
+#ifdef DEBUG
+		printf("[DEBUG] Using cached servers list\n");
+#endif
+		deviceHold(ctx);
+		webDeviceGetServersAsync(ctx->CAFile, ctx->CAPath,
+				ctx->crtFile, ctx->keyFile, webRefreshServersCb, ctx);
+	}
 
 //	startSSDPServer(ctx->gloop, "DigitalSecurityCamera", "schemas-urmet-com", "Camera", "URMET",
 //			"http://www.cloud.urmet.com", "Model 0", "0.0.1", "", "00000000000000000001", ctx->uid);
@@ -422,16 +1057,91 @@ int iotcInitDevice(char *uid, char *basePath) {
 */
 
 	connectToServers(ctx);
-/*
-	ctxG = ctx;
-	signal(SIGINT, ctrlCHandler);
-*/
+	return true;
+}
+
+bool iotcRuntimeRemoveDevice(IotcRuntime *runtime, const char *uid) {
+	IotcCtx **prev, *ctx;
+	if(runtime == NULL || uid == NULL)
+		return false;
+	for(prev=&(runtime->devices); *prev!=NULL; prev=&((*prev)->next))
+		if(strcmp((*prev)->uid, uid) == 0)
+			break;
+	if(*prev == NULL)
+		return false;
+	ctx = *prev;
+	*prev = ctx->next;
+	// pending callbacks see removed flag and stop, last one frees ctx
+	ctx->removed = true;
+	stopSSDPServer(ctx->uid);
+	if(ctx->carrier != NULL)
+		mqttRemoveRoute(ctx->carrier->mqttCtx, ctx->uid);
+	deviceDetachCarried(ctx);
+	mqttFree(ctx->mqttCtx);
+	ctx->mqttCtx = NULL;
+	deviceStandbyFree(ctx);
+	while(ctx->sessions != NULL) {
+		struct deviceSession *session = (struct deviceSession *)ctx->sessions->data;
+		ctx->sessions = g_slist_delete_link(ctx->sessions, ctx->sessions);
+		iceFree(session->iceAgent);
+		free(session);
+	}
+	deviceRelease(ctx);
+	return true;
+}
+
+void iotcRuntimeShareMqtt(IotcRuntime *runtime, bool share) {
+	runtime->shareMqtt = share;
+}
+
+void iotcRuntimeHotStandby(IotcRuntime *runtime, bool standby) {
+	runtime->hotStandby = standby;
+}
+
+void iotcRuntimeRun(IotcRuntime *runtime) {
 #ifdef DEBUG
 	printf("Entering main loop...\n");
 #endif
-	g_main_loop_run(ctx->gloop);
+	g_main_loop_run(runtime->gloop);
 	printf("Exit main loop...\n");
-	g_main_loop_unref(ctx->gloop);
+}
+
+void iotcRuntimeQuit(IotcRuntime *runtime) {
+	g_main_loop_quit(runtime->gloop);
+}
+
+void iotcRuntimeFree(IotcRuntime *runtime) {
+	if(runtime == NULL)
+		return;
+	while(runtime->devices != NULL)
+		iotcRuntimeRemoveDevice(runtime, runtime->devices->uid);
+#ifdef MQTT_THREADED_LOOP
+	// mqtt threads are stopped: release devices held by offers still queued
+	msgQueueFlush(runtime->offers);
+	msgQueueFree(runtime->offers);
+#endif
+	g_main_loop_unref(runtime->gloop);
+	free(runtime);
+}
+
+int iotcInitDevice(char *uid, char *basePath) {
+	printf("IOT v.%s\n", VERSION);
+	IotcRuntime *runtime = iotcRuntimeNew();
+	if(runtime == NULL)
+		return -1;
+	if(!iotcRuntimeAddDevice(runtime, uid != NULL ? uid : "DUMMY", basePath)) {
+#ifdef DEBUG
+		printf("Cannot start device %s\n", uid != NULL ? uid : "DUMMY");
+#endif
+		iotcRuntimeFree(runtime);
+		return -1;
+	}
+/*
+	ctxG = ctx;
+	signal(SIGINT, ctrlCHandler);
+*/
+	iotcRuntimeRun(runtime);
+	iotcRuntimeFree(runtime);
 	return 0;
 }
 //#endif // IOTC_CLIENT
@@ -480,15 +1190,10 @@ IOTC_PRIVATE void clientStatusChangedCb(IotcCtx *ctx, IceAgent *iceAgent, const
 	}
 }
 
-IOTC_PRIVATE void clientReadyCb(IotcCtx *ctx, IceAgent *iceAgent, char *localSdp, void *userData) {
-	struct connectUserData *data = (struct connectUserData *)userData;
-	const char *remoteSdp = NULL;
-	const char *(*getRemoteSdp)(char *uid, char *localSdp, void *userData) = data->getRemoteSdp;	
-	if(getRemoteSdp != NULL)
-		remoteSdp = getRemoteSdp(data->uid, localSdp, data->userData);
+// remoteSdp NULL means device sdp could not be obtained
+IOTC_PRIVATE void clientApplyRemoteSdp(struct connectUserData *data, const char *remoteSdp) {
 	if(remoteSdp != NULL) {
-		iceSetRemoteSdp(iceAgent, remoteSdp);
-		free((void *)remoteSdp);
+		iceSetRemoteSdp(data->iotcAgent->iceAgent, remoteSdp);
 	} else {
 		void (*connectionStatusCb)(IotcAgent *iotcAgent, const char *status,
 				ConnectionType connType, char *remoteIp, void *userData) = data->connectionStatusCb;
@@ -496,9 +1201,46 @@ IOTC_PRIVATE void clientReadyCb(IotcCtx *ctx, IceAgent *iceAgent, char *localSdp
 			connectionStatusCb(data->iotcAgent, "failed", CONNECTION_NONE, "", data->userData);
 //		iceStop(iceAgent);
 	}
+}
+
+IOTC_PRIVATE void clientReadyCb(IotcCtx *ctx, IceAgent *iceAgent, char *localSdp, void *userData) {
+	struct connectUserData *data = (struct connectUserData *)userData;
+	const char *remoteSdp = NULL;
+	const char *(*getRemoteSdp)(char *uid, char *localSdp, void *userData) = data->getRemoteSdp;	
+	void (*onLocalSdp)(IotcAgent *iotcAgent, char *uid, char *localSdp, void *userData) = data->onLocalSdp;
+	if(onLocalSdp != NULL) {
+		// remote sdp arrives later through iotcSetRemoteSdp()
+		onLocalSdp(data->iotcAgent, data->uid, localSdp, data->userData);
+		data->iotcAgent->removable = true;
+		return;
+	}
+	if(getRemoteSdp != NULL)
+		remoteSdp = getRemoteSdp(data->uid, localSdp, data->userData);
+	clientApplyRemoteSdp(data, remoteSdp);
+	if(remoteSdp != NULL)
+		free((void *)remoteSdp);
 	data->iotcAgent->removable = true;
 }
 
+IOTC_PRIVATE gboolean clientRemoteSdpCb(gpointer userData) {
+	struct remoteSdpHop *hop = (struct remoteSdpHop *)userData;
+	struct connectUserData *data = hop->data;
+	bool disconnected;
+	pthread_mutex_lock(&data->lock);
+	disconnected = data->disconnected;
+	pthread_mutex_unlock(&data->lock);
+	if(!disconnected)
+		clientApplyRemoteSdp(data, hop->remoteSdp);
+	if(hop->remoteSdp != NULL)
+		free(hop->remoteSdp);
+	free(hop);
+	// iotcDisconnect() may free data as soon as this is released
+	pthread_mutex_lock(&data->lock);
+	data->remoteSdpPending--;
+	pthread_mutex_unlock(&data->lock);
+	return G_SOURCE_REMOVE;
+}
+
 IotcCtx *iotcInitClient() {
 	printf("IOT v.%s\n", VERSION);
 #if !GLIB_CHECK_VERSION(2, 36, 0)
@@ -508,6 +1250,7 @@ IotcCtx *iotcInitClient() {
 	IotcCtx *ctx = (IotcCtx *)malloc(sizeof(IotcCtx));
 	ctx->gloop = gloop;
 	ctx->removable = false;
+	ctx->policy = NULL;
 	pthread_t threadId;
 	pthread_create(&threadId, NULL, &clientThreadInit, ctx);
 	pthread_detach(threadId);
@@ -518,25 +1261,38 @@ void iotcDeinit(IotcCtx *iotcCtx) {
 	g_main_loop_quit(iotcCtx->gloop);
 	while(!iotcCtx->removable)
 		sleep(1);
+	iceCandidatePolicyFree(iotcCtx->policy);
 	free(iotcCtx);
 }
 
-IotcAgent *iotcConnect(IotcCtx *ctx, const char *uid,
+void iotcSetCandidatePolicy(IotcCtx *ctx, const CandidatePolicy *policy) {
+	CandidatePolicy *old = ctx->policy;
+	ctx->policy = iceCandidatePolicyDup(policy);
+	iceCandidatePolicyFree(old);
+}
+
+IOTC_PRIVATE IotcAgent *clientConnect(IotcCtx *ctx, const char *uid,
 		const char *serverIp, const char *serverUsername, const char *serverPassword,
 		const char *(*getRemoteSdp)(char *uid, char *localSdp, void *userData),
+		void (*onLocalSdp)(IotcAgent *iotcAgent, char *uid, char *localSdp, void *userData),
 		void (*connectionStatusCb)(IotcAgent *iotcAgent, const char *status,
 				ConnectionType connType, char *remoteIp, void *userData),
 		void *userData) {
 	struct connectUserData *connectUserData = (struct connectUserData *)malloc(sizeof(struct connectUserData));
 	connectUserData->uid = uid != NULL ? strdup(uid) : NULL;
 	connectUserData->getRemoteSdp = getRemoteSdp;
+	connectUserData->onLocalSdp = onLocalSdp;
 	connectUserData->connectionStatusCb = connectionStatusCb;
 	connectUserData->userData = userData;
+	connectUserData->context = g_main_loop_get_context(ctx->gloop);
+	pthread_mutex_init(&connectUserData->lock, NULL);
+	connectUserData->remoteSdpPending = 0;
+	connectUserData->disconnected = false;
 	IotcAgent *iotcAgent = (IotcAgent *)malloc(sizeof(IotcAgent));
 	connectUserData->iotcAgent = iotcAgent;
 	iotcAgent->connectUserData = connectUserData;
 	iotcAgent->iceAgent = iceNew(ctx, ctx->gloop, serverIp, 3478, serverUsername, serverPassword,
-			clientReadyCb, clientStatusChangedCb, (void *)connectUserData);
+			ctx->policy, clientReadyCb, clientStatusChangedCb, (void *)connectUserData);
 	iotcAgent->removable = false;
 	if(iotcAgent->iceAgent == NULL) {
 #ifdef DEBUG
@@ -544,6 +1300,7 @@ IotcAgent *iotcConnect(IotcCtx *ctx, const char *uid,
 #endif
 		if(connectUserData->uid != NULL)
 			free(connectUserData->uid);
+		pthread_mutex_destroy(&connectUserData->lock);
 		free(connectUserData);
 		free(iotcAgent);
 		return NULL;
@@ -551,23 +1308,146 @@ IotcAgent *iotcConnect(IotcCtx *ctx, const char *uid,
 	return iotcAgent;
 }
 
+IotcAgent *iotcConnect(IotcCtx *ctx, const char *uid,
+		const char *serverIp, const char *serverUsername, const char *serverPassword,
+		const char *(*getRemoteSdp)(char *uid, char *localSdp, void *userData),
+		void (*connectionStatusCb)(IotcAgent *iotcAgent, const char *status,
+				ConnectionType connType, char *remoteIp, void *userData),
+		void *userData) {
+	return clientConnect(ctx, uid, serverIp, serverUsername, serverPassword,
+			getRemoteSdp, NULL, connectionStatusCb, userData);
+}
+
+IotcAgent *iotcConnectAsync(IotcCtx *ctx, const char *uid,
+		const char *serverIp, const char *serverUsername, const char *serverPassword,
+		void (*onLocalSdp)(IotcAgent *iotcAgent, char *uid, char *localSdp, void *userData),
+		void (*connectionStatusCb)(IotcAgent *iotcAgent, const char *status,
+				ConnectionType connType, char *remoteIp, void *userData),
+		void *userData) {
+	return clientConnect(ctx, uid, serverIp, serverUsername, serverPassword,
+			NULL, onLocalSdp, connectionStatusCb, userData);
+}
+
+bool iotcSetRemoteSdp(IotcAgent *iotcAgent, const char *remoteSdp) {
+	struct connectUserData *data;
+	struct remoteSdpHop *hop;
+	GSource *source;
+	if(iotcAgent == NULL)
+		return false;
+	data = iotcAgent->connectUserData;
+	hop = (struct remoteSdpHop *)malloc(sizeof(struct remoteSdpHop));
+	if(hop == NULL) {
+#ifdef DEBUG
+		printf("Malloc error: hop\n");
+#endif
+		return false;
+	}
+	hop->data = data;
+	hop->remoteSdp = remoteSdp != NULL ? strdup(remoteSdp) : NULL;
+	pthread_mutex_lock(&data->lock);
+	if(data->disconnected) {
+		pthread_mutex_unlock(&data->lock);
+		if(hop->remoteSdp != NULL)
+			free(hop->remoteSdp);
+		free(hop);
+		return false;
+	}
+	data->remoteSdpPending++;
+	pthread_mutex_unlock(&data->lock);
+	// always deferred, also when invoked on client loop (ex.: from onLocalSdp)
+	source = g_idle_source_new();
+	g_source_set_callback(source, clientRemoteSdpCb, hop, NULL);
+	g_source_attach(source, data->context);
+	g_source_unref(source);
+	return true;
+}
+
+// wait for client loop: run it here when invoked from one of its callbacks, nobody else would
+IOTC_PRIVATE void clientWaitLoop(struct connectUserData *data) {
+	if(g_main_context_is_owner(data->context))
+		g_main_context_iteration(data->context, TRUE);
+	else
+		sleep(1);
+}
+
 void iotcDisconnect(IotcAgent *iotcAgent) {
-	iotcAgent->connectUserData->getRemoteSdp = NULL;
-	iotcAgent->connectUserData->connectionStatusCb = NULL;
+	struct connectUserData *data = iotcAgent->connectUserData;
+	data->getRemoteSdp = NULL;
+	data->onLocalSdp = NULL;
+	data->connectionStatusCb = NULL;
 	while(!iotcAgent->removable)
-		sleep(1);
+		clientWaitLoop(data);
+	// remote sdp already passed to client loop must be released there
+	pthread_mutex_lock(&data->lock);
+	data->disconnected = true;
+	while(data->remoteSdpPending > 0) {
+		pthread_mutex_unlock(&data->lock);
+		clientWaitLoop(data);
+		pthread_mutex_lock(&data->lock);
+	}
+	pthread_mutex_unlock(&data->lock);
 	iceFree(iotcAgent->iceAgent);
-	if(iotcAgent->connectUserData->uid != NULL)
-		free(iotcAgent->connectUserData->uid);
-	free(iotcAgent->connectUserData);
+	if(data->uid != NULL)
+		free(data->uid);
+	pthread_mutex_destroy(&data->lock);
+	free(data);
 	free(iotcAgent);
 }
 
+bool iotcGetCandidateStats(IotcAgent *iotcAgent, CandidateStats *stats) {
+	return iotcAgent != NULL && iceGetCandidateStats(iotcAgent->iceAgent, stats);
+}
+
 bool portMap(IotcAgent *iotcAgent, unsigned short localPort, unsigned short remotePort,
 		TunnelProtocols proto) {
 	return icePortMap(iotcAgent->iceAgent, localPort, remotePort, proto);
 }
 
+bool portMapPool(IotcAgent *iotcAgent, unsigned short localPort, unsigned short remotePort,
+		TunnelProtocols proto, int poolSize) {
+	return icePortMapPool(iotcAgent->iceAgent, localPort, remotePort, proto, poolSize);
+}
+
+bool portMapFanout(IotcAgent *iotcAgent, unsigned short localPort, unsigned short remotePort) {
+	return icePortMapFanout(iotcAgent->iceAgent, localPort, remotePort);
+}
+
+bool portMapInterleaved(IotcAgent *iotcAgent, unsigned short localPort, unsigned short remotePort) {
+	return icePortMapInterleaved(iotcAgent->iceAgent, localPort, remotePort);
+}
+
+bool portMapPath(IotcAgent *iotcAgent, const char *localPath, unsigned short localPort,
+		const char *remotePath, unsigned short remotePort, TunnelProtocols proto) {
+	return icePortMapPath(iotcAgent->iceAgent, localPath, localPort, remotePath, remotePort, proto);
+}
+
+bool portMapHost(IotcAgent *iotcAgent, unsigned short localPort, const char *remoteHost,
+		unsigned short remotePort, TunnelProtocols proto) {
+	return icePortMapHost(iotcAgent->iceAgent, localPort, remoteHost, remotePort, proto);
+}
+
+int iotcChannelOpen(IotcAgent *iotcAgent, unsigned short remotePort, TunnelProtocols proto,
+		void (*onData)(int channel, char *data, int len, void *userData),
+		void (*onClose)(int channel, void *userData), void *userData) {
+	return iceChannelOpen(iotcAgent->iceAgent, remotePort, proto, onData, onClose, userData);
+}
+
+int iotcChannelWrite(IotcAgent *iotcAgent, int ch, const char *data, int len) {
+	return iceChannelWrite(iotcAgent->iceAgent, ch, data, len);
+}
+
+char *iotcChannelBuffer(IotcAgent *iotcAgent, int ch, int *size) {
+	return iceChannelBuffer(iotcAgent->iceAgent, ch, size);
+}
+
+bool iotcChannelCommit(IotcAgent *iotcAgent, int ch, int len) {
+	return iceChannelCommit(iotcAgent->iceAgent, ch, len);
+}
+
+void iotcChannelClose(IotcAgent *iotcAgent, int ch) {
+	iceChannelClose(iotcAgent->iceAgent, ch);
+}
+
 IOTC_PRIVATE void discoveryEndCb(struct deviceDiscoveredList *list, void *userData) {
 	((void (*)(struct deviceDiscoveredList *))userData)(list);
 }
@@ -110,6 +110,55 @@ typedef enum {
 	STATUS_TIMEOUT,		/**< Agent cannot comunicate to remote end point for too much time */
 } AgentStatus;
 
+/**
+ * @brief IP version preference applied to ICE candidates
+ */
+typedef enum {
+	IP_ANY,		/**< Use both IPv4 and IPv6 candidates */
+	IP_PREFER_V4,	/**< Drop IPv6 candidates of a type when an IPv4 candidate of the same type exists */
+	IP_PREFER_V6,	/**< Drop IPv4 candidates of a type when an IPv6 candidate of the same type exists */
+	IP_ONLY_V4,	/**< Never use IPv6 candidates */
+	IP_ONLY_V6,	/**< Never use IPv4 candidates */
+} IpPreference;
+
+/**
+ * @brief Usage of the relay (turn) server
+ */
+typedef enum {
+	RELAY_ALLOWED,	/**< Relay candidates are used together with all other candidates */
+	RELAY_ONLY,	/**< Only relay candidates are published and checked */
+	RELAY_NONE,	/**< No relay is allocated and remote relay candidates are ignored */
+} RelayMode;
+
+/**
+ * @brief Policy used to filter ICE candidates before they are published or checked
+ *
+ * Every field set to 0/NULL keeps the default behaviour, so a zeroed policy does not filter anything.
+ * Interface lists contain name prefixes, so "docker" matches docker0, docker1...
+ */
+typedef struct {
+	char **interfaceAllow;	/**< NULL terminated list of interfaces used for gathering, NULL for all */
+	char **interfaceDeny;	/**< NULL terminated list of interfaces never used for gathering (ex.: "docker", "veth", "tun") */
+	int maxHost;		/**< Max number of host candidates, 0 means no limit */
+	int maxSrflx;		/**< Max number of server reflexive candidates, 0 means no limit */
+	int maxRelay;		/**< Max number of relay candidates, 0 means no limit */
+	IpPreference ipPreference;
+	RelayMode relayMode;
+} CandidatePolicy;
+
+/**
+ * @brief Statistics about candidates filtered by a CandidatePolicy
+ */
+typedef struct {
+	int addressesSkipped;	/**< Local interface addresses excluded from gathering by interface lists */
+	int localGathered;	/**< Local candidates gathered, all of them are used by ICE checks */
+	int localPublished;	/**< Local candidates published into SDP */
+	int localPruned;	/**< Local candidates gathered but not published */
+	int remoteAccepted;	/**< Remote candidates passed to ICE checks */
+	int remotePruned;	/**< Remote candidates discarded */
+	int pairsPruned;	/**< Candidate pairs not checked because their remote candidate was discarded */
+} CandidateStats;
+
 /**
  * @brief The struct used to list and describe discovered devices
  *
@@ -126,14 +175,98 @@ struct deviceDiscoveredList {
 /**
  * @brief Start device. This function lock until device stop working.
  *
- * @param uid The uid of this device
+ * @param uid The uid of this device, NULL for "DUMMY"
  * @param basePath The path where configuration files are written
  * 	(no more than 20KB should be written and no more than 10 files)
  * 	the path must terminate with character '/'
+ * @return 0 when device stops working, -1 if it cannot be started
  * @note User that launches application must have read/write permissions
  * 	on the specified path
  */
 int iotcInitDevice(char *uid, char *basePath);
+
+/**
+ * @brief Runtime hosting many devices in the same process
+ *
+ * Devices share the main loop and the worker threads of the process, every device has its own
+ * certificates, connection to the server and SSDP announcement.
+ * @see iotcRuntimeNew()
+ */
+typedef struct iotcRuntime IotcRuntime;
+
+/**
+ * @brief Create a runtime without devices
+ *
+ * @return The runtime, to be deallocated using iotcRuntimeFree(), or NULL if an error occurred
+ */
+IotcRuntime *iotcRuntimeNew();
+
+/**
+ * @brief Add a device to the runtime
+ *
+ * Device starts connecting to the server as soon as runtime main loop runs. It can be called
+ * before iotcRuntimeRun() or from the runtime main loop.
+ * @param runtime The runtime created using iotcRuntimeNew()
+ * @param uid The unique id of the device
+ * @param basePath The path where configuration files of the device are written
+ * @return A boolean value: true if the device has been added, false if uid is already hosted
+ */
+bool iotcRuntimeAddDevice(IotcRuntime *runtime, const char *uid, const char *basePath);
+
+/**
+ * @brief Remove a device from the runtime, closing its connections
+ *
+ * It must be called from the runtime main loop.
+ * @param runtime The runtime created using iotcRuntimeNew()
+ * @param uid The unique id of the device
+ * @return A boolean value: true if the device has been removed, false if uid is not hosted
+ */
+bool iotcRuntimeRemoveDevice(IotcRuntime *runtime, const char *uid);
+
+/**
+ * @brief Let devices connected to the same server share a single mqtt connection
+ *
+ * The first device connected to a server carries the messages of the next devices connecting
+ * to it, so the runtime keeps one connection (and one network thread) per server.
+ * When the shared connection is lost every device connects again.
+ * @param runtime The runtime created using iotcRuntimeNew()
+ * @param share true to share connections (applied to next connections), false otherwise (default)
+ * @note The broker must allow the certificate of the first device to subscribe topics of the others
+ */
+void iotcRuntimeShareMqtt(IotcRuntime *runtime, bool share);
+
+/**
+ * @brief Keep a standby mqtt connection to a second server
+ *
+ * Each device connects also to the server following the registered one in servers list and
+ * subscribes its topic there: offers sent to both servers keep arriving while the main connection
+ * is lost, and the standby connection replaces it if the registered server does not come back.
+ * Devices carried by a shared connection have no standby connection.
+ * @param runtime The runtime created using iotcRuntimeNew()
+ * @param standby true to keep standby connections (applied to next registrations), false otherwise (default)
+ */
+void iotcRuntimeHotStandby(IotcRuntime *runtime, bool standby);
+
+/**
+ * @brief Run the main loop of the runtime. This function lock until iotcRuntimeQuit() is called
+ *
+ * @param runtime The runtime created using iotcRuntimeNew()
+ */
+void iotcRuntimeRun(IotcRuntime *runtime);
+
+/**
+ * @brief Stop the main loop of the runtime, it can be called from any thread
+ *
+ * @param runtime The runtime created using iotcRuntimeNew()
+ */
+void iotcRuntimeQuit(IotcRuntime *runtime);
+
+/**
+ * @brief Remove all devices and deallocate the runtime
+ *
+ * @param runtime The runtime created using iotcRuntimeNew() (can be NULL)
+ */
+void iotcRuntimeFree(IotcRuntime *runtime);
 //#endif // IOTC_CLIENT
 
 /**
@@ -159,6 +292,18 @@ IotcCtx *iotcInitClient();
  */
 void iotcDeinit(IotcCtx *iotcCtx);
 
+/**
+ * @brief Set the candidate policy used by next connections
+ *
+ * The policy is copied, so caller can free it after this call. Agents already created
+ * keep using the policy they were created with.
+ *
+ * @param ctx The IotcCtx created using iotcInitClient()
+ * @param policy The policy to apply or NULL to restore default behaviour
+ * @see CandidatePolicy
+ */
+void iotcSetCandidatePolicy(IotcCtx *ctx, const CandidatePolicy *policy);
+
 /**
  * @brief Connect to a device
  *
@@ -196,14 +341,61 @@ IotcAgent *iotcConnect(IotcCtx *ctx, const char *uid,
 				ConnectionType connType, char *remoteIp, void *userData),
 		void *userData);
 
+/**
+ * @brief Connect to a device without blocking the client loop for the device sdp
+ *
+ * Same as iotcConnect(), but the library hands out the sdp of this client and the
+ * application sends the sdp of the device back later using iotcSetRemoteSdp(), from any thread.
+ * The client loop keeps serving other agents while the sdp is exchanged with main server.
+ *
+ * @param ctx The IotcCtx created using iotcInitClient()
+ * @param uid The uid of the device to connect to
+ * @param serverIp The ip of a connection server obtained from main server
+ * @param serverUsername Username used for turn authentication
+ * @param serverPassword Password used for turn authentication
+ * @param onLocalSdp A callback invoked on the client loop when the sdp of this client is ready.
+ *	It must return immediately, e.g. after starting an async request to main server. Params are:
+ *	- iotcAgent The agent to pass to iotcSetRemoteSdp()
+ *	- uid The uid of the device
+ *	- localSdp The sdp of this client, valid only until callback returns
+ *	- userData The user data provided as parameter in this funtion
+ * @param connectionStatusCb A callback invoked when IceAgent status changes, as in iotcConnect()
+ * @param userData A pointer to data passed back to callbacks
+ * @return The IotcAgent of the connection or NULL if an error occurred
+ * @see iotcSetRemoteSdp()
+ * @see iotcDisconnect()
+ */
+IotcAgent *iotcConnectAsync(IotcCtx *ctx, const char *uid,
+		const char *serverIp, const char *serverUsername, const char *serverPassword,
+		void (*onLocalSdp)(IotcAgent *iotcAgent, char *uid, char *localSdp, void *userData),
+		void (*connectionStatusCb)(IotcAgent *iotcAgent, const char *status,
+				ConnectionType connType, char *remoteIp, void *userData),
+		void *userData);
+
+/**
+ * @brief Set the sdp of the device for an agent created using iotcConnectAsync()
+ *
+ * This function can be invoked from any thread: the sdp is copied and applied on the client loop.
+ * @param iotcAgent The agent created using iotcConnectAsync()
+ * @param remoteSdp The sdp of the device, or NULL if it could not be obtained: the agent
+ *	status becomes "failed"
+ * @return true if the sdp has been queued, false if an error occurred or the agent is
+ *	being disconnected
+ */
+bool iotcSetRemoteSdp(IotcAgent *iotcAgent, const char *remoteSdp);
+
 /**
  * @brief Disconnect an IotcAgent
  *
- * This function is used to disconnect an IotcAgent created using iotcConnect().
+ * This function is used to disconnect an IotcAgent created using iotcConnect() or
+ * iotcConnectAsync().
  * Disconnect must be called for every agent created when it is not needed anymore,
  * even if connection has not been correctly initialized.
  * Disconnect can be called even if connection has not been already completed.
  * After iotcDisconnect() the IotcAgent passed as parameter cannot be used anymore.
+ * When invoked from a callback of the client loop (ex.: connectionStatusCb or an async https
+ * callback) the loop is run here while waiting, so other callbacks can be invoked before it returns.
+ * It must not be invoked from onLocalSdp of iotcConnectAsync(): disconnect after it returns.
  * Every IotcAgent should be disconnected before invoke iotcDeinit()
  *
  * @param iotcAgent The agent to disconnect and destroy
@@ -211,6 +403,16 @@ IotcAgent *iotcConnect(IotcCtx *ctx, const char *uid,
  */
 void iotcDisconnect(IotcAgent *iotcAgent);
 
+/**
+ * @brief Get statistics about candidates filtered by the candidate policy
+ *
+ * @param iotcAgent The agent created using iotcConnect()
+ * @param[out] stats The structure filled with statistics
+ * @return true if stats are available, false otherwise
+ * @see iotcSetCandidatePolicy()
+ */
+bool iotcGetCandidateStats(IotcAgent *iotcAgent, CandidateStats *stats);
+
 /**
  * @brief Require a port mapping
  *
@@ -228,6 +430,151 @@ void iotcDisconnect(IotcAgent *iotcAgent);
 bool portMap(IotcAgent *iotcAgent, unsigned short localPort, unsigned short remotePort,
                 TunnelProtocols proto);
 
+/**
+ * @brief Require a port mapping with pre-opened connections
+ *
+ * Same as portMap(), but the device keeps poolSize connections to remotePort already open,
+ * so a new local connection does not wait for the device to connect to its service.
+ * Useful for services used through many short connections (ex.: snapshots, ONVIF requests).
+ * @param iotcAgent The agent used for connection to the device
+ * @param localPort The port on localhost (client) on which client will listen for incoming connections
+ * @param remotePort The port on the device where the desired service is listening
+ * @param proto The protocol used between final client and final server, only TCP and RTSP are accepted
+ * @param poolSize The number of connections kept open in advance (max 8)
+ * @return A boolean value, true if port mapping is correctly initialized, false otherwise
+ * @note Services that send data before receiving a request (ex.: banners) should not use a pool:
+ *	data received on a pre-opened connection not yet used is discarded
+ * @see portMap()
+ */
+bool portMapPool(IotcAgent *iotcAgent, unsigned short localPort, unsigned short remotePort,
+                TunnelProtocols proto, int poolSize);
+
+/**
+ * @brief Require a RTSP port mapping shared by many local viewers
+ *
+ * The device sends a stream only once, whatever the number of local viewers: the first
+ * connection on localPort opens the RTSP session on the device, the next connections asking
+ * the same url receive a copy of its RTP/RTCP packets.
+ * @param iotcAgent The agent used for connection to the device
+ * @param localPort The port on localhost (client) on which client will listen for incoming connections
+ * @param remotePort The RTSP port on the device
+ * @return A boolean value, true if port mapping is correctly initialized, false otherwise
+ * @note Only viewers on localhost using RTP over UDP share the stream, the others are served
+ *	by the device as with portMap(). When the first connection is closed all viewers sharing
+ *	its stream are disconnected too.
+ * @see portMap()
+ */
+bool portMapFanout(IotcAgent *iotcAgent, unsigned short localPort, unsigned short remotePort);
+
+/**
+ * @brief Require a RTSP port mapping using a single tunnel channel per connection
+ *
+ * Media of local viewers using RTP over UDP is carried inside the RTSP connection to the device
+ * (RTP/AVP/TCP interleaved transport), so no UDP channel pair is opened for every track.
+ * Viewers still receive RTP over UDP on localhost.
+ * @param iotcAgent The agent used for connection to the device
+ * @param localPort The port on localhost (client) on which client will listen for incoming connections
+ * @param remotePort The RTSP port on the device
+ * @return A boolean value, true if port mapping is correctly initialized, false otherwise
+ * @note Devices not supporting interleaved transport answer SETUP with an error. RTCP reports of
+ *	viewers are dropped while a request is being sent on the same connection.
+ * @see portMap()
+ */
+bool portMapInterleaved(IotcAgent *iotcAgent, unsigned short localPort, unsigned short remotePort);
+
+/**
+ * @brief Require a port mapping using AF_UNIX sockets instead of TCP ports
+ *
+ * Either end can be an AF_UNIX stream socket: local applications connect to localPath instead of
+ * localPort, and device connects to the service listening on remotePath instead of remotePort.
+ * Device serves only paths listed in unixpaths.conf file of its basePath (see iotcInitDevice()).
+ * @param iotcAgent The agent used for connection to the device
+ * @param localPath The path of the socket created on client, or NULL to listen on localPort
+ * @param localPort The port on localhost (client), used if localPath is NULL
+ * @param remotePath The path of the service socket on the device, or NULL to use remotePort
+ * @param remotePort The port on the device, used if remotePath is NULL
+ * @param proto The protocol of the service (P2P_TCP or P2P_RTSP)
+ * @return A boolean value, true if port mapping is correctly initialized, false otherwise
+ * @see portMap()
+ */
+bool portMapPath(IotcAgent *iotcAgent, const char *localPath, unsigned short localPort,
+		const char *remotePath, unsigned short remotePort, TunnelProtocols proto);
+
+/**
+ * @brief Require a port mapping to a host in the LAN of the device
+ *
+ * A single device can be used as gateway towards many hosts (ex.: IP cameras of a building),
+ * sharing one connection to the server and one ice connection with the client.
+ * Device serves only hosts listed in gateway.conf file of its basePath (see iotcInitDevice()).
+ * @param iotcAgent The agent used for connection to the device
+ * @param localPort The port on localhost (client) on which client will listen for incoming connections
+ * @param remoteHost The IPv4 address of the host in the LAN of device
+ * @param remotePort The port on the host
+ * @param proto The protocol of the service (P2P_TCP or P2P_RTSP)
+ * @return A boolean value, true if port mapping is correctly initialized, false otherwise
+ * @see portMap()
+ */
+bool portMapHost(IotcAgent *iotcAgent, unsigned short localPort, const char *remoteHost,
+		unsigned short remotePort, TunnelProtocols proto);
+
+/**
+ * @brief Open a channel to a device port without a local socket
+ *
+ * Alternative to portMap() for applications consuming tunnelled data in the same process:
+ * packets are passed to onData without crossing the loopback interface.
+ * @param iotcAgent The agent used for connection to the device
+ * @param remotePort The port on the device
+ * @param proto The protocol of the port on the device (P2P_TCP or P2P_UDP)
+ * @param onData Callback invoked with every packet received. data is valid only until the callback returns
+ * @param onClose Callback invoked when the device closes the channel (can be NULL)
+ * @param userData A pointer to data passed back to callbacks
+ * @return The channel, or -1 if an error occurred
+ * @see iceChannelOpen()
+ */
+int iotcChannelOpen(IotcAgent *iotcAgent, unsigned short remotePort, TunnelProtocols proto,
+		void (*onData)(int channel, char *data, int len, void *userData),
+		void (*onClose)(int channel, void *userData), void *userData);
+
+/**
+ * @brief Send data on a channel opened using iotcChannelOpen()
+ *
+ * @param iotcAgent The agent used for connection to the device
+ * @param ch The channel returned by iotcChannelOpen()
+ * @param data The data to send
+ * @param len The length of data
+ * @return The number of bytes taken (less than len when the tunnel is busy), or -1 if channel is not open
+ */
+int iotcChannelWrite(IotcAgent *iotcAgent, int ch, const char *data, int len);
+
+/**
+ * @brief Get the buffer where next packet of a channel can be written in place
+ *
+ * @param iotcAgent The agent used for connection to the device
+ * @param ch The channel returned by iotcChannelOpen()
+ * @param[out] size The space available in the buffer
+ * @return The buffer, or NULL if the tunnel is busy or channel is not open
+ * @see iotcChannelCommit()
+ */
+char *iotcChannelBuffer(IotcAgent *iotcAgent, int ch, int *size);
+
+/**
+ * @brief Send the packet written in the buffer returned by iotcChannelBuffer()
+ *
+ * @param iotcAgent The agent used for connection to the device
+ * @param ch The channel returned by iotcChannelOpen()
+ * @param len The length of the packet
+ * @return A boolean value, true if the packet has been taken, false otherwise
+ */
+bool iotcChannelCommit(IotcAgent *iotcAgent, int ch, int len);
+
+/**
+ * @brief Close a channel opened using iotcChannelOpen()
+ *
+ * @param iotcAgent The agent used for connection to the device
+ * @param ch The channel returned by iotcChannelOpen()
+ */
+void iotcChannelClose(IotcAgent *iotcAgent, int ch);
+
 /**
  * @brief Discover devices in the same LAN of the client
  *
@@ -24,41 +24,42 @@ void discoveryCb(struct deviceDiscoveredList *list) {
 	}
 }
 
-const char *getRemoteSdp(char *uid, char *localSdp, void *userData) {
-	printf("getRemoteSdp: %s, %s\n", uid, localSdp);
-	char *response;
+void remoteSdpCb(int code, char *response, void *userData) {
+	IotcAgent *agent = (IotcAgent *)userData;
+	if(response == NULL) {
+		printf("[ERROR] response is null...\n");
+		iotcSetRemoteSdp(agent, NULL);
+		return;
+	}
+
+	char *startDevSdp = strstr(response, "ice_sdp_dev");
+	if(startDevSdp != NULL) {
+		startDevSdp += 14;
+		startDevSdp[strlen(startDevSdp)-2] = '\0';
+		iotcSetRemoteSdp(agent, startDevSdp);
+		return;
+	}
+	iotcSetRemoteSdp(agent, NULL);
+}
+
+void localSdpCb(IotcAgent *agent, char *uid, char *localSdp, void *userData) {
+	printf("localSdp: %s, %s\n", uid, localSdp);
 	char *sdpEncoded = pemToUrl(localSdp);
 	char *pathAndGet = (char *)malloc(strlen(uid) + strlen(sdpEncoded) + 70);
 	sprintf(pathAndGet, "/tool/webapi/private/index.php/iotc_connect/?uid=%s&ice_sdp_cli=%s", uid, sdpEncoded);
 	free(sdpEncoded);
 
-	httpsPost(SERVER_NAME, 443, pathAndGet, &response,
+	// response arrives on this loop while other agents keep running
+	if(httpsPostAsync(SERVER_NAME, 443, pathAndGet,
 			NULL, NULL, NULL, NULL,
-			WEBSERVICE_AUTHFORM);
+			WEBSERVICE_AUTHFORM, remoteSdpCb, agent) != 0)
+		iotcSetRemoteSdp(agent, NULL);
 
-//printf("********** getRemoteSdp: %s, %s\n", SERVER_NAME, pathAndGet);
-
-	//httpsPost("www.cloud.elkron.com", 443, pathAndGet, &response,
+	//httpsPostAsync("www.cloud.elkron.com", 443, pathAndGet,
 	//		NULL, NULL, NULL, NULL,
-	//		"httpd_username=dileo&httpd_password=dileo");
-
+	//		"httpd_username=dileo&httpd_password=dileo", remoteSdpCb, agent);
 
 	free(pathAndGet);
-	if(response == NULL) {
-		printf("[ERROR] response is null...\n");
-		return NULL;
-	}
-
-	char *startDevSdp = strstr(response, "ice_sdp_dev");
-	if(startDevSdp != NULL) {
-		startDevSdp += 14;
-		startDevSdp[strlen(startDevSdp)-2] = '\0';
-		char *ret = strdup(startDevSdp);
-		free(response);
-		return ret;
-	}
-	free(response);
-	return NULL;
 }
 
 void statusCb(IotcAgent *iotcAgent, const char *status, ConnectionType connType, char *remoteIp, void *userData) {
@@ -134,13 +135,13 @@ int testClient(char *uid, int localPort, int remotePort, TunnelProtocols proto)
 
 
 		printf("Connecting to %s...\n", uid);
-		iotcAgent = iotcConnect(
+		iotcAgent = iotcConnectAsync(
 				ctx,
 				uid,
 				ICE_SERVER,
 				ICE_SERVER_USER,
 				ICE_SERVER_PASS,
-				getRemoteSdp,
+				localSdpCb,
 				statusCb,
 				NULL);
 
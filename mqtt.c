@@ -15,19 +15,63 @@
 
 #include "library.h"
 #include "mqtt.h"
+#include "dns.h"
+#include "secure.h"
 #include <glib/glib.h>
+#include <pthread.h>
 
 #define MQTT_PING_TIMEOUT 15
 #define MQTT_DEAD_TIMEOUT 30
+#define MQTT_MISC_INTERVAL 1 // seconds between keepalive checks when mosquitto is driven by main loop
+
+/*
+ * mosquitto 1.4 pins a single protocol version and knows nothing newer than TLS 1.2: the broker
+ * link uses it with the same ECDHE AEAD ciphers of https requests.
+ */
+#ifndef MQTT_TLS_VERSION
+#define MQTT_TLS_VERSION "tlsv1.2"
+#endif
+
+/*
+ * With a persistent session broker keeps subscriptions and QoS 1 messages of the client id while
+ * it is disconnected: offers sent during a short outage are delivered on reconnection.
+ */
+#ifdef MQTT_PERSISTENT_SESSION
+#define MQTT_CLEAN_SESSION false
+#define MQTT_PUBLISH_QOS 1
+#else
+#define MQTT_CLEAN_SESSION true
+#define MQTT_PUBLISH_QOS 0
+#endif
+
+/*
+ * A route sends messages of a topic (or of a topic filter with wildcards) to its own callback,
+ * so devices sharing the same connection receive only their messages.
+ */
+struct mqttRoute {
+	char *topic;
+	void (*messageCb)(MqttCtx *, void *, const struct mosquitto_message *);
+	void *userData;
+	struct mqttRoute *next;
+};
 
 struct mqttCtx {
 	struct mosquitto *mosq;
+	struct mqttRoute *routes;
+	pthread_mutex_t routesLock;	// routes are read by mosquitto thread
 	void (*connectCb)(MqttCtx *, void *, int);
 	void (*subscribeCb)(MqttCtx *, void *, int, int, const int *);
 	void (*messageCb)(MqttCtx *, void *, const struct mosquitto_message *);
 	void (*disconnectCb)(MqttCtx *, void *, int);
+	bool lost;		// disconnectCb already invoked for current connection
 	void *userData;
 	gulong mqttTimeout;
+#ifndef MQTT_THREADED_LOOP
+	int sock;			// socket watched by socketSource
+	GIOCondition socketCondition;	// events watched by socketSource
+	guint socketSource;
+	guint miscSource;
+#endif
 };
 
 #ifdef DEBUG
@@ -57,8 +101,8 @@ IOTC_PRIVATE void privMqttLogCb(struct mosquitto *mosq, void *obj, int level, co
 
 IOTC_PRIVATE void privMqttDisconnectCb(struct mosquitto *mosq, void *obj, int rc) {
 	MqttCtx *mqttCtx = (MqttCtx *)obj;
-	void (*callback)(MqttCtx *, void *, int) = mqttCtx->disconnectCb;
-	mqttCtx->disconnectCb = NULL;
+	void (*callback)(MqttCtx *, void *, int) = mqttCtx->lost ? NULL : mqttCtx->disconnectCb;
+	mqttCtx->lost = true;
 #ifdef DEBUG
 	printf("\033[31m[DEBUG] Disconnected [%d]\033[0m\n", rc);
 	if(rc == MOSQ_ERR_ERRNO)
@@ -73,7 +117,17 @@ IOTC_PRIVATE void privMqttMessageCb(struct mosquitto *mosq, void *obj, const str
 	printf("[DEBUG] Message: %s\n", (char *)(message->payload));
 #endif
 	MqttCtx *mqttCtx = (MqttCtx *)obj;
-	if(mqttCtx->messageCb != NULL)
+	struct mqttRoute *route;
+	bool match = false;
+	pthread_mutex_lock(&mqttCtx->routesLock);
+	for(route=mqttCtx->routes; route!=NULL; route=route->next) {
+		if(mosquitto_topic_matches_sub(route->topic, message->topic, &match) == MOSQ_ERR_SUCCESS && match) {
+			route->messageCb(mqttCtx, route->userData, message);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&mqttCtx->routesLock);
+	if(!match && mqttCtx->messageCb != NULL)
 		mqttCtx->messageCb(mqttCtx, mqttCtx->userData, message);
 }
 
@@ -99,6 +153,14 @@ IOTC_PRIVATE void privMqttConnectCb(struct mosquitto *mosq, void *obj, int resul
 		printf("[DEBUG] Connect fail\n");
 	}
 #endif
+	struct mqttRoute *route;
+	// subscriptions of routes are lost with the session: restore them after a reconnect
+	if(!result) {
+		pthread_mutex_lock(&mqttCtx->routesLock);
+		for(route=mqttCtx->routes; route!=NULL; route=route->next)
+			mosquitto_subscribe(mqttCtx->mosq, NULL, route->topic, 2);
+		pthread_mutex_unlock(&mqttCtx->routesLock);
+	}
 	if(mqttCtx->connectCb != NULL)
 		mqttCtx->connectCb(mqttCtx, mqttCtx->userData, result);
 }
@@ -112,14 +174,84 @@ IOTC_PRIVATE gboolean privMqttTimeout(gpointer userData) {
 		mosquitto_disconnect(mqttCtx->mosq);
 		mosquitto_loop_stop(mqttCtx->mosq, true);
 	}*/
-//	mqttCtx->mqttTimeout = 0;
-	void (*callback)(MqttCtx *, void *, int) = mqttCtx->disconnectCb;
-	mqttCtx->disconnectCb = NULL;
+	mqttCtx->mqttTimeout = 0;
+	void (*callback)(MqttCtx *, void *, int) = mqttCtx->lost ? NULL : mqttCtx->disconnectCb;
+	mqttCtx->lost = true;
 	if(callback != NULL)
 		callback(mqttCtx, mqttCtx->userData, -1);
 	return G_SOURCE_REMOVE;
 }
 
+#ifndef MQTT_THREADED_LOOP
+/*
+ * Without MQTT_THREADED_LOOP mosquitto has no network thread: its socket is watched by the main
+ * loop, so every callback runs on main loop like the rest of the library.
+ */
+IOTC_PRIVATE void privMqttConnectionLost(MqttCtx *mqttCtx, int rc) {
+	if(mqttCtx->socketSource != 0) {
+		g_source_remove(mqttCtx->socketSource);
+		mqttCtx->socketSource = 0;
+	}
+	privMqttDisconnectCb(mqttCtx->mosq, mqttCtx, rc);
+}
+
+IOTC_PRIVATE gboolean privMqttSocketCb(GIOChannel *source, GIOCondition condition, gpointer userData);
+
+// watch mosquitto socket for read, and for write only when mosquitto has data to send
+IOTC_PRIVATE void privMqttWatch(MqttCtx *mqttCtx) {
+	int sock = mosquitto_socket(mqttCtx->mosq);
+	GIOCondition condition = G_IO_IN | G_IO_HUP | G_IO_ERR;
+	if(mosquitto_want_write(mqttCtx->mosq))
+		condition |= G_IO_OUT;
+	if(mqttCtx->socketSource != 0 && sock == mqttCtx->sock && condition == mqttCtx->socketCondition)
+		return;
+	if(mqttCtx->socketSource != 0) {
+		g_source_remove(mqttCtx->socketSource);
+		mqttCtx->socketSource = 0;
+	}
+	mqttCtx->sock = sock;
+	mqttCtx->socketCondition = condition;
+	if(sock == -1)
+		return;
+	GIOChannel *channel = g_io_channel_unix_new(sock);
+	mqttCtx->socketSource = g_io_add_watch(channel, condition, privMqttSocketCb, mqttCtx);
+	g_io_channel_unref(channel);
+}
+
+IOTC_PRIVATE gboolean privMqttSocketCb(GIOChannel *source, GIOCondition condition, gpointer userData) {
+	MqttCtx *mqttCtx = (MqttCtx *)userData;
+	int rc = MOSQ_ERR_SUCCESS;
+	if(condition & (G_IO_IN | G_IO_HUP | G_IO_ERR))
+		rc = mosquitto_loop_read(mqttCtx->mosq, 1);
+	if(rc == MOSQ_ERR_SUCCESS && (condition & G_IO_OUT))
+		rc = mosquitto_loop_write(mqttCtx->mosq, 1);
+	if(rc != MOSQ_ERR_SUCCESS) {
+#ifdef DEBUG
+		printf("[DEBUG] Mosquitto loop error: %s\n", mosquitto_strerror(rc));
+#endif
+		// source is removed returning FALSE
+		mqttCtx->socketSource = 0;
+		privMqttConnectionLost(mqttCtx, rc);
+		return FALSE;
+	}
+	// watch has been replaced if condition changed
+	privMqttWatch(mqttCtx);
+	return TRUE;
+}
+
+IOTC_PRIVATE gboolean privMqttMiscCb(gpointer userData) {
+	MqttCtx *mqttCtx = (MqttCtx *)userData;
+	// keepalive: send ping or detect a dead connection
+	if(mosquitto_loop_misc(mqttCtx->mosq) != MOSQ_ERR_SUCCESS && mosquitto_socket(mqttCtx->mosq) == -1) {
+		mqttCtx->miscSource = 0;
+		privMqttConnectionLost(mqttCtx, MOSQ_ERR_CONN_LOST);
+		return G_SOURCE_REMOVE;
+	}
+	privMqttWatch(mqttCtx);
+	return G_SOURCE_CONTINUE;
+}
+#endif
+
 MqttCtx *mqttNew(char *deviceId, char *host, int port,
 		char *CAFile, char *CAPath, char *crtFile, char *keyFile,
 		void (*connectCb)(MqttCtx *, void *, int),
@@ -127,7 +259,8 @@ MqttCtx *mqttNew(char *deviceId, char *host, int port,
 		void (*messageCb)(MqttCtx *, void *, const struct mosquitto_message *),
 		void (*disconnectCb)(MqttCtx *, void *, int),
 		void *userData) {
-	char TESThost[INET6_ADDRSTRLEN];
+	GList *addresses;
+	char *brokerIp;
 	int error;
 	// User agent name
 	char *id = malloc(MOSQ_MQTT_ID_MAX_LENGTH); // MAX_LENGTH is 23
@@ -136,16 +269,25 @@ MqttCtx *mqttNew(char *deviceId, char *host, int port,
 	// Setup context
 	MqttCtx *mqttCtx = (MqttCtx *)malloc(sizeof(MqttCtx));
 	mqttCtx->mosq = NULL;
+	mqttCtx->routes = NULL;
+	pthread_mutex_init(&mqttCtx->routesLock, NULL);
 	mqttCtx->connectCb = connectCb;
 	mqttCtx->subscribeCb = subscribeCb;
 	mqttCtx->messageCb = messageCb;
 	mqttCtx->disconnectCb = disconnectCb;
+	mqttCtx->lost = false;
 	mqttCtx->userData = userData;
 	mqttCtx->mqttTimeout = 0;
+#ifndef MQTT_THREADED_LOOP
+	mqttCtx->sock = -1;
+	mqttCtx->socketCondition = 0;
+	mqttCtx->socketSource = 0;
+	mqttCtx->miscSource = 0;
+#endif
 
-	// Create mosquitto instance with clean sesssion and no user data to callbacks
+	// Create mosquitto instance, id is the same on every connection to resume persistent session
 	mosquitto_lib_init();
-	mqttCtx->mosq = mosquitto_new(id, true, mqttCtx);
+	mqttCtx->mosq = mosquitto_new(id, MQTT_CLEAN_SESSION, mqttCtx);
 	free(id);
 	if(!mqttCtx->mosq) {
 #ifdef DEBUG
@@ -168,7 +310,7 @@ MqttCtx *mqttNew(char *deviceId, char *host, int port,
 	mosquitto_log_callback_set(mqttCtx->mosq, privMqttLogCb);
 #endif
 
-	// Set TLS options: key and certificates, verify server, use TLSv1
+	// Set TLS options: key and certificates, verify server, use MQTT_TLS_VERSION with the ciphers of https requests
 	if((error = mosquitto_tls_set(mqttCtx->mosq, CAFile, CAPath, crtFile, keyFile, NULL))) {
 #ifdef DEBUG
 		switch(error) {
@@ -189,7 +331,8 @@ MqttCtx *mqttNew(char *deviceId, char *host, int port,
 		mqttFree(mqttCtx);
 		return NULL;
 	}
-	if((error = mosquitto_tls_opts_set(mqttCtx->mosq, SSL_VERIFY_NONE, "tlsv1", NULL))) {
+	if((error = mosquitto_tls_opts_set(mqttCtx->mosq, SSL_VERIFY_NONE, MQTT_TLS_VERSION,
+			tlsCipherList()))) {
 #ifdef DEBUG
 		switch(error) {
 			case MOSQ_ERR_SUCCESS:
@@ -219,46 +362,26 @@ MqttCtx *mqttNew(char *deviceId, char *host, int port,
 	mosquitto_message_callback_set(mqttCtx->mosq, privMqttMessageCb);
 	mosquitto_disconnect_callback_set(mqttCtx->mosq, privMqttDisconnectCb);
 
-// TEST use getaddrinfo to translate hostname: on iOS ipv4 is translated to ipv6 automatically
-	struct addrinfo hints, *dnsResults, *dnsResult;
-
-	// set connection hints
-	memset(&hints, 0, sizeof(struct addrinfo));
-	hints.ai_family = AF_UNSPEC; // Allow IPv4 or IPv6
-	hints.ai_socktype = SOCK_STREAM; // TCP
-	hints.ai_flags = 0;
-	hints.ai_protocol = 0;
-
 #ifdef FORCE_MQTT_BROKER
 	host = FORCE_MQTT_BROKER;
 #endif
 
-	// Resolve host name
-	error = getaddrinfo(host, NULL, &hints, &dnsResults);
-	if(error != 0) {
+	// resolve host name through the shared cache: on iOS ipv4 is translated to ipv6 automatically
+	addresses = dnsLookup(host);
+	if(addresses == NULL) {
 #ifdef DEBUG
 		printf("Cannot resolve host name\n");
 #endif
+		mqttFree(mqttCtx);
+		return NULL;
 	}
-
-	// try to connect to one of the results gave by dns
-	for(dnsResult = dnsResults; dnsResult != NULL; dnsResult = dnsResult->ai_next) {
-		if(dnsResult->ai_family == PF_INET) {
-//			((struct sockaddr_in *)dnsResult->ai_addr)->sin_port = htons(port);
-			inet_ntop(AF_INET, &(((struct sockaddr_in *)dnsResult->ai_addr)->sin_addr), TESThost, INET6_ADDRSTRLEN);
-			break;
-		} else if(dnsResult->ai_family == PF_INET6) {
-//			((struct sockaddr_in6 *)dnsResult->ai_addr)->sin6_port = htons(port);
-			inet_ntop(AF_INET6, &(((struct sockaddr_in *)dnsResult->ai_addr)->sin_addr), TESThost, INET6_ADDRSTRLEN);
-			break;
-		}
-		// else try next if exists
-	}
-	freeaddrinfo(dnsResults);
-// TEST
+	brokerIp = g_inet_address_to_string(G_INET_ADDRESS(addresses->data));
+	g_resolver_free_addresses(addresses);
 
 	// Connect to broker
-	if((error = mosquitto_connect_async(mqttCtx->mosq, TESThost, port, MQTT_PING_TIMEOUT))) {
+	error = mosquitto_connect_async(mqttCtx->mosq, brokerIp, port, MQTT_PING_TIMEOUT);
+	g_free(brokerIp);
+	if(error) {
 #ifdef DEBUG
 		switch(error) {
 			case MOSQ_ERR_SUCCESS:
@@ -288,6 +411,7 @@ MqttCtx *mqttNew(char *deviceId, char *host, int port,
 
 	mqttCtx->mqttTimeout = g_timeout_add_seconds(MQTT_DEAD_TIMEOUT, &privMqttTimeout, mqttCtx);
 
+#ifdef MQTT_THREADED_LOOP
 	if((error = mosquitto_loop_start(mqttCtx->mosq))) {
 #ifdef DEBUG
 		switch(error) {
@@ -308,10 +432,49 @@ MqttCtx *mqttNew(char *deviceId, char *host, int port,
 		mqttFree(mqttCtx);
 		return NULL;
 	}
+#else
+	privMqttWatch(mqttCtx);
+	mqttCtx->miscSource = g_timeout_add_seconds(MQTT_MISC_INTERVAL, &privMqttMiscCb, mqttCtx);
+#endif
 
 	return mqttCtx;
 }
 
+bool mqttReconnect(MqttCtx *mqttCtx) {
+	int error;
+	if(mqttCtx->mqttTimeout != 0) {
+		g_source_remove(mqttCtx->mqttTimeout);
+		mqttCtx->mqttTimeout = 0;
+	}
+#ifdef MQTT_THREADED_LOOP
+	// network thread would retry by itself at its own pace
+	mosquitto_loop_stop(mqttCtx->mosq, true);
+#endif
+	mqttCtx->lost = false;
+	if((error = mosquitto_reconnect_async(mqttCtx->mosq))) {
+#ifdef DEBUG
+		printf("Mosquitto reconnect: %s\n", mosquitto_strerror(error));
+#endif
+		mqttCtx->lost = true;
+		return false;
+	}
+	mqttCtx->mqttTimeout = g_timeout_add_seconds(MQTT_DEAD_TIMEOUT, &privMqttTimeout, mqttCtx);
+#ifdef MQTT_THREADED_LOOP
+	if((error = mosquitto_loop_start(mqttCtx->mosq))) {
+#ifdef DEBUG
+		printf("Mosquitto loop start: %s\n", mosquitto_strerror(error));
+#endif
+		mqttCtx->lost = true;
+		return false;
+	}
+#else
+	privMqttWatch(mqttCtx);
+	if(mqttCtx->miscSource == 0)
+		mqttCtx->miscSource = g_timeout_add_seconds(MQTT_MISC_INTERVAL, &privMqttMiscCb, mqttCtx);
+#endif
+	return true;
+}
+
 bool mqttSubscribe(MqttCtx *mqttCtx, char *topic) {
 	int error;
 	if((error = mosquitto_subscribe(mqttCtx->mosq, NULL, topic, 2))) {
@@ -333,12 +496,15 @@ bool mqttSubscribe(MqttCtx *mqttCtx, char *topic) {
 #endif
 		return false;
 	}
+#ifndef MQTT_THREADED_LOOP
+	privMqttWatch(mqttCtx);
+#endif
 	return true;
 }
 
 bool mqttPublish(MqttCtx *mqttCtx, char *topic, char *msg) {
 	int error;
-	if((error = mosquitto_publish(mqttCtx->mosq, NULL, topic, strlen(msg), (void *)msg, 0, false))) {
+	if((error = mosquitto_publish(mqttCtx->mosq, NULL, topic, strlen(msg), (void *)msg, MQTT_PUBLISH_QOS, false))) {
 #ifdef DEBUG
 		switch(error) {
 			case MOSQ_ERR_SUCCESS:
@@ -363,6 +529,54 @@ bool mqttPublish(MqttCtx *mqttCtx, char *topic, char *msg) {
 #endif
 		return false;
 	}
+#ifndef MQTT_THREADED_LOOP
+	privMqttWatch(mqttCtx);
+#endif
+	return true;
+}
+
+bool mqttAddRoute(MqttCtx *mqttCtx, char *topic,
+		void (*messageCb)(MqttCtx *, void *, const struct mosquitto_message *), void *userData) {
+	struct mqttRoute *route = (struct mqttRoute *)malloc(sizeof(struct mqttRoute));
+	if(route == NULL) {
+#ifdef DEBUG
+		printf("Malloc error: route\n");
+#endif
+		return false;
+	}
+	if(!mqttSubscribe(mqttCtx, topic)) {
+		free(route);
+		return false;
+	}
+	route->topic = strdup(topic);
+	route->messageCb = messageCb;
+	route->userData = userData;
+	pthread_mutex_lock(&mqttCtx->routesLock);
+	route->next = mqttCtx->routes;
+	mqttCtx->routes = route;
+	pthread_mutex_unlock(&mqttCtx->routesLock);
+	return true;
+}
+
+bool mqttRemoveRoute(MqttCtx *mqttCtx, char *topic) {
+	struct mqttRoute **prev, *route = NULL;
+	pthread_mutex_lock(&mqttCtx->routesLock);
+	for(prev=&(mqttCtx->routes); *prev!=NULL; prev=&((*prev)->next)) {
+		if(strcmp((*prev)->topic, topic) == 0) {
+			route = *prev;
+			*prev = route->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&mqttCtx->routesLock);
+	if(route == NULL)
+		return false;
+	mosquitto_unsubscribe(mqttCtx->mosq, NULL, topic);
+#ifndef MQTT_THREADED_LOOP
+	privMqttWatch(mqttCtx);
+#endif
+	free(route->topic);
+	free(route);
 	return true;
 }
 
@@ -374,6 +588,16 @@ bool mqttFree(MqttCtx *mqttCtx) {
 		g_source_remove(mqttCtx->mqttTimeout);
 		mqttCtx->mqttTimeout = 0;
 	}
+#ifndef MQTT_THREADED_LOOP
+	if(mqttCtx->socketSource != 0) {
+		g_source_remove(mqttCtx->socketSource);
+		mqttCtx->socketSource = 0;
+	}
+	if(mqttCtx->miscSource != 0) {
+		g_source_remove(mqttCtx->miscSource);
+		mqttCtx->miscSource = 0;
+	}
+#endif
 	if(mqttCtx->mosq != NULL) {
 		if((error = mosquitto_disconnect(mqttCtx->mosq))) {
 #ifdef DEBUG
@@ -393,6 +617,7 @@ bool mqttFree(MqttCtx *mqttCtx) {
 			}
 #endif
 		}
+#ifdef MQTT_THREADED_LOOP
 		if((error = mosquitto_loop_stop(mqttCtx->mosq, true))) {
 #ifdef DEBUG
 			switch(error) {
@@ -411,10 +636,18 @@ bool mqttFree(MqttCtx *mqttCtx) {
 			}
 #endif
 		}
+#endif
 		mosquitto_destroy(mqttCtx->mosq);
 		mqttCtx->mosq = NULL;
 	}
 	mosquitto_lib_cleanup();
+	while(mqttCtx->routes != NULL) {
+		struct mqttRoute *route = mqttCtx->routes;
+		mqttCtx->routes = route->next;
+		free(route->topic);
+		free(route);
+	}
+	pthread_mutex_destroy(&mqttCtx->routesLock);
 
 	free(mqttCtx);
 	return true;
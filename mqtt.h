@@ -47,8 +47,13 @@ typedef struct mqttCtx MqttCtx;
 /**
  * @brief Create and initialize mqtt
  *
- * Create MqttCtx and starts network thread for manage mqtt communications.
- * Use CA, and my certificate and key files to initialize TLS. TLSv1 is used.
+ * Create MqttCtx and watch its socket on the default main context: callbacks are invoked on
+ * main loop. With MQTT_THREADED_LOOP a network thread is started instead, and callbacks are
+ * invoked on that thread.
+ * Use CA, and my certificate and key files to initialize TLS. MQTT_TLS_VERSION (TLS 1.2 by default)
+ * is used with the ECDHE AEAD ciphers of tlsCipherList().
+ * Session is clean, unless MQTT_PERSISTENT_SESSION is defined: in that case broker keeps
+ * subscriptions and messages of deviceId while it is disconnected.
  * Mosquitto structure should be freed using mqttFree().
  * @see mqttFree()
  * @param deviceId The unique id of the device, used as `user agent`. This must be unique;
@@ -89,6 +94,17 @@ MqttCtx *mqttNew(char *deviceId, char *host, int port,
 		void (*disconnectCb)(MqttCtx *, void *, int),
 		void *userData);
 
+/**
+ * @brief Connect again to the same broker after a disconnection
+ *
+ * The mosquitto instance, its TLS settings and the routes added using mqttAddRoute() are kept,
+ * so this is cheaper than freeing MqttCtx and creating a new one. Callbacks passed to mqttNew()
+ * are invoked again as for the first connection, disconnectCb once for each connection.
+ * @param mqttCtx A pointer to MqttCtx, correctly initialized using mqttNew()
+ * @return true if connection has been started, false otherwise
+ */
+bool mqttReconnect(MqttCtx *mqttCtx);
+
 /**
  * @brief Subscribe to mqtt topic
  *
@@ -103,7 +119,8 @@ bool mqttSubscribe(MqttCtx *mqttCtx, char *topic);
 /**
  * @brief Publish to mqtt topic
  *
- * Send a message for publishing on the specified topic
+ * Send a message for publishing on the specified topic, with QoS 1 if MQTT_PERSISTENT_SESSION
+ * is defined and QoS 0 otherwise
  * @see mqttNew()
  * @param mqttCtx A pointer to MqttCtx, correctly initialized using mqttNew()
  * @param topic The topic where to publish on
@@ -112,10 +129,34 @@ bool mqttSubscribe(MqttCtx *mqttCtx, char *topic);
  */
 bool mqttPublish(MqttCtx *mqttCtx, char *topic, char *msg);
 
+/**
+ * @brief Subscribe to a topic whose messages are passed to a dedicated callback
+ *
+ * Many devices can share the same connection, each one receiving only messages of its topic.
+ * Messages not matching any route are passed to messageCb of mqttNew().
+ * @see mqttNew()
+ * @param mqttCtx A pointer to MqttCtx, correctly initialized using mqttNew()
+ * @param topic The topic to subscribe to, wildcards '+' and '#' are allowed
+ * @param messageCb The callback invoked with messages of the topic (on main loop)
+ * @param userData The user data passed to messageCb
+ * @return true if success, false otherwise
+ */
+bool mqttAddRoute(MqttCtx *mqttCtx, char *topic,
+		void (*messageCb)(MqttCtx *, void *, const struct mosquitto_message *), void *userData);
+
+/**
+ * @brief Unsubscribe a topic added using mqttAddRoute()
+ *
+ * @param mqttCtx A pointer to MqttCtx, correctly initialized using mqttNew()
+ * @param topic The topic passed to mqttAddRoute()
+ * @return true if the route has been removed, false if topic has no route
+ */
+bool mqttRemoveRoute(MqttCtx *mqttCtx, char *topic);
+
 /**
  * @brief Stop and free mqtt structures
  *
- * Stop thread for management of network messages from mqtt and free all structures used
+ * Stop management of network messages from mqtt and free all structures used
  * @param mqttCtx A pointer to MqttCtx, correctly initialized using mqttNew()
  * @return true if success, false otherwise
  */
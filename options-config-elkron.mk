@@ -13,3 +13,24 @@ OPTIONS+=-DWEBSERVICE_AUTHFORM="\"httpd_username=dileo&httpd_password=dileo\""
 #OPTIONS+=-DFORCE_MQTT_BROKER="\"35.205.173.130\""
 #OPTIONS+=-DFORCE_MQTT_BROKER="\"35.205.38.87\""
 
+# interfaces (name prefixes separated by comma) never used by device for ICE gathering
+#OPTIONS+=-DICE_INTERFACE_DENY="\"docker,veth,tun\""
+
+# uncomment to run mosquitto network loop on its own thread instead of main loop
+#OPTIONS+=-DMQTT_THREADED_LOOP
+
+# uncomment to keep mqtt session (and offers sent to device) on broker while device is reconnecting
+#OPTIONS+=-DMQTT_PERSISTENT_SESSION
+
+# minimum TLS version of https requests (TLS1_2_VERSION by default, TLS 1.3 is used when server has it)
+#OPTIONS+=-DTLS_MIN_VERSION=TLS1_3_VERSION
+
+# TLS 1.2 cipher list of https and mqtt connections (ECDHE AEAD ciphers ordered by CPU AES support by default)
+#OPTIONS+=-DTLS_CIPHERS="\"ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256\""
+
+# uncomment to send idempotent async https GET requests as TLS 1.3 early data (0-RTT) on resumed sessions
+#OPTIONS+=-DHTTPS_EARLY_DATA
+
+# TLS version of mqtt connection as named by mosquitto (tlsv1.2 by default)
+#OPTIONS+=-DMQTT_TLS_VERSION="\"tlsv1.1\""
+
@@ -0,0 +1,201 @@
+/*
+ * Copyright (C) 2015 CSP Innovazione nelle ICT s.c.a r.l. (http://www.csp.it/)
+ * All rights reserved.
+ *
+ * [any text provided by the client]
+ *
+ * queue.c
+ *	Urmet IoT message queue towards main loop
+ *
+ * Authors:
+ *	Matteo Di Leo <matteo.dileo@csp.it>
+ */
+
+#include "library.h"
+#include "queue.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#ifndef EVENTFD_NOT_SUPPORTED
+#include <sys/eventfd.h>
+#include <stdint.h>
+#endif
+
+/*
+ * Bounded queue with a sequence number for each slot (D. Vyukov). A slot whose sequence is equal
+ * to the tail position is free: producers reserve it moving tail with a compare and exchange,
+ * copy the message and publish it setting sequence to position + 1. The consumer reads slots
+ * in order while their sequence is head + 1 and frees them setting sequence to head + size.
+ */
+struct queueSlot {
+	gint seq;
+	int len;
+};
+
+struct msgQueue {
+	char *slots;
+	unsigned int size;		// number of slots, power of 2
+	unsigned int msgSize;
+	unsigned int slotSize;		// bytes between two slots
+	gint tail;			// next position to be reserved by producers
+	unsigned int head;		// next position to be read, used by main loop only
+	int fd[2];			// eventfd in fd[0] (and fd[1]), or pipe
+	guint source;
+	void (*onMsg)(const char *msg, int len, void *userData);
+	void *userData;
+};
+
+IOTC_PRIVATE struct queueSlot *queueSlotAt(MsgQueue *queue, unsigned int pos) {
+	return (struct queueSlot *)(queue->slots + (pos & (queue->size - 1)) * queue->slotSize);
+}
+
+// wake up main loop, signals of many pushes are merged by eventfd
+IOTC_PRIVATE void queueSignal(MsgQueue *queue) {
+#ifndef EVENTFD_NOT_SUPPORTED
+	uint64_t value = 1;
+	if(write(queue->fd[1], &value, sizeof(value)) < 0 && errno != EAGAIN) {
+#else
+	char value = 1;
+	// a full pipe already wakes up main loop
+	if(write(queue->fd[1], &value, 1) < 0 && errno != EAGAIN) {
+#endif
+#ifdef DEBUG
+		printf("Queue signal error: %s\n", strerror(errno));
+#endif
+	}
+}
+
+IOTC_PRIVATE void queueClearSignal(MsgQueue *queue) {
+#ifndef EVENTFD_NOT_SUPPORTED
+	uint64_t value;
+	if(read(queue->fd[0], &value, sizeof(value)) < 0 && errno != EAGAIN) {
+#else
+	char value[64];
+	if(read(queue->fd[0], value, sizeof(value)) < 0 && errno != EAGAIN) {
+#endif
+#ifdef DEBUG
+		printf("Queue read signal error: %s\n", strerror(errno));
+#endif
+	}
+}
+
+// read at most max messages, returns true if queue is not empty yet
+IOTC_PRIVATE bool queueDrain(MsgQueue *queue, int max) {
+	int i;
+	for(i=0; i<max; i++) {
+		struct queueSlot *slot = queueSlotAt(queue, queue->head);
+		if((gint)((unsigned int)g_atomic_int_get(&slot->seq) - (queue->head + 1)) < 0)
+			return false;
+		queue->onMsg((char *)(slot + 1), slot->len, queue->userData);
+		g_atomic_int_set(&slot->seq, (gint)(queue->head + queue->size));
+		queue->head++;
+	}
+	return true;
+}
+
+IOTC_PRIVATE gboolean queueWatchCb(GIOChannel *source, GIOCondition condition, gpointer userData) {
+	MsgQueue *queue = (MsgQueue *)userData;
+	queueClearSignal(queue);
+	// leave room to other sources under message storms, next batch on next iteration
+	if(queueDrain(queue, QUEUE_BATCH))
+		queueSignal(queue);
+	return TRUE;
+}
+
+MsgQueue *msgQueueNew(unsigned int size, unsigned int msgSize,
+		void (*onMsg)(const char *msg, int len, void *userData), void *userData) {
+	unsigned int i;
+	MsgQueue *queue = (MsgQueue *)malloc(sizeof(MsgQueue));
+	if(queue == NULL) {
+#ifdef DEBUG
+		printf("Malloc error: queue\n");
+#endif
+		return NULL;
+	}
+	queue->size = 1;
+	while(queue->size < size)
+		queue->size <<= 1;
+	queue->msgSize = msgSize;
+	queue->slotSize = (sizeof(struct queueSlot) + msgSize + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+	queue->slots = (char *)malloc(queue->size * queue->slotSize);
+	if(queue->slots == NULL) {
+#ifdef DEBUG
+		printf("Malloc error: queue->slots\n");
+#endif
+		free(queue);
+		return NULL;
+	}
+	for(i=0; i<queue->size; i++)
+		queueSlotAt(queue, i)->seq = (gint)i;
+	queue->tail = 0;
+	queue->head = 0;
+	queue->onMsg = onMsg;
+	queue->userData = userData;
+#ifndef EVENTFD_NOT_SUPPORTED
+	queue->fd[0] = queue->fd[1] = eventfd(0, EFD_NONBLOCK);
+	if(queue->fd[0] < 0) {
+#else
+	if(pipe(queue->fd) < 0 || fcntl(queue->fd[0], F_SETFL, O_NONBLOCK) < 0 ||
+			fcntl(queue->fd[1], F_SETFL, O_NONBLOCK) < 0) {
+#endif
+#ifdef DEBUG
+		printf("Queue cannot create signal: %s\n", strerror(errno));
+#endif
+		free(queue->slots);
+		free(queue);
+		return NULL;
+	}
+	GIOChannel *channel = g_io_channel_unix_new(queue->fd[0]);
+	queue->source = g_io_add_watch(channel, G_IO_IN, queueWatchCb, queue);
+	g_io_channel_unref(channel);
+	return queue;
+}
+
+bool msgQueuePush(MsgQueue *queue, const void *head, int headLen, const void *body, int bodyLen) {
+	struct queueSlot *slot;
+	unsigned int pos;
+	if(headLen < 0 || bodyLen < 0 || (unsigned int)(headLen + bodyLen) > queue->msgSize)
+		return false;
+	// reserve a slot
+	pos = (unsigned int)g_atomic_int_get(&queue->tail);
+	while(true) {
+		slot = queueSlotAt(queue, pos);
+		gint diff = (gint)((unsigned int)g_atomic_int_get(&slot->seq) - pos);
+		if(diff == 0) {
+			if(g_atomic_int_compare_and_exchange(&queue->tail, (gint)pos, (gint)(pos + 1)))
+				break;
+		} else if(diff < 0) {
+#ifdef DEBUG
+			printf("Queue full, message dropped\n");
+#endif
+			return false;
+		}
+		pos = (unsigned int)g_atomic_int_get(&queue->tail);
+	}
+	if(headLen > 0)
+		memcpy((char *)(slot + 1), head, headLen);
+	if(bodyLen > 0)
+		memcpy((char *)(slot + 1) + headLen, body, bodyLen);
+	slot->len = headLen + bodyLen;
+	// publish
+	g_atomic_int_set(&slot->seq, (gint)(pos + 1));
+	queueSignal(queue);
+	return true;
+}
+
+void msgQueueFlush(MsgQueue *queue) {
+	while(queueDrain(queue, QUEUE_BATCH));
+}
+
+void msgQueueFree(MsgQueue *queue) {
+	if(queue == NULL)
+		return;
+	g_source_remove(queue->source);
+	close(queue->fd[0]);
+	if(queue->fd[1] != queue->fd[0])
+		close(queue->fd[1]);
+	free(queue->slots);
+	free(queue);
+}
@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2015 CSP Innovazione nelle ICT s.c.a r.l. (http://www.csp.it/)
+ * All rights reserved.
+ *
+ * [any text provided by the client]
+ *
+ */
+
+/**
+ * @file queue.h
+ * @author Matteo Di Leo <matteo.dileo@csp.it>
+ * @date 19/10/2026
+ * @brief Urmet IoT message queue towards main loop
+ *
+ * Here are placed the functions used to pass messages from other threads (ex.: mosquitto
+ * network thread) to main loop. Many threads can push messages at the same time without locks;
+ * messages are read by main loop only. Messages are copied in slots allocated at creation, so
+ * no memory is allocated for each message.
+ */
+
+#ifndef __QUEUE_H__
+#define __QUEUE_H__
+
+#include <stdbool.h>
+#include <gio/gio.h>
+
+#define QUEUE_BATCH 32 // max messages read from queue in a single main loop iteration
+
+/**
+ * @brief A bounded queue of messages read by main loop
+ *
+ * @see msgQueueNew()
+ */
+typedef struct msgQueue MsgQueue;
+
+/**
+ * @brief Create a queue and attach it to the default main context
+ *
+ * The queue is watched through an eventfd (a pipe if EVENTFD_NOT_SUPPORTED is defined)
+ * which is signalled by msgQueuePush().
+ * @param size The number of slots, rounded up to a power of 2
+ * @param msgSize The max length of a message
+ * @param onMsg Callback invoked on main loop with every message. Params are:
+ *	- msg The message, valid only until callback returns
+ *	- len The length of message
+ *	- userData The user data provided as parameter in this function
+ * @param userData A pointer to data passed back to onMsg
+ * @return The queue, to be deallocated using msgQueueFree(), or NULL if an error occurred
+ */
+MsgQueue *msgQueueNew(unsigned int size, unsigned int msgSize,
+		void (*onMsg)(const char *msg, int len, void *userData), void *userData);
+
+/**
+ * @brief Copy a message in the queue. This function can be invoked by any thread
+ *
+ * The message is made of a head and a body written one after the other, so that callers
+ * don't need to build it in a buffer of their own.
+ * @param queue The queue created using msgQueueNew()
+ * @param head The first part of the message (can be NULL)
+ * @param headLen The length of head
+ * @param body The second part of the message (can be NULL)
+ * @param bodyLen The length of body
+ * @return true if message has been queued, false if queue is full or message is too long
+ */
+bool msgQueuePush(MsgQueue *queue, const void *head, int headLen, const void *body, int bodyLen);
+
+/**
+ * @brief Pass all queued messages to onMsg now, without waiting for main loop
+ *
+ * Must be invoked from main loop thread.
+ * @param queue The queue created using msgQueueNew()
+ */
+void msgQueueFlush(MsgQueue *queue);
+
+/**
+ * @brief Detach a queue from main context and deallocate it
+ *
+ * Messages still queued are dropped: use msgQueueFlush() before if they hold resources.
+ * No thread must push messages during and after this call.
+ * @param queue The queue to free (can be NULL)
+ */
+void msgQueueFree(MsgQueue *queue);
+
+#endif /* __QUEUE_H__ */
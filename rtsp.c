@@ -0,0 +1,379 @@
+/*
+ * Copyright (C) 2015 CSP Innovazione nelle ICT s.c.a r.l. (http://www.csp.it/)
+ * All rights reserved.
+ *
+ * [any text provided by the client]
+ *
+ * rtsp.c
+ *	Urmet IoT RTSP message inspection
+ *
+ * Authors:
+ *	Matteo Di Leo <matteo.dileo@csp.it>
+ */
+
+#include "library.h"
+#include "rtsp.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+typedef enum {
+	RTSP_PARSE_START,		// next byte starts a new message or interleaved frame
+	RTSP_PARSE_HEADER,		// reading header section
+	RTSP_PARSE_BODY,		// skipping body
+	RTSP_PARSE_INTERLEAVED_HEADER,	// reading '$', channel and length of interleaved frame
+	RTSP_PARSE_INTERLEAVED,		// skipping interleaved frame
+} RtspParseState;
+
+struct rtspParser {
+	RtspParseState state;
+	char *header;
+	int headerLen;
+	bool overflow;		// header section longer than RTSP_MAX_HEADER
+	int newlines;		// consecutive line terminators read, 2 means end of header
+	int remaining;		// bytes of body or interleaved frame still to skip
+	unsigned char interleaved[4];
+	int interleavedLen;
+	char *line;		// current line of header, used in rewrite mode
+	int lineLen;
+	bool lineOverflow;	// current line longer than RTSP_MAX_LINE, it is not rewritten
+	int startLen;		// length of start line (request or status line)
+	char *frame;		// interleaved frame taken by onInterleaved
+	int frameLen;
+	bool take;
+	bool drop;
+	void (*onHeader)(const char *header, int len, void *userData);
+	void (*onBody)(const char *data, int len, void *userData);
+	int (*rewriteLine)(const char *header, int headerLen, const char *line, int len,
+			char *out, int outSize, void *userData);
+	bool (*takeChannel)(int channel, void *userData);
+	void (*onInterleaved)(int channel, const char *data, int len, void *userData);
+	void *userData;
+};
+
+int rtspHeaderLength(const char *msg, int len) {
+	int i;
+	for(i=3; i<len; i++)
+		if(msg[i] == '\n' && msg[i-1] == '\r' && msg[i-2] == '\n' && msg[i-3] == '\r')
+			return i+1;
+	return 0;
+}
+
+const char *rtspGetHeader(const char *msg, int len, const char *name, int *valueLen) {
+	int nameLen = strlen(name);
+	int end = rtspHeaderLength(msg, len);
+	int i = 0, j;
+	if(end == 0)
+		end = len;
+	// skip first line (request or status line)
+	while(i < end && msg[i] != '\n')
+		i++;
+	i++;
+	while(i < end) {
+		if(i+nameLen < end && strncasecmp(msg+i, name, nameLen) == 0 && msg[i+nameLen] == ':') {
+			i += nameLen+1;
+			while(i < end && (msg[i] == ' ' || msg[i] == '\t'))
+				i++;
+			for(j=i; j<end && msg[j] != '\r' && msg[j] != '\n'; j++);
+			if(valueLen != NULL)
+				*valueLen = j-i;
+			return msg+i;
+		}
+		while(i < end && msg[i] != '\n')
+			i++;
+		i++;
+	}
+	return NULL;
+}
+
+int rtspContentLength(const char *msg, int len) {
+	char value[16];
+	int valueLen;
+	const char *v = rtspGetHeader(msg, len, "Content-Length", &valueLen);
+	if(v == NULL || valueLen <= 0 || valueLen >= sizeof(value))
+		return 0;
+	memcpy(value, v, valueLen);
+	value[valueLen] = '\0';
+	return atoi(value);
+}
+
+int rtspGetCSeq(const char *msg, int len) {
+	char value[16];
+	int valueLen;
+	const char *v = rtspGetHeader(msg, len, "CSeq", &valueLen);
+	if(v == NULL || valueLen <= 0 || valueLen >= sizeof(value))
+		return -1;
+	memcpy(value, v, valueLen);
+	value[valueLen] = '\0';
+	return atoi(value);
+}
+
+bool rtspGetRequestLine(const char *msg, int len, char *method, int methodSize, char *url, int urlSize) {
+	int i, j;
+	for(i=0; i<len && msg[i] != ' '; i++);
+	if(i == 0 || i == len || i >= methodSize)
+		return false;
+	memcpy(method, msg, i);
+	method[i] = '\0';
+	i++;
+	for(j=i; j<len && msg[j] != ' ' && msg[j] != '\r'; j++);
+	if(j == i || j == len || j-i >= urlSize)
+		return false;
+	memcpy(url, msg+i, j-i);
+	url[j-i] = '\0';
+	return true;
+}
+
+// returns the url without scheme and credentials
+IOTC_PRIVATE const char *rtspUrlResource(const char *url) {
+	const char *host = strstr(url, "://");
+	const char *at;
+	host = host != NULL ? host+3 : url;
+	at = strchr(host, '@');
+	if(at != NULL && (strchr(host, '/') == NULL || at < strchr(host, '/')))
+		host = at+1;
+	return host;
+}
+
+bool rtspSameUrl(const char *url1, const char *url2) {
+	const char *r1 = rtspUrlResource(url1);
+	const char *r2 = rtspUrlResource(url2);
+	int l1 = strlen(r1), l2 = strlen(r2);
+	if(l1 > 0 && r1[l1-1] == '/')
+		l1--;
+	if(l2 > 0 && r2[l2-1] == '/')
+		l2--;
+	return l1 == l2 && strncasecmp(r1, r2, l1) == 0;
+}
+
+// returns the value of an integer parameter of the first transport of the list, -1 if not present
+IOTC_PRIVATE int rtspTransportInt(const char *transport, int len, const char *name) {
+	int nameLen = strlen(name);
+	int i = 0, value;
+	while(i < len && transport[i] != ',') {
+		// parameter starts here
+		if(i+nameLen < len && strncasecmp(transport+i, name, nameLen) == 0 && transport[i+nameLen] == '=') {
+			i += nameLen+1;
+			if(i == len || transport[i] < '0' || transport[i] > '9')
+				return -1;
+			for(value=0; i<len && transport[i] >= '0' && transport[i] <= '9' && value < 65536; i++)
+				value = value*10 + (transport[i]-'0');
+			return value;
+		}
+		while(i < len && transport[i] != ';' && transport[i] != ',')
+			i++;
+		if(i < len && transport[i] == ';')
+			i++;
+	}
+	return -1;
+}
+
+int rtspTransportPort(const char *transport, int len, const char *name) {
+	int port = rtspTransportInt(transport, len, name);
+	return port > 0 && port < 65536 ? port : 0;
+}
+
+int rtspTransportChannel(const char *transport, int len) {
+	int channel = rtspTransportInt(transport, len, "interleaved");
+	return channel < 256 ? channel : -1;
+}
+
+RtspParser *rtspParserNew(void (*onHeader)(const char *header, int len, void *userData),
+		void (*onBody)(const char *data, int len, void *userData), void *userData) {
+	RtspParser *parser = (RtspParser *)malloc(sizeof(RtspParser));
+	if(parser == NULL) {
+#ifdef DEBUG
+		printf("Malloc error: parser\n");
+#endif
+		return NULL;
+	}
+	memset(parser, 0, sizeof(RtspParser));
+	parser->header = (char *)malloc(RTSP_MAX_HEADER);
+	if(parser->header == NULL) {
+#ifdef DEBUG
+		printf("Malloc error: parser->header\n");
+#endif
+		free(parser);
+		return NULL;
+	}
+	parser->state = RTSP_PARSE_START;
+	parser->onHeader = onHeader;
+	parser->onBody = onBody;
+	parser->userData = userData;
+	return parser;
+}
+
+bool rtspParserSetRewrite(RtspParser *parser,
+		int (*rewriteLine)(const char *header, int headerLen, const char *line, int len,
+				char *out, int outSize, void *userData),
+		bool (*takeChannel)(int channel, void *userData),
+		void (*onInterleaved)(int channel, const char *data, int len, void *userData)) {
+	if(parser->line == NULL)
+		parser->line = (char *)malloc(RTSP_MAX_LINE);
+	if(parser->frame == NULL && takeChannel != NULL)
+		parser->frame = (char *)malloc(RTSP_MAX_FRAME);
+	if(parser->line == NULL || (takeChannel != NULL && parser->frame == NULL)) {
+#ifdef DEBUG
+		printf("Malloc error: parser rewrite buffers\n");
+#endif
+		return false;
+	}
+	parser->rewriteLine = rewriteLine;
+	parser->takeChannel = takeChannel;
+	parser->onInterleaved = onInterleaved;
+	return true;
+}
+
+IOTC_PRIVATE void copyOut(char *out, int *outLen, const char *data, int len) {
+	if(out == NULL)
+		return;
+	memcpy(out+(*outLen), data, len);
+	*outLen += len;
+}
+
+// a complete line of header has been read, write it (maybe rewritten) into output
+IOTC_PRIVATE void rewriteOrCopy(RtspParser *p, char *out, int *outLen, int maxLen) {
+	int n = -1;
+	// start line is never rewritten
+	if(p->startLen > 0 && p->rewriteLine != NULL && maxLen > *outLen)
+		n = p->rewriteLine(p->header, p->headerLen, p->line, p->lineLen, out+(*outLen), maxLen-(*outLen), p->userData);
+	if(n >= 0)
+		*outLen += n;
+	else
+		copyOut(out, outLen, p->line, p->lineLen);
+}
+
+// parse data writing to out (if not NULL) data to forward. Returns the number of bytes written
+IOTC_PRIVATE int rtspParse(RtspParser *p, const char *data, int len, char *out, int outSize) {
+	int i = 0, n, outLen = 0;
+	while(i < len) {
+		switch(p->state) {
+			case RTSP_PARSE_START:
+				// skip empty lines between messages
+				if(data[i] == '\r' || data[i] == '\n') {
+					copyOut(out, &outLen, data+i, 1);
+					i++;
+					break;
+				}
+				p->headerLen = 0;
+				p->overflow = false;
+				p->newlines = 0;
+				p->startLen = 0;
+				p->lineLen = 0;
+				p->lineOverflow = false;
+				p->interleavedLen = 0;
+				p->state = data[i] == '$' ? RTSP_PARSE_INTERLEAVED_HEADER : RTSP_PARSE_HEADER;
+			break;
+			case RTSP_PARSE_HEADER:
+				for(; i<len && p->newlines<2; i++) {
+					if(p->headerLen < RTSP_MAX_HEADER)
+						p->header[p->headerLen++] = data[i];
+					else
+						p->overflow = true;
+					if(data[i] == '\n')
+						p->newlines++;
+					else if(data[i] != '\r')
+						p->newlines = 0;
+					if(out == NULL)
+						continue;
+					// lines are kept until complete because they could be rewritten
+					if(p->lineOverflow) {
+						copyOut(out, &outLen, data+i, 1);
+					} else if(p->lineLen < RTSP_MAX_LINE) {
+						p->line[p->lineLen++] = data[i];
+					} else {
+						copyOut(out, &outLen, p->line, p->lineLen);
+						copyOut(out, &outLen, data+i, 1);
+						p->lineOverflow = true;
+					}
+					if(data[i] == '\n') {
+						// room left for the rest of data must not be used by rewrite
+						if(!p->lineOverflow)
+							rewriteOrCopy(p, out, &outLen, outSize-(len-i-1));
+						if(p->startLen == 0)
+							p->startLen = p->headerLen;
+						p->lineLen = 0;
+						p->lineOverflow = false;
+					}
+				}
+				if(p->newlines < 2)
+					break;
+				p->remaining = rtspContentLength(p->header, p->headerLen);
+				if(p->overflow) {
+#ifdef DEBUG
+					printf("RTSP header too long, not inspected\n");
+#endif
+				} else if(p->onHeader != NULL) {
+					p->onHeader(p->header, p->headerLen, p->userData);
+				}
+				p->state = p->remaining > 0 ? RTSP_PARSE_BODY : RTSP_PARSE_START;
+			break;
+			case RTSP_PARSE_BODY:
+				n = (len-i) < p->remaining ? (len-i) : p->remaining;
+				if(p->onBody != NULL)
+					p->onBody(data+i, n, p->userData);
+				copyOut(out, &outLen, data+i, n);
+				i += n;
+				p->remaining -= n;
+				if(p->remaining == 0)
+					p->state = RTSP_PARSE_START;
+			break;
+			case RTSP_PARSE_INTERLEAVED_HEADER:
+				p->interleaved[p->interleavedLen++] = data[i++];
+				if(p->interleavedLen < 4)
+					break;
+				p->remaining = (((unsigned int)p->interleaved[2])<<8) + p->interleaved[3];
+				p->take = p->takeChannel != NULL && p->takeChannel(p->interleaved[1], p->userData);
+				p->drop = p->take && p->remaining > RTSP_MAX_FRAME;
+				p->frameLen = 0;
+				if(!p->take)
+					copyOut(out, &outLen, (char *)p->interleaved, 4);
+#ifdef DEBUG
+				if(p->drop)
+					printf("RTSP interleaved frame too big, dropped\n");
+#endif
+				p->state = p->remaining > 0 ? RTSP_PARSE_INTERLEAVED : RTSP_PARSE_START;
+			break;
+			case RTSP_PARSE_INTERLEAVED:
+				n = (len-i) < p->remaining ? (len-i) : p->remaining;
+				if(!p->take) {
+					copyOut(out, &outLen, data+i, n);
+				} else if(!p->drop) {
+					memcpy(p->frame+p->frameLen, data+i, n);
+					p->frameLen += n;
+				}
+				i += n;
+				p->remaining -= n;
+				if(p->remaining > 0)
+					break;
+				if(p->take && !p->drop && p->onInterleaved != NULL)
+					p->onInterleaved(p->interleaved[1], p->frame, p->frameLen, p->userData);
+				p->state = RTSP_PARSE_START;
+			break;
+		}
+	}
+	return outLen;
+}
+
+void rtspParserFeed(RtspParser *parser, const char *data, int len) {
+	rtspParse(parser, data, len, NULL, 0);
+}
+
+int rtspParserRewrite(RtspParser *parser, const char *data, int len, char *out, int outSize) {
+	return rtspParse(parser, data, len, out, outSize);
+}
+
+bool rtspParserIdle(RtspParser *parser) {
+	return parser->state == RTSP_PARSE_START;
+}
+
+void rtspParserFree(RtspParser *parser) {
+	if(parser == NULL)
+		return;
+	free(parser->header);
+	if(parser->line != NULL)
+		free(parser->line);
+	if(parser->frame != NULL)
+		free(parser->frame);
+	free(parser);
+}
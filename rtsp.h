@@ -0,0 +1,210 @@
+/*
+ * Copyright (C) 2015 CSP Innovazione nelle ICT s.c.a r.l. (http://www.csp.it/)
+ * All rights reserved.
+ *
+ * [any text provided by the client]
+ *
+ */
+
+/**
+ * @file rtsp.h
+ * @author Matteo Di Leo <matteo.dileo@csp.it>
+ * @date 19/10/2026
+ * @brief Urmet IoT RTSP message inspection
+ *
+ * Here are placed the functions used by the tunnel to read RTSP messages.
+ * Messages are not null terminated: every function works on a buffer and its length.
+ */
+
+#ifndef __RTSP_H__
+#define __RTSP_H__
+
+#include <stdbool.h>
+
+#define RTSP_MAX_HEADER 2048 // header sections longer than this are not inspected
+#define RTSP_MAX_LINE 512 // header lines longer than this are not rewritten
+#define RTSP_MAX_FRAME 4096 // interleaved frames longer than this cannot be taken
+#define RTSP_REWRITE_SPACE (RTSP_MAX_LINE + 128) // output space needed by rtspParserRewrite() over input length
+
+/**
+ * @brief Incremental parser of a RTSP stream
+ *
+ * The parser receives the bytes of a connection as they arrive, in chunks of any size,
+ * and separates header sections, bodies and interleaved binary data ('$' frames).
+ * Every byte is read once: headers are copied only until their end, bodies and
+ * interleaved data are just skipped.
+ *
+ * @see rtspParserNew()
+ */
+typedef struct rtspParser RtspParser;
+
+/**
+ * @brief Get the length of the header section of a RTSP message
+ *
+ * @param msg The buffer containing the message
+ * @param len The length of the buffer
+ * @return The number of bytes up to the empty line (included), 0 if the header is not complete
+ */
+int rtspHeaderLength(const char *msg, int len);
+
+/**
+ * @brief Get the value of a header
+ *
+ * @param msg The buffer containing the message
+ * @param len The length of the buffer
+ * @param name The name of the header (case insensitive, ex.: "Transport")
+ * @param[out] valueLen The length of the value, without line terminator
+ * @return A pointer to the value inside msg or NULL if header is not present
+ */
+const char *rtspGetHeader(const char *msg, int len, const char *name, int *valueLen);
+
+/**
+ * @brief Get the value of Content-Length header
+ *
+ * @param msg The buffer containing the message
+ * @param len The length of the buffer
+ * @return The length of the body or 0 if the message has no body
+ */
+int rtspContentLength(const char *msg, int len);
+
+/**
+ * @brief Get the value of CSeq header
+ *
+ * @param msg The buffer containing the message
+ * @param len The length of the buffer
+ * @return The sequence number or -1 if not present
+ */
+int rtspGetCSeq(const char *msg, int len);
+
+/**
+ * @brief Read method and url from a request line
+ *
+ * @param msg The buffer containing the request
+ * @param len The length of the buffer
+ * @param[out] method The buffer filled with the method as string (ex.: "SETUP")
+ * @param methodSize The size of method buffer
+ * @param[out] url The buffer filled with the url as string
+ * @param urlSize The size of url buffer
+ * @return true if the request line is valid, false otherwise
+ */
+bool rtspGetRequestLine(const char *msg, int len, char *method, int methodSize, char *url, int urlSize);
+
+/**
+ * @brief Get a port from the value of a Transport header
+ *
+ * @param transport The value of Transport header (ex.: "RTP/AVP;unicast;client_port=4588-4589")
+ * @param len The length of the value
+ * @param name The name of the parameter (ex.: "client_port")
+ * @return The first port of the parameter, 0 if parameter is not present. Only the first transport
+ *	of the list is read
+ */
+int rtspTransportPort(const char *transport, int len, const char *name);
+
+/**
+ * @brief Get the interleaved channel from the value of a Transport header
+ *
+ * @param transport The value of Transport header (ex.: "RTP/AVP/TCP;unicast;interleaved=0-1")
+ * @param len The length of the value
+ * @return The first channel of interleaved parameter, -1 if parameter is not present
+ */
+int rtspTransportChannel(const char *transport, int len);
+
+/**
+ * @brief Create a RTSP stream parser
+ *
+ * @param onHeader Callback invoked for every complete header section. Params are:
+ *	- header The header section, including start line and empty line (not null terminated)
+ *	- len The length of header section
+ *	- userData The user data provided as parameter in this function
+ * @param onBody Callback invoked with chunks of message bodies (can be NULL). Params are:
+ *	- data The chunk of body
+ *	- len The length of chunk
+ *	- userData The user data provided as parameter in this function
+ * @param userData A pointer to data passed back to callbacks
+ * @return The parser, to be deallocated using rtspParserFree(), or NULL if an error occurred
+ */
+RtspParser *rtspParserNew(void (*onHeader)(const char *header, int len, void *userData),
+		void (*onBody)(const char *data, int len, void *userData), void *userData);
+
+/**
+ * @brief Pass to parser the next bytes of the stream
+ *
+ * Callbacks are invoked before this function returns. Data is never modified.
+ * @param parser The parser created using rtspParserNew()
+ * @param data The bytes received
+ * @param len The number of bytes
+ */
+void rtspParserFeed(RtspParser *parser, const char *data, int len);
+
+/**
+ * @brief Enable rewrite mode of a parser
+ *
+ * In rewrite mode the stream is passed to rtspParserRewrite(), which copies it to an output
+ * buffer after changing header lines and taking out interleaved frames.
+ * @param parser The parser created using rtspParserNew()
+ * @param rewriteLine Callback invoked for every complete header line but the start line. Params are:
+ *	- header The header section read so far, from the start line (request or status line)
+ *	to this line included
+ *	- headerLen The length of header
+ *	- line The header line, including line terminator
+ *	- len The length of line
+ *	- out The buffer where the new line must be written
+ *	- outSize The space available in out
+ *	- userData The user data provided to rtspParserNew()
+ *	- return The number of bytes written, or -1 to keep the line unchanged
+ * @param takeChannel Callback invoked at the start of every interleaved frame (can be NULL). Params are:
+ *	- channel The interleaved channel of the frame
+ *	- userData The user data provided to rtspParserNew()
+ *	- return true if frame must be taken out of the stream and passed to onInterleaved
+ * @param onInterleaved Callback invoked with every complete frame taken out of the stream. Params are:
+ *	- channel The interleaved channel of the frame
+ *	- data The payload of the frame (ex.: a RTP packet)
+ *	- len The length of payload
+ *	- userData The user data provided to rtspParserNew()
+ * @return true if rewrite mode is enabled, false if an error occurred
+ */
+bool rtspParserSetRewrite(RtspParser *parser,
+		int (*rewriteLine)(const char *header, int headerLen, const char *line, int len,
+				char *out, int outSize, void *userData),
+		bool (*takeChannel)(int channel, void *userData),
+		void (*onInterleaved)(int channel, const char *data, int len, void *userData));
+
+/**
+ * @brief Pass to parser the next bytes of the stream and get the bytes to forward
+ *
+ * Incomplete header lines are kept by the parser and written in output when complete.
+ * @param parser The parser in rewrite mode
+ * @param data The bytes received
+ * @param len The number of bytes
+ * @param[out] out The buffer filled with the bytes to forward
+ * @param outSize The size of out, must be at least len + RTSP_REWRITE_SPACE
+ * @return The number of bytes written in out
+ * @see rtspParserSetRewrite()
+ */
+int rtspParserRewrite(RtspParser *parser, const char *data, int len, char *out, int outSize);
+
+/**
+ * @brief Check the parser is between two messages
+ *
+ * @param parser The parser created using rtspParserNew()
+ * @return true if no message or interleaved frame is partially read
+ */
+bool rtspParserIdle(RtspParser *parser);
+
+/**
+ * @brief Deallocate a parser created using rtspParserNew()
+ *
+ * @param parser The parser to free (can be NULL)
+ */
+void rtspParserFree(RtspParser *parser);
+
+/**
+ * @brief Compare two RTSP urls ignoring credentials and trailing '/'
+ *
+ * @param url1 The first url
+ * @param url2 The second url
+ * @return true if urls point to the same resource
+ */
+bool rtspSameUrl(const char *url1, const char *url2);
+
+#endif /* __RTSP_H__ */
@@ -12,6 +12,8 @@
  */
 
 #include "secure.h"
+#include "http.h"
+#include "dns.h"
 
 //#ifndef IOTC_CLIENT
 
@@ -20,12 +22,66 @@
 #include <openssl/ssl.h>
 #include <openssl/x509v3.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <errno.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#elif defined(__linux__) && (defined(__aarch64__) || defined(__arm__))
+#include <sys/auxv.h>
+#endif
 #include <glib/glib.h>
 #include <gio/gio.h>
 
+#define SSL_CTX_CACHE_SIZE 4 // contexts kept, one for each set of CA/cert/key files
+#define SSL_SESSION_CACHE_SIZE 8 // sessions kept, one for each server and client cert
+
+/*
+ * TLS policy: TLS 1.2 or newer, ECDHE key exchange and AEAD ciphers only. AES-GCM comes first
+ * on CPUs with AES instructions, ChaCha20-Poly1305 (faster in software) elsewhere.
+ * TLS_MIN_VERSION and TLS_CIPHERS can be set in options-config*.mk: lowering TLS_MIN_VERSION
+ * needs a TLS_CIPHERS list with non AEAD ciphers too.
+ */
+#ifndef TLS_MIN_VERSION
+#define TLS_MIN_VERSION TLS1_2_VERSION
+#endif
+#define TLS_CIPHERS_AES "ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256:" \
+		"ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES256-GCM-SHA384:" \
+		"ECDHE-ECDSA-CHACHA20-POLY1305:ECDHE-RSA-CHACHA20-POLY1305"
+#define TLS_CIPHERS_CHACHA "ECDHE-ECDSA-CHACHA20-POLY1305:ECDHE-RSA-CHACHA20-POLY1305:" \
+		"ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256:" \
+		"ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES256-GCM-SHA384"
+#define TLS13_SUITES_AES "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384:TLS_CHACHA20_POLY1305_SHA256"
+#define TLS13_SUITES_CHACHA "TLS_CHACHA20_POLY1305_SHA256:TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384"
+#define TLS_CURVES "X25519:P-256:P-384"
+
+// early data (0-RTT) needs TLS 1.3
+#if defined(HTTPS_EARLY_DATA) && OPENSSL_VERSION_NUMBER < 0x10101000L
+#undef HTTPS_EARLY_DATA
+#endif
+
+#if defined(__linux__) && defined(__aarch64__) && !defined(HWCAP_AES)
+#define HWCAP_AES (1 << 3)
+#elif defined(__linux__) && defined(__arm__) && !defined(HWCAP2_AES)
+#define HWCAP2_AES (1 << 0)
+#endif
+
+// steps of an async request, each one is resumed when socket is ready
+enum httpsState {
+	HTTPS_CONNECTING,
+	HTTPS_SEND_EARLY,	// request sent with the first handshake message
+	HTTPS_HANDSHAKE,
+	HTTPS_WRITE,
+	HTTPS_READ
+};
+
 struct httpsCtx {
+	char *key;		// host:port:crtFile, identifies sessions and pooled connections
+	bool pooled;		// connection taken from pool
+	bool keepAlive;		// connection can be pooled after response
 	int sock;
-	SSL_CTX *sslCtx;
 	SSL *ssl;
 	GSocketClient *gSocketClient;
 	GSocketConnection *gSocketConnection;
@@ -39,6 +95,17 @@ struct httpsCtx {
 	char *postMsg;
 	void (*callback)(int, char *, void*);
 	void *userData;
+	enum httpsState state;
+	bool earlyData;		// request sent as early data
+	char *request;
+	int requestLen;
+	HttpParser *parser;
+	int offset;		// bytes of response received
+	guint watch;		// socket readiness source of async requests
+	guint timeout;
+	GCancellable *cancellable;
+	GList *addresses;	// addresses of host for async requests
+	GList *address;		// address being connected
 };
 
 /**
@@ -182,34 +249,355 @@ void certBundleFree(struct certBundle *bundle) {
 }
 
 // PRIVATE
+/*
+ * SSL contexts are built once for each set of files and shared by all https requests (each SSL
+ * keeps its own reference to context). A context is rebuilt when one of its files changes.
+ */
+struct sslCtxCacheEntry {
+	char *CAFile;
+	char *CAPath;
+	char *crtFile;
+	char *keyFile;
+	time_t mtime[3];	// modification time of CAFile, crtFile and keyFile when loaded
+	SSL_CTX *sslCtx;
+	struct sslCtxCacheEntry *next;
+};
+
+// session of last handshake with a server, resumed by next connection to skip full handshake
+struct sslSessionCacheEntry {
+	char *key;		// host:port:crtFile
+	SSL_SESSION *session;
+	struct sslSessionCacheEntry *next;
+};
+
+// idle connection kept open to send next request to the same server
+struct httpsPoolEntry {
+	char *key;
+	int sock;
+	SSL *ssl;
+	GSocketConnection *gSocketConnection;	// owner of sock for async requests
+	gint64 idleSince;
+	struct httpsPoolEntry *next;
+};
+
+IOTC_PRIVATE struct sslCtxCacheEntry *sslCtxCache = NULL;
+IOTC_PRIVATE struct httpsPoolEntry *httpsPool = NULL;
+IOTC_PRIVATE struct sslSessionCacheEntry *sslSessionCache = NULL;
+IOTC_PRIVATE pthread_mutex_t sslCtxCacheLock = PTHREAD_MUTEX_INITIALIZER;
+IOTC_PRIVATE pthread_once_t sslInitOnce = PTHREAD_ONCE_INIT;
+IOTC_PRIVATE bool tlsAesHardware = false;
+
 IOTC_PRIVATE int verify_server_cert_cb(int ok, X509_STORE_CTX *ctx) {
 	return 1;
 }
 
-// PRIVATE
-IOTC_PRIVATE void httpsCtxFree(struct httpsCtx *httpsCtx) {
-	// close all connections
+IOTC_PRIVATE bool cpuHasAes() {
+#if defined(__x86_64__) || defined(__i386__)
+	unsigned int eax, ebx, ecx, edx;
+	if(__get_cpuid(1, &eax, &ebx, &ecx, &edx) == 0)
+		return false;
+	return (ecx & bit_AES) != 0;
+#elif defined(__linux__) && defined(__aarch64__)
+	return (getauxval(AT_HWCAP) & HWCAP_AES) != 0;
+#elif defined(__linux__) && defined(__arm__)
+	return (getauxval(AT_HWCAP2) & HWCAP2_AES) != 0;
+#else
+	return false;
+#endif
+}
+
+IOTC_PRIVATE void sslInit() {
+	SSLeay_add_ssl_algorithms();
+	tlsAesHardware = cpuHasAes();
+#ifdef DEBUG
+	printf("[DEBUG] AES instructions %savailable, preferring %s\n", tlsAesHardware ? "" : "not ",
+			tlsAesHardware ? "AES-GCM" : "ChaCha20");
+#endif
+}
+
+const char *tlsCipherList() {
+	pthread_once(&sslInitOnce, sslInit);
+#ifdef TLS_CIPHERS
+	return TLS_CIPHERS;
+#else
+	return tlsAesHardware ? TLS_CIPHERS_AES : TLS_CIPHERS_CHACHA;
+#endif
+}
+
+IOTC_PRIVATE int sslNewSessionCb(SSL *ssl, SSL_SESSION *session);
+
+// protocol versions, ciphers and curves of TLS policy
+IOTC_PRIVATE bool sslCtxSetPolicy(SSL_CTX *sslCtx) {
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	if(SSL_CTX_set_min_proto_version(sslCtx, TLS_MIN_VERSION) != 1)
+		return false;
+	SSL_CTX_set1_curves_list(sslCtx, TLS_CURVES);
+#else
+	long options = SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3;
+	if(TLS_MIN_VERSION > TLS1_VERSION)
+		options |= SSL_OP_NO_TLSv1;
+	if(TLS_MIN_VERSION > TLS1_1_VERSION)
+		options |= SSL_OP_NO_TLSv1_1;
+	SSL_CTX_set_options(sslCtx, options);
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+	SSL_CTX_set_ecdh_auto(sslCtx, 1);
+#endif
+#endif
+	if(SSL_CTX_set_cipher_list(sslCtx, tlsCipherList()) != 1) {
+#ifdef DEBUG
+		printf("No cipher of TLS policy is available\n");
+#endif
+		return false;
+	}
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+	SSL_CTX_set_ciphersuites(sslCtx, tlsAesHardware ? TLS13_SUITES_AES : TLS13_SUITES_CHACHA);
+#endif
+	// with TLS 1.3 sessions arrive after handshake: store them when they arrive
+	SSL_CTX_set_session_cache_mode(sslCtx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(sslCtx, sslNewSessionCb);
+	return true;
+}
+
+IOTC_PRIVATE time_t fileMtime(const char *file) {
+	struct stat st;
+	if(file == NULL || stat(file, &st) != 0)
+		return 0;
+	return st.st_mtime;
+}
+
+IOTC_PRIVATE bool sameFile(const char *file1, const char *file2) {
+	if(file1 == NULL || file2 == NULL)
+		return file1 == file2;
+	return strcmp(file1, file2) == 0;
+}
+
+IOTC_PRIVATE void sslCtxCacheEntryFree(struct sslCtxCacheEntry *entry) {
+	SSL_CTX_free(entry->sslCtx);
+	free(entry->CAFile);
+	free(entry->CAPath);
+	free(entry->crtFile);
+	free(entry->keyFile);
+	free(entry);
+}
+
+// initialize SSL context with ca cert and key
+IOTC_PRIVATE SSL_CTX *sslCtxNew(const char *CAFile, const char *CAPath, const char *crtFile, const char *keyFile) {
+	int error;
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	SSL_CTX *sslCtx = SSL_CTX_new(TLS_client_method());
+#else
+	SSL_CTX *sslCtx = SSL_CTX_new(SSLv23_client_method());
+#endif
+	if(sslCtx == NULL) {
+#ifdef DEBUG
+		printf("Cannot intialize context\n");
+#endif
+		return NULL;
+	}
+	if(!sslCtxSetPolicy(sslCtx)) {
+		SSL_CTX_free(sslCtx);
+		return NULL;
+	}
+	SSL_CTX_set_verify(sslCtx, SSL_VERIFY_PEER, verify_server_cert_cb);
+	SSL_CTX_load_verify_locations(sslCtx, CAFile, CAPath);
+//#ifndef IOTC_CLIENT
+	SSL_CTX_set_default_verify_paths(sslCtx);
+//#endif
+//	SSL_CTX_use_certificate_chain_file(sslCtx, crtFile);
+	if(crtFile != NULL && keyFile != NULL) {
+		SSL_CTX_use_certificate_file(sslCtx, crtFile, SSL_FILETYPE_PEM);
+		SSL_CTX_use_PrivateKey_file(sslCtx, keyFile, SSL_FILETYPE_PEM);
+
+		error = SSL_CTX_check_private_key(sslCtx);
+#ifdef DEBUG
+		if(error != 1)
+			printf("Private Key not verified\n");
+#endif
+	}
+	return sslCtx;
+}
+
+// create a SSL using the cached context for these files, building it if missing or outdated
+IOTC_PRIVATE SSL *sslNew(const char *CAFile, const char *CAPath, const char *crtFile, const char *keyFile) {
+	struct sslCtxCacheEntry **prev, *entry = NULL;
+	time_t mtime[3];
+	int count = 0;
+	SSL *ssl = NULL;
+	pthread_once(&sslInitOnce, sslInit);
+	mtime[0] = fileMtime(CAFile);
+	mtime[1] = fileMtime(crtFile);
+	mtime[2] = fileMtime(keyFile);
+	pthread_mutex_lock(&sslCtxCacheLock);
+	for(prev=&sslCtxCache; *prev!=NULL; prev=&((*prev)->next)) {
+		if(sameFile((*prev)->CAFile, CAFile) && sameFile((*prev)->CAPath, CAPath) &&
+				sameFile((*prev)->crtFile, crtFile) && sameFile((*prev)->keyFile, keyFile)) {
+			entry = *prev;
+			*prev = entry->next;
+			if(memcmp(entry->mtime, mtime, sizeof(mtime)) != 0) {
+#ifdef DEBUG
+				printf("[DEBUG] Certificate files changed, reloading SSL context\n");
+#endif
+				sslCtxCacheEntryFree(entry);
+				entry = NULL;
+			}
+			break;
+		}
+	}
+	if(entry == NULL) {
+		entry = (struct sslCtxCacheEntry *)malloc(sizeof(struct sslCtxCacheEntry));
+		if(entry == NULL) {
+#ifdef DEBUG
+			printf("Malloc error: entry\n");
+#endif
+			pthread_mutex_unlock(&sslCtxCacheLock);
+			return NULL;
+		}
+		entry->sslCtx = sslCtxNew(CAFile, CAPath, crtFile, keyFile);
+		if(entry->sslCtx == NULL) {
+			free(entry);
+			pthread_mutex_unlock(&sslCtxCacheLock);
+			return NULL;
+		}
+		entry->CAFile = CAFile != NULL ? strdup(CAFile) : NULL;
+		entry->CAPath = CAPath != NULL ? strdup(CAPath) : NULL;
+		entry->crtFile = crtFile != NULL ? strdup(crtFile) : NULL;
+		entry->keyFile = keyFile != NULL ? strdup(keyFile) : NULL;
+		memcpy(entry->mtime, mtime, sizeof(mtime));
+	}
+	// most recently used first, least recently used dropped
+	entry->next = sslCtxCache;
+	sslCtxCache = entry;
+	for(prev=&sslCtxCache; *prev!=NULL; prev=&((*prev)->next)) {
+		if(++count > SSL_CTX_CACHE_SIZE) {
+			sslCtxCacheEntryFree(*prev);
+			*prev = NULL;
+			break;
+		}
+	}
+	ssl = SSL_new(entry->sslCtx);
+	pthread_mutex_unlock(&sslCtxCacheLock);
+	return ssl;
+}
+
+IOTC_PRIVATE void sslSessionCacheEntryFree(struct sslSessionCacheEntry *entry) {
+	if(entry->session != NULL)
+		SSL_SESSION_free(entry->session);
+	free(entry->key);
+	free(entry);
+}
+
+// remove the session of key from cache, the caller owns it
+IOTC_PRIVATE struct sslSessionCacheEntry *sslSessionTake(const char *key) {
+	struct sslSessionCacheEntry **prev, *entry;
+	for(prev=&sslSessionCache; *prev!=NULL; prev=&((*prev)->next)) {
+		if(strcmp((*prev)->key, key) == 0) {
+			entry = *prev;
+			*prev = entry->next;
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+// resume the cached session of key, if any
+IOTC_PRIVATE void sslSessionResume(SSL *ssl, const char *key) {
+	struct sslSessionCacheEntry *entry;
+	pthread_mutex_lock(&sslCtxCacheLock);
+	for(entry=sslSessionCache; entry!=NULL; entry=entry->next) {
+		if(strcmp(entry->key, key) == 0) {
+			SSL_set_session(ssl, entry->session);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&sslCtxCacheLock);
+}
+
+// keep session of a connected ssl for key, or drop the cached one if session is NULL
+IOTC_PRIVATE void sslSessionStore(const char *key, SSL_SESSION *session) {
+	struct sslSessionCacheEntry **prev, *entry;
+	int count = 0;
+	pthread_mutex_lock(&sslCtxCacheLock);
+	entry = sslSessionTake(key);
+	if(session == NULL) {
+		if(entry != NULL)
+			sslSessionCacheEntryFree(entry);
+		pthread_mutex_unlock(&sslCtxCacheLock);
+		return;
+	}
+	if(entry == NULL) {
+		entry = (struct sslSessionCacheEntry *)malloc(sizeof(struct sslSessionCacheEntry));
+		if(entry == NULL) {
+#ifdef DEBUG
+			printf("Malloc error: entry\n");
+#endif
+			SSL_SESSION_free(session);
+			pthread_mutex_unlock(&sslCtxCacheLock);
+			return;
+		}
+		entry->key = strdup(key);
+	} else {
+		SSL_SESSION_free(entry->session);
+	}
+	entry->session = session;
+	entry->next = sslSessionCache;
+	sslSessionCache = entry;
+	for(prev=&sslSessionCache; *prev!=NULL; prev=&((*prev)->next)) {
+		if(++count > SSL_SESSION_CACHE_SIZE) {
+			sslSessionCacheEntryFree(*prev);
+			*prev = NULL;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&sslCtxCacheLock);
+}
+
+// the ssl of every connection carries the key of its server as app data
+IOTC_PRIVATE int sslNewSessionCb(SSL *ssl, SSL_SESSION *session) {
+	const char *key = (const char *)SSL_get_app_data(ssl);
+	if(key == NULL)
+		return 0;
+	sslSessionStore(key, session);
+	return 1;
+}
+
+// close connection of httpsCtx, a new one can be opened
+IOTC_PRIVATE void httpsCtxClose(struct httpsCtx *httpsCtx) {
+	if(httpsCtx->watch > 0) {
+		g_source_remove(httpsCtx->watch);
+		httpsCtx->watch = 0;
+	}
 	if(httpsCtx->ssl != NULL) {
 		SSL_shutdown(httpsCtx->ssl);
 		SSL_free(httpsCtx->ssl);
 		httpsCtx->ssl = NULL;
 	}
-	if(httpsCtx->sock >= 0) {
+	// socket of async requests is closed with its connection
+	if(httpsCtx->sock >= 0 && httpsCtx->gSocketConnection == NULL)
 		close(httpsCtx->sock);
-		httpsCtx->sock = -1;
-	}
-	if(httpsCtx->sslCtx != NULL) {
-		SSL_CTX_free(httpsCtx->sslCtx);
-		httpsCtx->sslCtx = NULL;
+	httpsCtx->sock = -1;
+	if(httpsCtx->gSocketConnection != NULL) {
+		g_object_unref(httpsCtx->gSocketConnection);
+		httpsCtx->gSocketConnection = NULL;
 	}
+	httpsCtx->pooled = false;
+}
+
+// PRIVATE
+IOTC_PRIVATE void httpsCtxFree(struct httpsCtx *httpsCtx) {
+	// close all connections
+	httpsCtxClose(httpsCtx);
 	if(httpsCtx->gSocketClient != NULL) {
 		g_object_unref(httpsCtx->gSocketClient);
 		httpsCtx->gSocketClient = NULL;
 	}
-	if(httpsCtx->gSocketConnection != NULL) {
-		g_object_unref(httpsCtx->gSocketConnection);
-		httpsCtx->gSocketConnection = NULL;
-	}
+	if(httpsCtx->timeout > 0)
+		g_source_remove(httpsCtx->timeout);
+	if(httpsCtx->cancellable != NULL)
+		g_object_unref(httpsCtx->cancellable);
+	if(httpsCtx->addresses != NULL)
+		g_resolver_free_addresses(httpsCtx->addresses);
+	httpParserFree(httpsCtx->parser);
+	g_free(httpsCtx->request);
 	if(httpsCtx->host != NULL)
 		free(httpsCtx->host);
 	if(httpsCtx->path != NULL)
@@ -224,17 +612,112 @@ IOTC_PRIVATE void httpsCtxFree(struct httpsCtx *httpsCtx) {
 		free(httpsCtx->keyFile);
 	if(httpsCtx->postMsg != NULL)
 		free(httpsCtx->postMsg);
+	g_free(httpsCtx->key);
 	free(httpsCtx);
 }
 
+IOTC_PRIVATE void httpsPoolEntryFree(struct httpsPoolEntry *entry) {
+	SSL_shutdown(entry->ssl);
+	SSL_free(entry->ssl);
+	if(entry->gSocketConnection != NULL)
+		g_object_unref(entry->gSocketConnection);
+	else
+		close(entry->sock);
+	g_free(entry->key);
+	free(entry);
+}
+
+// server closed an idle connection if its socket is readable
+IOTC_PRIVATE bool httpsPoolEntryAlive(struct httpsPoolEntry *entry, gint64 now) {
+	char c;
+	if(now - entry->idleSince > (gint64)HTTPS_POOL_IDLE_TIMEOUT * G_USEC_PER_SEC)
+		return false;
+	return recv(entry->sock, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+// take an idle connection to the server of httpsCtx, returns false if none
+IOTC_PRIVATE bool httpsPoolTake(struct httpsCtx *httpsCtx) {
+	struct httpsPoolEntry **prev, *entry, *found = NULL;
+	gint64 now = g_get_monotonic_time();
+	pthread_mutex_lock(&sslCtxCacheLock);
+	prev = &httpsPool;
+	while(*prev != NULL) {
+		entry = *prev;
+		if(!httpsPoolEntryAlive(entry, now)) {
+			*prev = entry->next;
+			httpsPoolEntryFree(entry);
+		} else if(found == NULL && strcmp(entry->key, httpsCtx->key) == 0) {
+			*prev = entry->next;
+			found = entry;
+		} else {
+			prev = &(entry->next);
+		}
+	}
+	pthread_mutex_unlock(&sslCtxCacheLock);
+	if(found == NULL)
+		return false;
+	httpsCtx->sock = found->sock;
+	httpsCtx->ssl = found->ssl;
+	SSL_set_app_data(httpsCtx->ssl, httpsCtx->key);
+	if(httpsCtx->gSocketConnection != NULL)
+		g_object_unref(httpsCtx->gSocketConnection);
+	httpsCtx->gSocketConnection = found->gSocketConnection;
+	httpsCtx->pooled = true;
+	g_free(found->key);
+	free(found);
+#ifdef DEBUG
+	printf("[DEBUG] Reusing connection to %s\n", httpsCtx->key);
+#endif
+	return true;
+}
+
+// keep connection of httpsCtx open for next requests, if server allows it
+IOTC_PRIVATE void httpsPoolPut(struct httpsCtx *httpsCtx) {
+	struct httpsPoolEntry *entry;
+	int count = 0;
+	if(!httpsCtx->keepAlive || httpsCtx->ssl == NULL)
+		return;
+	pthread_mutex_lock(&sslCtxCacheLock);
+	for(entry=httpsPool; entry!=NULL; entry=entry->next)
+		if(strcmp(entry->key, httpsCtx->key) == 0)
+			count++;
+	if(count >= HTTPS_POOL_MAX_PER_HOST) {
+		pthread_mutex_unlock(&sslCtxCacheLock);
+		return;
+	}
+	entry = (struct httpsPoolEntry *)malloc(sizeof(struct httpsPoolEntry));
+	if(entry == NULL) {
+#ifdef DEBUG
+		printf("Malloc error: entry\n");
+#endif
+		pthread_mutex_unlock(&sslCtxCacheLock);
+		return;
+	}
+	entry->key = g_strdup(httpsCtx->key);
+	entry->sock = httpsCtx->sock;
+	entry->ssl = httpsCtx->ssl;
+	SSL_set_app_data(entry->ssl, entry->key);
+	entry->gSocketConnection = httpsCtx->gSocketConnection;
+	entry->idleSince = g_get_monotonic_time();
+	entry->next = httpsPool;
+	httpsPool = entry;
+	pthread_mutex_unlock(&sslCtxCacheLock);
+	// connection now belongs to pool
+	httpsCtx->sock = -1;
+	httpsCtx->ssl = NULL;
+	httpsCtx->gSocketConnection = NULL;
+}
+
 // PRIVATE
 IOTC_PRIVATE struct httpsCtx *httpsCtxNew(char *host, unsigned short port, char *path,
 		char *CAFile, char *CAPath, char *crtFile, char *keyFile, char *postMsg,
 		void (*onResponse)(int, char *, void *), void *userData) {
 	struct httpsCtx *httpsCtx = (struct httpsCtx *)malloc(sizeof(struct httpsCtx));
+	httpsCtx->key = g_strdup_printf("%s:%u:%s", host, port, crtFile != NULL ? crtFile : "");
+	httpsCtx->pooled = false;
+	httpsCtx->keepAlive = false;
 	httpsCtx->sock = -1;
 	httpsCtx->ssl = NULL;
-	httpsCtx->sslCtx = NULL;
 	httpsCtx->gSocketClient = NULL;
 	httpsCtx->gSocketConnection = NULL;
 	httpsCtx->host = host != NULL ? strdup(host) : NULL;
@@ -247,14 +730,22 @@ IOTC_PRIVATE struct httpsCtx *httpsCtxNew(char *host, unsigned short port, char
 	httpsCtx->postMsg = postMsg != NULL ? strdup(postMsg) : NULL;
 	httpsCtx->callback = onResponse;
 	httpsCtx->userData = userData;
+	httpsCtx->state = HTTPS_CONNECTING;
+	httpsCtx->earlyData = false;
+	httpsCtx->request = NULL;
+	httpsCtx->requestLen = 0;
+	httpsCtx->parser = NULL;
+	httpsCtx->offset = 0;
+	httpsCtx->watch = 0;
+	httpsCtx->timeout = 0;
+	httpsCtx->cancellable = NULL;
+	httpsCtx->addresses = NULL;
+	httpsCtx->address = NULL;
 	return httpsCtx;
 }
 
-// PRIVATE
-IOTC_PRIVATE int httpsPrepareSend(struct httpsCtx *httpsCtx) {
-	int error;
-	char requestString[HTTP_MAX_RESP];
-
+// create SSL over the connected socket, resuming last session with server
+IOTC_PRIVATE int httpsSslStart(struct httpsCtx *httpsCtx) {
 	if(httpsCtx->sock < 0) {
 #ifdef DEBUG
 		printf("Invalid socket. Did you create it?\n");
@@ -262,77 +753,105 @@ IOTC_PRIVATE int httpsPrepareSend(struct httpsCtx *httpsCtx) {
 		return -1;
 	}
 
-	// initialize SSL context with ca cert and key
-	SSLeay_add_ssl_algorithms();
-	httpsCtx->sslCtx = SSL_CTX_new(TLSv1_client_method());
-	if(httpsCtx->sslCtx == NULL) {
+	// SSL connection
+	httpsCtx->ssl = sslNew(httpsCtx->CAFile, httpsCtx->CAPath, httpsCtx->crtFile, httpsCtx->keyFile);
+	if(httpsCtx->ssl == NULL) {
 #ifdef DEBUG
-		printf("Cannot intialize context\n");
+		printf("Cannot intialize ssl\n");
 #endif
 		return -1;
 	}
-	SSL_CTX_set_verify(httpsCtx->sslCtx, SSL_VERIFY_PEER, verify_server_cert_cb);
-	SSL_CTX_load_verify_locations(httpsCtx->sslCtx, httpsCtx->CAFile, httpsCtx->CAPath);
-//#ifndef IOTC_CLIENT
-	SSL_CTX_set_default_verify_paths(httpsCtx->sslCtx);
-//#endif
-//	SSL_CTX_use_certificate_chain_file(httpsCtx->sslCtx, crtFile);
-	if(httpsCtx->crtFile != NULL && httpsCtx->keyFile != NULL) {
-		SSL_CTX_use_certificate_file(httpsCtx->sslCtx, httpsCtx->crtFile, SSL_FILETYPE_PEM);
-		SSL_CTX_use_PrivateKey_file(httpsCtx->sslCtx, httpsCtx->keyFile, SSL_FILETYPE_PEM);
+	SSL_set_fd(httpsCtx->ssl, httpsCtx->sock);
+	SSL_set_connect_state(httpsCtx->ssl);
+	SSL_set_app_data(httpsCtx->ssl, httpsCtx->key);
+	sslSessionResume(httpsCtx->ssl, httpsCtx->key);
+	return 0;
+}
 
-		error = SSL_CTX_check_private_key(httpsCtx->sslCtx);
+IOTC_PRIVATE void httpsHandshakeDone(struct httpsCtx *httpsCtx) {
 #ifdef DEBUG
-		if(error != 1)
-			printf("Private Key not verified\n");
+	if(SSL_session_reused(httpsCtx->ssl))
+		printf("SSL session resumed\n");
+	printf("SSL protocol %s\n", SSL_get_version(httpsCtx->ssl));
 #endif
+}
+
+#ifdef HTTPS_EARLY_DATA
+// only idempotent requests can be sent before handshake: server may receive them twice
+IOTC_PRIVATE bool httpsEarlyDataAllowed(struct httpsCtx *httpsCtx) {
+	SSL_SESSION *session = SSL_get_session(httpsCtx->ssl);
+	return httpsCtx->postMsg == NULL && session != NULL &&
+			SSL_SESSION_get_max_early_data(session) >= (uint32_t)httpsCtx->requestLen;
+}
+#endif
+
+// socket condition SSL is waiting for after a failed call, 0 if it is a real error
+IOTC_PRIVATE GIOCondition httpsWantCondition(SSL *ssl, int ret) {
+	switch(SSL_get_error(ssl, ret)) {
+		case SSL_ERROR_WANT_READ:
+			return G_IO_IN;
+		case SSL_ERROR_WANT_WRITE:
+			return G_IO_OUT;
 	}
+	return 0;
+}
 
-	// SSL connection
-	httpsCtx->ssl = SSL_new(httpsCtx->sslCtx);
-	if(httpsCtx->ssl == NULL) {
+/*
+ * Blocking requests can reuse a pooled connection left non blocking by an async request:
+ * wait for the socket condition SSL asked. Returns false on timeout or error.
+ */
+IOTC_PRIVATE bool httpsWaitSocket(int sock, GIOCondition condition) {
+	struct pollfd pfd;
+	int ret;
+	if(condition == 0)
+		return false;
+	pfd.fd = sock;
+	pfd.events = condition == G_IO_OUT ? POLLOUT : POLLIN;
+	pfd.revents = 0;
+	do {
+		ret = poll(&pfd, 1, HTTPS_TIMEOUT * 1000);
+	} while(ret == -1 && errno == EINTR);
 #ifdef DEBUG
-		printf("Cannot intialize ssl\n");
+	if(ret == 0)
+		printf("SSL socket timeout\n");
 #endif
+	return ret > 0;
+}
+
+// PRIVATE
+IOTC_PRIVATE int httpsHandshake(struct httpsCtx *httpsCtx) {
+	int error;
+
+	if(httpsSslStart(httpsCtx) < 0)
 		return -1;
-	}
-	SSL_set_fd(httpsCtx->ssl, httpsCtx->sock);
 
 	while(true) {
 		// repeat connect when SOCKET is non blocking and error is WANT_READ or WANT_WRITE
 		error = SSL_connect(httpsCtx->ssl);
-		if(error == -1) {
-			int problem = SSL_get_error(httpsCtx->ssl, error);
-			switch(problem) {
-				case SSL_ERROR_WANT_READ:
-				case SSL_ERROR_WANT_WRITE:
-					continue;
-				break;
-			}
+		if(error <= 0) {
+			if(httpsWaitSocket(httpsCtx->sock, httpsWantCondition(httpsCtx->ssl, error)))
+				continue;
 #ifdef DEBUG
 			printf("SSL connect failed\n");
 #endif
+			// do not try to resume a session refused by server
+			sslSessionStore(httpsCtx->key, NULL);
 			return -1;
 		} else {
 			break;
 		}
 	}
-
-/*	if((error = SSL_get_verify_result(httpsCtx->ssl)) != X509_V_OK) {
-#ifdef DEBUG
-		printf("SSL cert verify failed [ %d ]\n", error);
-#endif
-		if(error != X509_V_ERR_CERT_NOT_YET_VALID)
-			return -1;
-	}
-*/
+	httpsHandshakeDone(httpsCtx);
+	return 0;
+}
 
 #ifdef DEBUG
-	// print certificate informations
+// print certificate informations
+IOTC_PRIVATE int httpsPrintCert(SSL *ssl) {
 	X509 *serverCert;
 	char *crtStr;
-	printf("SSL connection using %s\n", SSL_get_cipher(httpsCtx->ssl));
-	serverCert = SSL_get_peer_certificate(httpsCtx->ssl);
+	printf("SSL connection using %s\n", SSL_get_cipher(ssl));
+	serverCert = SSL_get_peer_certificate(ssl);
 	if(serverCert == NULL) {
 		printf("Cannot get server cert\n");
 		return -1;
@@ -349,112 +868,143 @@ IOTC_PRIVATE int httpsPrepareSend(struct httpsCtx *httpsCtx) {
 		OPENSSL_free(crtStr);
 	}
 	X509_free(serverCert);
+	return 0;
+}
 #endif
 
+IOTC_PRIVATE void httpsBuildRequest(struct httpsCtx *httpsCtx) {
+	g_free(httpsCtx->request);
 	if(httpsCtx->postMsg == NULL) // Http GET
-		snprintf(requestString, sizeof(requestString), "GET %s HTTP/1.1\nUser-Agent: IoTl/%s\nAccept: */*\nHost: %s\nConnection: Close\nContent-Length: 0\n\n", httpsCtx->path, VERSION, httpsCtx->host);
+		httpsCtx->request = g_strdup_printf("GET %s HTTP/1.1\nUser-Agent: IoTl/%s\nAccept: */*\nHost: %s\nConnection: keep-alive\nContent-Length: 0\n\n", httpsCtx->path, VERSION, httpsCtx->host);
 	else // Http POST
-		snprintf(requestString, sizeof(requestString), "POST %s HTTP/1.1\nUser-Agent: IoTl/%s\nAccept: */*\nHost: %s\nConnection: Close\nContent-Type: application/x-www-form-urlencoded\nContent-Length: %ld\n\n%s", httpsCtx->path, VERSION, httpsCtx->host, strlen(httpsCtx->postMsg), httpsCtx->postMsg);
-	error = SSL_write(httpsCtx->ssl, requestString, strlen(requestString));
-	if(error == -1) {
-#ifdef DEBUG
-		printf("Cannot write to SSL socket\n");
-#endif
-		return -1;
-	}
-
-	return 0;
+		httpsCtx->request = g_strdup_printf("POST %s HTTP/1.1\nUser-Agent: IoTl/%s\nAccept: */*\nHost: %s\nConnection: keep-alive\nContent-Type: application/x-www-form-urlencoded\nContent-Length: %ld\n\n%s", httpsCtx->path, VERSION, httpsCtx->host, (long)strlen(httpsCtx->postMsg), httpsCtx->postMsg);
+	httpsCtx->requestLen = strlen(httpsCtx->request);
 }
 
 // PRIVATE
-IOTC_PRIVATE int httpsReceive(struct httpsCtx *httpsCtx, char **response) {
-	int error, offset;
-	(*response) = (char *)malloc(sizeof(char)*HTTP_MAX_RESP);
-	offset = 0;
-	error = 1;
-	while(error > 0) {
-		error = SSL_read(httpsCtx->ssl, (*response)+offset, HTTP_MAX_RESP - (offset+1));
-		switch(SSL_get_error(httpsCtx->ssl, error)) {
-			case SSL_ERROR_NONE:
-				offset += error;
-				(*response)[offset] = '\0';
-			break;
-			case SSL_ERROR_WANT_READ:
-				error = 1;
-			break;
+IOTC_PRIVATE int httpsWriteRequest(struct httpsCtx *httpsCtx) {
+	int error;
+
+/*	if((error = SSL_get_verify_result(httpsCtx->ssl)) != X509_V_OK) {
 #ifdef DEBUG
-			default:
-				if(error == 0)
-					printf("SSL no more data to read\n");
-				else
-					printf("SSL read error\n");
-			break;
+		printf("SSL cert verify failed [ %d ]\n", error);
 #endif
-		}
+		if(error != X509_V_ERR_CERT_NOT_YET_VALID)
+			return -1;
 	}
-#ifdef DEBUG
-	if(offset > 0)
-		printf("Received %d bytes:\n%s\n", offset, *response);
-#endif
+*/
 
-	// read HTTP status code
-	if(offset > 11 && strstr(*response, "HTTP/1.1") == (*response) && strlen(*response) > 11) {
 #ifdef DEBUG
-		printf("HTTP status code: %d\n", atoi((*response)+9));
+	if(httpsPrintCert(httpsCtx->ssl) < 0)
+		return -1;
 #endif
-		return atoi((*response)+9);
-	} 
+
+	httpsBuildRequest(httpsCtx);
+	// after WANT_READ or WANT_WRITE the same buffer must be written again
+	do {
+		error = SSL_write(httpsCtx->ssl, httpsCtx->request, httpsCtx->requestLen);
+	} while(error <= 0 && httpsWaitSocket(httpsCtx->sock, httpsWantCondition(httpsCtx->ssl, error)));
+	if(error <= 0) {
 #ifdef DEBUG
-	printf("Cannot read HTTP status code\n");
+		printf("Cannot write to SSL socket\n");
 #endif
-	return -1;
+		return -1;
+	}
+
+	return 0;
 }
 
 // PRIVATE
-IOTC_PRIVATE int httpsConnectSocket(struct httpsCtx *httpsCtx, char *host, unsigned short port) {
-	int error;
-	struct addrinfo hints, *dnsResults, *dnsResult;
+IOTC_PRIVATE int httpsPrepareSend(struct httpsCtx *httpsCtx) {
+	if(httpsHandshake(httpsCtx) < 0)
+		return -1;
+	return httpsWriteRequest(httpsCtx);
+}
 
-	// set connection hints
-	memset(&hints, 0, sizeof(struct addrinfo));
-	hints.ai_family = AF_UNSPEC; // Allow IPv4 or IPv6
-	hints.ai_socktype = SOCK_STREAM; // TCP
-	hints.ai_flags = 0;
-	hints.ai_protocol = 0;
+// prepare httpsCtx to read a new response
+IOTC_PRIVATE bool httpsResponseStart(struct httpsCtx *httpsCtx) {
+	httpParserFree(httpsCtx->parser);
+	httpsCtx->parser = httpParserNew(NULL, NULL);
+	httpsCtx->offset = 0;
+	return httpsCtx->parser != NULL;
+}
 
-	// Resolve host name
-	error = getaddrinfo(host, NULL, &hints, &dnsResults);
-	if(error != 0) {
+/*
+ * Read the data available and pass it to parser. Returns the socket condition to wait for,
+ * or 0 when response is complete or connection is closed.
+ */
+IOTC_PRIVATE GIOCondition httpsReadStep(struct httpsCtx *httpsCtx) {
+	char buf[HTTP_READ_CHUNK];
+	int error, used;
+	GIOCondition wait;
+	while(true) {
+		error = SSL_read(httpsCtx->ssl, buf, sizeof(buf));
+		if(error > 0) {
+			httpsCtx->offset += error;
+			used = httpParserFeed(httpsCtx->parser, buf, error);
+			if(used < 0) {
+				httpsCtx->keepAlive = false;
+				return 0;
+			}
+			// a kept alive connection is not closed by server: stop at the end of response
+			if(httpParserComplete(httpsCtx->parser)) {
+				httpsCtx->keepAlive = httpParserKeepAlive(httpsCtx->parser) && used == error;
+				return 0;
+			}
+			continue;
+		}
+		if((wait = httpsWantCondition(httpsCtx->ssl, error)) != 0)
+			return wait;
+		httpsCtx->keepAlive = false;
+		// some responses end when server closes connection
+		if(error == 0)
+			httpParserEnd(httpsCtx->parser);
 #ifdef DEBUG
-		printf("Cannot resolve host name\n");
+		if(error == 0)
+			printf("SSL no more data to read\n");
+		else
+			printf("SSL read error\n");
 #endif
-		return -1;
+		return 0;
 	}
+}
 
-	// try to connect to one of the results gave by dns
-	for(dnsResult = dnsResults; dnsResult != NULL; dnsResult = dnsResult->ai_next) {
-		httpsCtx->sock = socket(dnsResult->ai_family, dnsResult->ai_socktype, dnsResult->ai_protocol);
-		if(httpsCtx->sock == -1)
-			continue;
-		if(dnsResult->ai_family == PF_INET) {
-			((struct sockaddr_in *)dnsResult->ai_addr)->sin_port = htons(port);
-		} else if(dnsResult->ai_family == PF_INET6) {
-			((struct sockaddr_in6 *)dnsResult->ai_addr)->sin6_port = htons(port);
-		} else {
-			continue;
-		}
-		if(connect(httpsCtx->sock, dnsResult->ai_addr, dnsResult->ai_addrlen) != -1)
-			break;
-		close(httpsCtx->sock);
-	}
-	if(dnsResult == NULL) {
+// give response to caller, returns the status code or -1 if response is not complete
+IOTC_PRIVATE int httpsTakeResponse(struct httpsCtx *httpsCtx, char **response) {
+	int code = -1;
+	(*response) = NULL;
+	if(httpsCtx->parser == NULL)
+		return -1;
+	(*response) = httpParserTakeResponse(httpsCtx->parser, NULL);
 #ifdef DEBUG
-		printf("Cannot establish socket connection\n");
+	if(*response != NULL)
+		printf("Received %d bytes:\n%s\n", httpsCtx->offset, *response);
 #endif
-		freeaddrinfo(dnsResults);
+	if(httpParserComplete(httpsCtx->parser))
+		code = httpParserStatus(httpsCtx->parser);
+#ifdef DEBUG
+	if(code > 0)
+		printf("HTTP status code: %d\n", code);
+	else
+		printf("Cannot read HTTP status code\n");
+#endif
+	return code;
+}
+
+// PRIVATE
+IOTC_PRIVATE int httpsReceive(struct httpsCtx *httpsCtx, char **response) {
+	if(!httpsResponseStart(httpsCtx)) {
+		(*response) = NULL;
 		return -1;
 	}
-	freeaddrinfo(dnsResults);
+	// a pooled socket can be non blocking: wait for the condition returned
+	while(httpsWaitSocket(httpsCtx->sock, httpsReadStep(httpsCtx)));
+	return httpsTakeResponse(httpsCtx, response);
+}
+
+// PRIVATE
+IOTC_PRIVATE int httpsConnectSocket(struct httpsCtx *httpsCtx, char *host, unsigned short port) {
+	httpsCtx->sock = dnsConnect(host, port);
 	return httpsCtx->sock;
 }
 
@@ -466,6 +1016,17 @@ IOTC_PRIVATE int httpsSend(char *host, unsigned short port, char *path, char **r
 
 	struct httpsCtx *httpsCtx = httpsCtxNew(host, port, path, CAFile, CAPath, crtFile, keyFile, postMsg,
 			NULL, NULL);
+	if(httpsPoolTake(httpsCtx)) {
+		if(httpsWriteRequest(httpsCtx) == 0 && (code = httpsReceive(httpsCtx, response)) > 0) {
+			httpsPoolPut(httpsCtx);
+			httpsCtxFree(httpsCtx);
+			return code;
+		}
+		// server closed the idle connection in the meantime: use a new one
+		free(*response);
+		(*response) = NULL;
+		httpsCtxClose(httpsCtx);
+	}
 	error = httpsConnectSocket(httpsCtx, host, port);
 	if(error < 0) {
 #ifdef DEBUG
@@ -484,6 +1045,7 @@ IOTC_PRIVATE int httpsSend(char *host, unsigned short port, char *path, char **r
 	}
 	code = httpsReceive(httpsCtx, response);
 
+	httpsPoolPut(httpsCtx);
 	httpsCtxFree(httpsCtx);
 	return code;
 }
@@ -498,43 +1060,233 @@ int httpsPost(char *host, unsigned short port, char *path, char **response,
 	return httpsSend(host, port, path, response, CAFile, CAPath, crtFile, keyFile, postMsg);
 }
 
-IOTC_PRIVATE gboolean httpsRecvCb(GObject *sourceObject, GAsyncResult *res, gpointer userData) {
+IOTC_PRIVATE void httpsSocketConnectCb(GObject *sourceObject, GAsyncResult *res, gpointer userData);
+IOTC_PRIVATE void httpsResolvedCb(GList *addresses, void *userData);
+IOTC_PRIVATE void httpsAsyncStep(struct httpsCtx *httpsCtx);
+
+IOTC_PRIVATE void httpsConnectAsync(struct httpsCtx *httpsCtx) {
+	if(httpsCtx->gSocketClient == NULL)
+		httpsCtx->gSocketClient = g_socket_client_new();
+	if(httpsCtx->cancellable == NULL)
+		httpsCtx->cancellable = g_cancellable_new();
+	httpsCtx->state = HTTPS_CONNECTING;
+	dnsLookupAsync(httpsCtx->host, httpsCtx->cancellable, httpsResolvedCb, httpsCtx);
+}
+
+IOTC_PRIVATE void httpsConnectAddress(struct httpsCtx *httpsCtx) {
+	GSocketAddress *sockAddr = g_inet_socket_address_new(G_INET_ADDRESS(httpsCtx->address->data),
+			httpsCtx->port);
+	g_socket_client_connect_async(httpsCtx->gSocketClient, G_SOCKET_CONNECTABLE(sockAddr),
+			httpsCtx->cancellable, httpsSocketConnectCb, httpsCtx);
+	g_object_unref(sockAddr);
+}
+
+IOTC_PRIVATE gboolean httpsReadyCb(GIOChannel *source, GIOCondition condition, gpointer userData) {
 	struct httpsCtx *httpsCtx = (struct httpsCtx *)userData;
-	int code;
-	char *response;
+	httpsCtx->watch = 0;
+	httpsAsyncStep(httpsCtx);
+	return G_SOURCE_REMOVE;
+}
 
-	code = httpsReceive(httpsCtx, &response);
+// resume request when socket is ready for condition
+IOTC_PRIVATE void httpsAsyncWait(struct httpsCtx *httpsCtx, GIOCondition condition) {
+	GIOChannel* channel = g_io_channel_unix_new(httpsCtx->sock);
+	httpsCtx->watch = g_io_add_watch(channel, condition | G_IO_HUP | G_IO_ERR, httpsReadyCb, httpsCtx);
+	g_io_channel_unref(channel);
+}
 
+// requests failed before the end of response get -1 as status code
+IOTC_PRIVATE void httpsAsyncEnd(struct httpsCtx *httpsCtx) {
+	char *response;
+	int code = httpsTakeResponse(httpsCtx, &response);
 	if(httpsCtx->callback != NULL)
 		httpsCtx->callback(code, response, httpsCtx->userData);
-
 	if(response != NULL)
 		free(response);
-
+	httpsPoolPut(httpsCtx);
 	httpsCtxFree(httpsCtx);
+}
+
+// server closed the idle connection in the meantime: use a new one
+IOTC_PRIVATE void httpsAsyncRetry(struct httpsCtx *httpsCtx) {
+#ifdef DEBUG
+	printf("[DEBUG] Pooled connection to %s closed, reconnecting\n", httpsCtx->key);
+#endif
+	httpsCtxClose(httpsCtx);
+	httpsCtx->offset = 0;
+	httpsConnectAsync(httpsCtx);
+}
+
+// go on with request until socket would block, never waits on main loop
+IOTC_PRIVATE void httpsAsyncStep(struct httpsCtx *httpsCtx) {
+	int error;
+	GIOCondition wait;
+	while(true) {
+		switch(httpsCtx->state) {
+#ifdef HTTPS_EARLY_DATA
+			case HTTPS_SEND_EARLY: {
+				size_t written;
+				// after WANT_READ or WANT_WRITE the same buffer must be written again
+				error = SSL_write_early_data(httpsCtx->ssl, httpsCtx->request, httpsCtx->requestLen,
+						&written);
+				if(error == 1) {
+					httpsCtx->earlyData = true;
+					httpsCtx->state = HTTPS_HANDSHAKE;
+					break;
+				}
+				if((wait = httpsWantCondition(httpsCtx->ssl, error)) != 0) {
+					httpsAsyncWait(httpsCtx, wait);
+					return;
+				}
+#ifdef DEBUG
+				printf("SSL early data failed\n");
+#endif
+				sslSessionStore(httpsCtx->key, NULL);
+				httpsAsyncEnd(httpsCtx);
+				return;
+			}
+#endif
+			case HTTPS_HANDSHAKE:
+				error = SSL_connect(httpsCtx->ssl);
+				if(error == 1) {
+					httpsHandshakeDone(httpsCtx);
+#ifdef DEBUG
+					httpsPrintCert(httpsCtx->ssl);
+#endif
+					httpsCtx->state = HTTPS_WRITE;
+#ifdef HTTPS_EARLY_DATA
+					// request rejected by server must be sent again
+					if(httpsCtx->earlyData &&
+							SSL_get_early_data_status(httpsCtx->ssl) == SSL_EARLY_DATA_ACCEPTED) {
+#ifdef DEBUG
+						printf("SSL early data accepted\n");
+#endif
+						if(!httpsResponseStart(httpsCtx)) {
+							httpsAsyncEnd(httpsCtx);
+							return;
+						}
+						httpsCtx->state = HTTPS_READ;
+					}
+#endif
+					break;
+				}
+				if((wait = httpsWantCondition(httpsCtx->ssl, error)) != 0) {
+					httpsAsyncWait(httpsCtx, wait);
+					return;
+				}
+#ifdef DEBUG
+				printf("SSL connect failed\n");
+#endif
+				// do not try to resume a session refused by server
+				sslSessionStore(httpsCtx->key, NULL);
+				httpsAsyncEnd(httpsCtx);
+				return;
+			case HTTPS_WRITE:
+				// after WANT_READ or WANT_WRITE the same buffer must be written again
+				error = SSL_write(httpsCtx->ssl, httpsCtx->request, httpsCtx->requestLen);
+				if(error > 0) {
+					if(!httpsResponseStart(httpsCtx)) {
+						httpsAsyncEnd(httpsCtx);
+						return;
+					}
+					httpsCtx->state = HTTPS_READ;
+					break;
+				}
+				if((wait = httpsWantCondition(httpsCtx->ssl, error)) != 0) {
+					httpsAsyncWait(httpsCtx, wait);
+					return;
+				}
+				if(httpsCtx->pooled) {
+					httpsAsyncRetry(httpsCtx);
+					return;
+				}
+#ifdef DEBUG
+				printf("Cannot write to SSL socket\n");
+#endif
+				httpsAsyncEnd(httpsCtx);
+				return;
+			case HTTPS_READ:
+				if((wait = httpsReadStep(httpsCtx)) != 0) {
+					httpsAsyncWait(httpsCtx, wait);
+					return;
+				}
+				if(httpsCtx->offset == 0 && httpsCtx->pooled) {
+					httpsAsyncRetry(httpsCtx);
+					return;
+				}
+				httpsAsyncEnd(httpsCtx);
+				return;
+			default:
+				return;
+		}
+	}
+}
+
+IOTC_PRIVATE gboolean httpsTimeoutCb(gpointer userData) {
+	struct httpsCtx *httpsCtx = (struct httpsCtx *)userData;
+	httpsCtx->timeout = 0;
+#ifdef DEBUG
+	printf("[DEBUG] Request to %s timed out\n", httpsCtx->key);
+#endif
+	// a partially read connection cannot be reused
+	httpsCtx->keepAlive = false;
+	if(httpsCtx->state == HTTPS_CONNECTING) {
+		// resolve or connect callback is invoked anyway with an error and ends the request
+		g_cancellable_cancel(httpsCtx->cancellable);
+		return G_SOURCE_REMOVE;
+	}
+	httpsAsyncEnd(httpsCtx);
 	return G_SOURCE_REMOVE;
 }
 
+IOTC_PRIVATE void httpsResolvedCb(GList *addresses, void *userData) {
+	struct httpsCtx *httpsCtx = (struct httpsCtx *)userData;
+	if(addresses == NULL) {
+#ifdef DEBUG
+		printf("[DEBUG] Cannot resolve host name\n");
+#endif
+		httpsAsyncEnd(httpsCtx);
+		return;
+	}
+	if(httpsCtx->addresses != NULL)
+		g_resolver_free_addresses(httpsCtx->addresses);
+	httpsCtx->addresses = g_list_copy_deep(addresses, (GCopyFunc)g_object_ref, NULL);
+	httpsCtx->address = httpsCtx->addresses;
+	httpsConnectAddress(httpsCtx);
+}
+
 IOTC_PRIVATE void httpsSocketConnectCb(GObject *sourceObject, GAsyncResult *res, gpointer userData) {
-	int error;
 	struct httpsCtx *httpsCtx = (struct httpsCtx *)userData;
-	httpsCtx->gSocketConnection = g_socket_client_connect_to_host_finish(httpsCtx->gSocketClient,
-			res, NULL);
+	httpsCtx->gSocketConnection = g_socket_client_connect_finish(httpsCtx->gSocketClient, res, NULL);
+	if(httpsCtx->gSocketConnection == NULL) {
+		// try next address of host, unless request timed out
+		if(!g_cancellable_is_cancelled(httpsCtx->cancellable) && httpsCtx->address->next != NULL) {
+			httpsCtx->address = httpsCtx->address->next;
+			httpsConnectAddress(httpsCtx);
+			return;
+		}
+#ifdef DEBUG
+		printf("[DEBUG] Cannot connect Socket\n");
+#endif
+		httpsAsyncEnd(httpsCtx);
+		return;
+	}
+	// GSocket is non blocking: handshake goes on when socket is ready
 	GSocket *gsocket = g_socket_connection_get_socket(httpsCtx->gSocketConnection);
 	httpsCtx->sock = g_socket_get_fd(gsocket);
-	error = httpsPrepareSend(httpsCtx);
-	if(error < 0) {
+	if(httpsSslStart(httpsCtx) < 0) {
 #ifdef DEBUG
 		printf("[DEBUG] Cannot prepare Https Send\n");
 #endif
-		httpsCtx->callback(-1, NULL, httpsCtx->userData);
-		httpsCtxFree(httpsCtx);
+		httpsAsyncEnd(httpsCtx);
 		return;
 	}
-
-	GIOChannel* channel = g_io_channel_unix_new(httpsCtx->sock);
-	g_io_add_watch(channel, G_IO_IN, (GIOFunc)httpsRecvCb, httpsCtx);
-	g_io_channel_unref(channel);
+	httpsCtx->state = HTTPS_HANDSHAKE;
+#ifdef HTTPS_EARLY_DATA
+	if(httpsEarlyDataAllowed(httpsCtx))
+		httpsCtx->state = HTTPS_SEND_EARLY;
+#endif
+	httpsAsyncStep(httpsCtx);
 }
 
 IOTC_PRIVATE int httpsSendAsync(char *host, unsigned short port, char *path,
@@ -542,9 +1294,17 @@ IOTC_PRIVATE int httpsSendAsync(char *host, unsigned short port, char *path,
 		void (*onResponse)(int, char *, void *), void *userData) {
 	struct httpsCtx *httpsCtx = httpsCtxNew(host, port, path, CAFile, CAPath, crtFile, keyFile, postMsg,
 			onResponse, userData);
-	httpsCtx->gSocketClient = g_socket_client_new();
-	g_socket_client_connect_to_host_async(httpsCtx->gSocketClient, host, port, NULL,
-			httpsSocketConnectCb, httpsCtx);
+	httpsBuildRequest(httpsCtx);
+	httpsCtx->timeout = g_timeout_add_seconds(HTTPS_TIMEOUT, httpsTimeoutCb, httpsCtx);
+	if(httpsPoolTake(httpsCtx)) {
+		// connection can come from a blocking request: never block the main loop on it
+		fcntl(httpsCtx->sock, F_SETFL, fcntl(httpsCtx->sock, F_GETFL) | O_NONBLOCK);
+		// write on next main loop iteration: onResponse is never invoked before returning
+		httpsCtx->state = HTTPS_WRITE;
+		httpsAsyncWait(httpsCtx, G_IO_OUT);
+		return 0;
+	}
+	httpsConnectAsync(httpsCtx);
 	return 0;
 }
 
@@ -560,6 +1320,26 @@ int httpsPostAsync(char *host, unsigned short port, char *path,
 	return httpsSendAsync(host, port, path, CAFile, CAPath, crtFile, keyFile, postMsg, onResponse, userData);
 }
 
+void httpsClearCache() {
+	pthread_mutex_lock(&sslCtxCacheLock);
+	while(sslCtxCache != NULL) {
+		struct sslCtxCacheEntry *entry = sslCtxCache;
+		sslCtxCache = entry->next;
+		sslCtxCacheEntryFree(entry);
+	}
+	while(sslSessionCache != NULL) {
+		struct sslSessionCacheEntry *entry = sslSessionCache;
+		sslSessionCache = entry->next;
+		sslSessionCacheEntryFree(entry);
+	}
+	while(httpsPool != NULL) {
+		struct httpsPoolEntry *entry = httpsPool;
+		httpsPool = entry->next;
+		httpsPoolEntryFree(entry);
+	}
+	pthread_mutex_unlock(&sslCtxCacheLock);
+}
+
 char *pemToUrl(char *pem) {
 	int i;
 	char *out;
@@ -635,6 +1415,10 @@ int httpsPostAsync(char *host, unsigned short port, char *path,
 		char *CAFile, char *CAPath, char *crtFile, char *keyFile, char *postMsg,
 		void (*onResponse)(int, char *, void *), void *userData) { return -1; }
 
+void httpsClearCache() {}
+
+const char *tlsCipherList() { return NULL; }
+
 char *pemToUrl(char *pem) { return NULL; }
 #endif
 //#endif  // IOTC_CLIENT
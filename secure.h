@@ -27,6 +27,9 @@
 #include <string.h>
 
 #define HTTP_MAX_RESP 8192
+#define HTTPS_POOL_MAX_PER_HOST 2 // idle connections kept for each server and client cert
+#define HTTPS_POOL_IDLE_TIMEOUT 30 // seconds an idle connection is kept
+#define HTTPS_TIMEOUT 20 // seconds an async request can last before failing
 
 /**
  * @brief Generate csr
@@ -136,8 +139,8 @@ int httpsGet(char *host, unsigned short port, char *path, char **response,
  * @param crtFile The full path of my certificate used by server to verify my identity
  * @param keyFile The full path of my private key used to crypt my messages
  * @param onResponse The callback invoked when data is ready if the function returns 0. Params are:
- *	- code The HTTP status code
- *	- response The string containing http response
+ *	- code The HTTP status code, -1 if request failed or lasted more than HTTPS_TIMEOUT seconds
+ *	- response The string containing http response (header section and decoded body)
  *	- userData the user data provided as parameter in this funtion
  * @param userData A pointer to data passed back to callbacks
  * @return A negative error code or 0 if ok
@@ -183,8 +186,8 @@ int httpsPost(char *host, unsigned short port, char *path, char **response,
  * @param keyFile The full path of my private key used to crypt my messages
  * @param postMsg The message to send into POST, must be URL Encoded
  * @param onResponse The callback invoked when data is ready if the function returns 0. Params are:
- *	- code The HTTP status code
- *	- response The string containing http response
+ *	- code The HTTP status code, -1 if request failed or lasted more than HTTPS_TIMEOUT seconds
+ *	- response The string containing http response (header section and decoded body)
  *	- userData the user data provided as parameter in this funtion
  * @param userData A pointer to data passed back to callbacks
  * @return A negative error code or 0 if ok
@@ -193,6 +196,26 @@ int httpsPostAsync(char *host, unsigned short port, char *path,
 		char *CAFile, char *CAPath, char *crtFile, char *keyFile, char *postMsg,
 		void (*onResponse)(int, char *, void *), void *userData);
 
+/**
+ * @brief Drop SSL contexts, sessions and idle connections kept for https requests
+ *
+ * Contexts are reused by all requests with the same CA, cert and key files and rebuilt when
+ * a file modification time changes. The session of last connection to each server is resumed
+ * by next connection. Connections are kept alive after the response and reused by next requests
+ * to the same server for HTTPS_POOL_IDLE_TIMEOUT seconds. Invoke this after replacing files to be sure next requests
+ * load them, even if written within the same second.
+ */
+void httpsClearCache();
+
+/**
+ * @brief Get the TLS 1.2 cipher list preferred on this CPU
+ *
+ * Only ECDHE key exchanges with AEAD ciphers are listed: AES-GCM first when the CPU has AES
+ * instructions, ChaCha20-Poly1305 first otherwise. TLS_CIPHERS option replaces the list.
+ * @return The cipher list in OpenSSL format, must not be freed
+ */
+const char *tlsCipherList();
+
 /**
  * @brief URL Encode a PEM
  *
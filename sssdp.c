@@ -35,9 +35,17 @@ struct deviceInfo {
 	char *deviceURL;
 	char *serialNumber;
 	char *uuid;
+	GSSDPClient *client;
+	GSocketService *service;
+	guint updateSource;
+	bool stopped;			// server stopped while a description request was pending
+	struct deviceInfo *next;
 };
 typedef struct deviceInfo DeviceInfo;
 
+// servers started in this process, a process can host more devices
+IOTC_PRIVATE DeviceInfo *servers = NULL;
+
 struct discoveryCtx {
 	GSSDPClient *client;
 	GSSDPResourceBrowser *resourceBrowser;
@@ -86,7 +94,13 @@ IOTC_PRIVATE gboolean sssdpRecvCb(GObject *sourceObject, GAsyncResult *res, gpoi
 			device->serialNumber, device->uuid, device->ip);
 	send(sock, description, strlen(description), 0);
 	g_object_unref(device->connection);
+	device->connection = NULL;
 	free(description);
+	if(device->stopped) {
+		free(device->ip);
+		free(device->uuid);
+		free(device);
+	}
 	return false;
 }
 
@@ -145,7 +159,7 @@ IOTC_PRIVATE gboolean updateSSDPResourcesTimeoutCb(gpointer userData) {
 		if(newIP != NULL)
 			free(newIP);
 	}
-	g_timeout_add_seconds(60, &updateSSDPResourcesTimeoutCb, userData);
+	device->updateSource = g_timeout_add_seconds(60, &updateSSDPResourcesTimeoutCb, userData);
 	return G_SOURCE_REMOVE;
 }
 
@@ -171,8 +185,10 @@ bool startSSDPServer(GMainLoop *gloop, char *urnDeviceType, char * schema, char
 #endif
 		return false;
 	}
+	device->connection = NULL;
 	device->resourceRootDevice = 0;
 	device->resourceDevice = 0;
+	device->stopped = false;
 	device->ip = ip != NULL ? ip : "";
 	device->urnDeviceType = urnDeviceType != NULL ? urnDeviceType : "";
 	device->schema = schema != NULL ? schema : "";
@@ -183,7 +199,8 @@ bool startSSDPServer(GMainLoop *gloop, char *urnDeviceType, char * schema, char
 	device->modelNumber = modelNumber != NULL ? modelNumber : "";
 	device->deviceURL = deviceURL != NULL ? deviceURL : "";
 	device->serialNumber = serialNumber != NULL ? serialNumber : "";
-	device->uuid = uuid != NULL ? uuid : "";
+	// uuid is kept because the device owning it can be removed before a pending description request
+	device->uuid = strdup(uuid != NULL ? uuid : "");
 
 	client = gssdp_client_new(g_main_loop_get_context(gloop), &error);
 	if(error) {
@@ -191,6 +208,9 @@ bool startSSDPServer(GMainLoop *gloop, char *urnDeviceType, char * schema, char
 		printf("Error creating the SSDP server: %s\n", error->message);
 #endif
 		g_clear_error(&error);
+		free(ip);
+		free(device->uuid);
+		free(device);
 		return false;
 	}
 
@@ -220,7 +240,38 @@ bool startSSDPServer(GMainLoop *gloop, char *urnDeviceType, char * schema, char
 	g_signal_connect(service, "incoming", G_CALLBACK(sssdpListenCb), device);
 	g_socket_service_start(service);
 
-	g_timeout_add_seconds(60, &updateSSDPResourcesTimeoutCb, device);
+	device->client = client;
+	device->service = service;
+	device->updateSource = g_timeout_add_seconds(60, &updateSSDPResourcesTimeoutCb, device);
+	device->next = servers;
+	servers = device;
+	return true;
+}
+
+bool stopSSDPServer(const char *uuid) {
+	DeviceInfo **prev, *device;
+	for(prev=&servers; *prev!=NULL; prev=&((*prev)->next))
+		if(strcmp((*prev)->uuid, uuid) == 0)
+			break;
+	if(*prev == NULL)
+		return false;
+	device = *prev;
+	*prev = device->next;
+	if(device->updateSource > 0)
+		g_source_remove(device->updateSource);
+	g_socket_service_stop(device->service);
+	g_object_unref(device->service);
+	gssdp_resource_group_set_available(device->resourceGroup, FALSE);
+	g_object_unref(device->resourceGroup);
+	g_object_unref(device->client);
+	// a description request is being served, it frees device when done
+	if(device->connection != NULL) {
+		device->stopped = true;
+		return true;
+	}
+	free(device->ip);
+	free(device->uuid);
+	free(device);
 	return true;
 }
 
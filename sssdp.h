@@ -54,6 +54,14 @@ bool startSSDPServer(GMainLoop *gloop, char *urnDeviceType, char *schema, char *
 		char *vendorURL, char *deviceModel, char *modelNumber, char *deviceURL, char *serialNumber,
 		char *uuid);
 
+/**
+ * @brief Stop a SSDP server started using startSSDPServer()
+ *
+ * @param uuid The uuid passed to startSSDPServer()
+ * @return A boolean value: true if the server has been stopped, false if no server has this uuid
+ */
+bool stopSSDPServer(const char *uuid);
+
 /**
  * @brief Start SSDP discovery (used by client)
  *
@@ -13,8 +13,11 @@
 
 #include "web.h"
 #include "secure.h"
+#include "http.h"
+#include "dns.h"
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <glib/glib.h>
 #include <gio/gio.h>
 
@@ -26,6 +29,9 @@ struct httpCtx {
 	unsigned short port;
 	char *path;
 	char *postMsg;
+	GList *addresses;	// addresses of host resolved by dns
+	GList *address;		// address being connected
+	HttpParser *parser;
 	void (*callback)(int, char *, void*);
 	void *userData;
 };
@@ -99,6 +105,7 @@ IOTC_PRIVATE struct iotcServerList *parseList(char *response) {
 		server->ip = ip;
 		server->username = user;
 		server->password = pass;
+		server->rtt = 0;
 		server->next = NULL;
 
 		if(list == NULL) {
@@ -193,6 +200,42 @@ bool webDeviceRegister(char *ip, char *CAFile, char *CAPath, char *crtFile, char
 	return code == 200;
 }
 
+IOTC_PRIVATE void webOnDeviceRegisterHttpsResponse(int code, char *response, void *userData) {
+	struct webCtx *webCtx = (struct webCtx *)userData;
+#ifdef DEBUG
+	if(code != 200) {
+		if(code > 0)
+			printf("webDeviceRegister ERROR\n%s\n", response);
+		else
+			printf("webDeviceRegister ERROR\n");
+	}
+#endif
+	if(webCtx->callback != NULL)
+		((void (*)(bool, void *))webCtx->callback)(code == 200, webCtx->userData);
+	free(webCtx);
+}
+
+int webDeviceRegisterAsync(char *ip, char *CAFile, char *CAPath, char *crtFile, char *keyFile,
+		void (*onFinish)(bool, void *), void *userData) {
+	struct webCtx *webCtx = (struct webCtx *)malloc(sizeof(struct webCtx));
+	if(webCtx == NULL) {
+#ifdef DEBUG
+		printf("Malloc error: webCtx\n");
+#endif
+		return -1;
+	}
+	webCtx->callback = onFinish;
+	webCtx->userData = userData;
+	char *postMsg = g_strdup_printf("srv=%s", ip);
+	int ret = httpsPostAsync(IOTC_VHOST, IOTC_VHOST_PORT, "/deviceregister/",
+			CAFile, CAPath, crtFile, keyFile, postMsg,
+			webOnDeviceRegisterHttpsResponse, webCtx);
+	g_free(postMsg);
+	if(ret != 0)
+		free(webCtx);
+	return ret;
+}
+
 IOTC_PRIVATE void httpCtxFree(struct httpCtx *httpCtx) {
 	// close all connections
 	if(httpCtx->sock >= 0) {
@@ -213,6 +256,9 @@ IOTC_PRIVATE void httpCtxFree(struct httpCtx *httpCtx) {
 		free(httpCtx->path);
 	if(httpCtx->postMsg != NULL)
 		free(httpCtx->postMsg);
+	if(httpCtx->addresses != NULL)
+		g_resolver_free_addresses(httpCtx->addresses);
+	httpParserFree(httpCtx->parser);
 	free(httpCtx);
 }
 
@@ -226,6 +272,9 @@ IOTC_PRIVATE struct httpCtx *httpCtxNew(char *host, unsigned short port, char *p
 	httpCtx->port = port;
 	httpCtx->path = path != NULL ? strdup(path) : NULL;
 	httpCtx->postMsg = postMsg != NULL ? strdup(postMsg) : NULL;
+	httpCtx->addresses = NULL;
+	httpCtx->address = NULL;
+	httpCtx->parser = NULL;
 	httpCtx->callback = onResponse;
 	httpCtx->userData = userData;
 	return httpCtx;
@@ -248,41 +297,54 @@ IOTC_PRIVATE int httpPrepareSend(struct httpCtx *httpCtx) {
 	return 0;
 }
 
-IOTC_PRIVATE int httpReceive(struct httpCtx *httpCtx, char **response) {
-	int error, offset;
-	(*response) = (char *)malloc(sizeof(char)*HTTP_MAX_RESP);
-	offset = 0;
-	error = 1;
-	while(error > 0) {
-		error = recv(httpCtx->sock, (*response)+offset, HTTP_MAX_RESP - (offset+1), 0);
-		if(error == 0 || (error == -1 && errno != EAGAIN && errno != EWOULDBLOCK)) {
-			break;
-		} else if(error == -1) {
-			error = 1;
+// read the data available, returns false when response is complete or connection is closed
+IOTC_PRIVATE bool httpReadAvailable(int sock, HttpParser *parser) {
+	char buf[HTTP_READ_CHUNK];
+	int received;
+	while(true) {
+		received = recv(sock, buf, sizeof(buf), 0);
+		if(received > 0) {
+			if(httpParserFeed(parser, buf, received) < 0 || httpParserComplete(parser))
+				return false;
+		} else if(received == -1 && errno == EINTR) {
+			continue;
+		} else if(received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return true;
 		} else {
-			offset += error;
+			// some responses end when server closes connection
+			httpParserEnd(parser);
+			return false;
 		}
 	}
+}
+
+// give response to caller, returns the status code or -1 if response is not complete
+IOTC_PRIVATE int httpTakeResponse(HttpParser *parser, char **response) {
+	int len, code = -1;
+	(*response) = httpParserTakeResponse(parser, &len);
 #ifdef DEBUG
-	if(offset > 0)
-		printf("Received %d bytes:\n%s\n", offset, *response);
+	if(*response != NULL)
+		printf("Received %d bytes:\n%s\n", len, *response);
 #endif
-
-	if(strstr(*response, "HTTP/1.1") == (*response) && strlen(*response) > 11) {
+	if(httpParserComplete(parser))
+		code = httpParserStatus(parser);
 #ifdef DEBUG
-		printf("HTTP status code: %d\n", atoi((*response)+9));
+	if(code > 0)
+		printf("HTTP status code: %d\n", code);
 #endif
-		return atoi((*response)+9);
-	}
-	return -1;
+	return code;
 }
 
-IOTC_PRIVATE gboolean httpRecvCb(GObject *sourceObject, GAsyncResult *res, gpointer userData) {
+IOTC_PRIVATE gboolean httpRecvCb(GIOChannel *source, GIOCondition condition, gpointer userData) {
 	struct httpCtx *httpCtx = (struct httpCtx *)userData;
 	int code;
 	char *response;
 
-	code = httpReceive(httpCtx, &response);
+	// socket is non blocking: wait for next data
+	if(httpReadAvailable(httpCtx->sock, httpCtx->parser))
+		return G_SOURCE_CONTINUE;
+
+	code = httpTakeResponse(httpCtx->parser, &response);
 
 	if(httpCtx->callback != NULL)
 		httpCtx->callback(code, response, httpCtx->userData);
@@ -294,35 +356,78 @@ IOTC_PRIVATE gboolean httpRecvCb(GObject *sourceObject, GAsyncResult *res, gpoin
 	return G_SOURCE_REMOVE;
 }
 
+IOTC_PRIVATE void httpSocketConnectCb(GObject *sourceObject, GAsyncResult *res, gpointer userData);
+
+IOTC_PRIVATE void httpConnectAddress(struct httpCtx *httpCtx) {
+	GSocketAddress *sockAddr = g_inet_socket_address_new(G_INET_ADDRESS(httpCtx->address->data),
+			httpCtx->port);
+	g_socket_client_connect_async(httpCtx->gSocketClient, G_SOCKET_CONNECTABLE(sockAddr), NULL,
+			httpSocketConnectCb, httpCtx);
+	g_object_unref(sockAddr);
+}
+
 IOTC_PRIVATE void httpSocketConnectCb(GObject *sourceObject, GAsyncResult *res, gpointer userData) {
 	int error;
 	struct httpCtx *httpCtx = (struct httpCtx *)userData;
-	httpCtx->gSocketConnection = g_socket_client_connect_to_host_finish(httpCtx->gSocketClient,
-			res, NULL);
+	httpCtx->gSocketConnection = g_socket_client_connect_finish(httpCtx->gSocketClient, res, NULL);
+	if(httpCtx->gSocketConnection == NULL) {
+		// try next address of host (ex.: AAAA record on a network without ipv6)
+		if(httpCtx->address->next != NULL) {
+			httpCtx->address = httpCtx->address->next;
+			httpConnectAddress(httpCtx);
+			return;
+		}
+#ifdef DEBUG
+		printf("[DEBUG] Cannot connect Socket\n");
+#endif
+		if(httpCtx->callback != NULL)
+			httpCtx->callback(-1, NULL, httpCtx->userData);
+		httpCtxFree(httpCtx);
+		return;
+	}
 	GSocket *gsocket = g_socket_connection_get_socket(httpCtx->gSocketConnection);
 	httpCtx->sock = g_socket_get_fd(gsocket);
 
 	error = httpPrepareSend(httpCtx);
+	if(error == 0 && (httpCtx->parser = httpParserNew(NULL, NULL)) == NULL)
+		error = -1;
 	if(error != 0) {
 #ifdef DEBUG
 		printf("[DEBUG] Cannot prepare Http Send\n");
 #endif
-		httpCtx->callback(-1, NULL, httpCtx->userData);
+		if(httpCtx->callback != NULL)
+			httpCtx->callback(-1, NULL, httpCtx->userData);
 		httpCtxFree(httpCtx);
 		return;
 	}
 
 	GIOChannel* channel = g_io_channel_unix_new(httpCtx->sock);
-	g_io_add_watch(channel, G_IO_IN, (GIOFunc)httpRecvCb, httpCtx);
+	g_io_add_watch(channel, G_IO_IN | G_IO_HUP | G_IO_ERR, httpRecvCb, httpCtx);
 	g_io_channel_unref(channel);
 }
 
+IOTC_PRIVATE void httpResolvedCb(GList *addresses, void *userData) {
+	struct httpCtx *httpCtx = (struct httpCtx *)userData;
+	if(addresses == NULL) {
+#ifdef DEBUG
+		printf("[DEBUG] Cannot resolve host name\n");
+#endif
+		if(httpCtx->callback != NULL)
+			httpCtx->callback(-1, NULL, httpCtx->userData);
+		httpCtxFree(httpCtx);
+		return;
+	}
+	// list is valid only during this callback
+	httpCtx->addresses = g_list_copy_deep(addresses, (GCopyFunc)g_object_ref, NULL);
+	httpCtx->address = httpCtx->addresses;
+	httpConnectAddress(httpCtx);
+}
+
 IOTC_PRIVATE int httpSendAsync(char *host, unsigned short port, char *path, char *postMsg,
 		void (*onResponse)(int, char *, void *), void *userData) {
 	struct httpCtx *httpCtx = httpCtxNew(host, port, path, postMsg, onResponse, userData);
 	httpCtx->gSocketClient = g_socket_client_new();
-	g_socket_client_connect_to_host_async(httpCtx->gSocketClient, host, port, NULL,
-			httpSocketConnectCb, httpCtx);
+	dnsLookupAsync(host, NULL, httpResolvedCb, httpCtx);
 	return 0;
 }
 
@@ -334,84 +439,32 @@ int httpPostAsync(char *host, unsigned short port, char *path, char *postMsg,
 int httpPost(char *host, char *path, char **response, char *postMsg) {
 	// TODO some code can be reduced into a function to avoid duplication
 	// between this file and secure.c implementation of https post
-	int error, sock, offset;
-	struct addrinfo hints, *dnsResults, *dnsResult;
+	int sock, code;
 	char requestString[HTTP_MAX_RESP];
+	HttpParser *parser;
 
 	(*response) = NULL;
 
-	// set connection hints
-	memset(&hints, 0, sizeof(struct addrinfo));
-	hints.ai_family = AF_UNSPEC; // Allow IPv4 or IPv6
-	hints.ai_socktype = SOCK_STREAM; // TCP
-	hints.ai_flags = 0;
-	hints.ai_protocol = 0;
-
-	// Resolv host name
-	error = getaddrinfo(host, NULL, &hints, &dnsResults);
-	if(error != 0) {
-#ifdef DEBUG
-		printf("Cannot resolve host name\n");
-#endif
+	sock = dnsConnect(host, 80);
+	if(sock < 0)
 		return -1;
-	}
-
-	// try to connect to one of the results gave by dns
-	for(dnsResult = dnsResults; dnsResult != NULL; dnsResult = dnsResult->ai_next) {
-		sock = socket(dnsResult->ai_family, dnsResult->ai_socktype, dnsResult->ai_protocol);
-		if(sock == -1)
-			continue;
-		if(dnsResult->ai_family == PF_INET){
-			((struct sockaddr_in *)dnsResult->ai_addr)->sin_port = htons(80);
-		}else if(dnsResult->ai_family == PF_INET6){
-			((struct sockaddr_in6 *)dnsResult->ai_addr)->sin6_port = htons(80);
-		}else{
-			continue;
-		}
-		if(connect(sock, dnsResult->ai_addr, dnsResult->ai_addrlen) != -1)
-			break;
-		close(sock);
-	}
-	if(dnsResult == NULL) {
-#ifdef DEBUG
-		printf("Cannot establish socket connection\n");
-#endif
-		freeaddrinfo(dnsResults);
-		return -1;
-	}
-	freeaddrinfo(dnsResults);
 
 	snprintf(requestString, sizeof(requestString), "POST %s HTTP/1.1\nUser-Agent: IoTl/%s\nAccept: */*\nHost: %s\nConnection: Close\nContent-Type: application/x-www-form-urlencoded\nContent-Length: %ld\n\n%s", path, VERSION, host, strlen(postMsg), postMsg);
 
 	send(sock, requestString, strlen(requestString), 0);
 
 	// read response
-	(*response) = (char *)malloc(sizeof(char)*HTTP_MAX_RESP);
-	offset = 0;
-	error = 1;
-	while(error > 0) {
-		error = recv(sock, (*response)+offset, HTTP_MAX_RESP - (offset+1), 0);
-		if(error == 0 || (error == -1 && errno != EAGAIN && errno != EWOULDBLOCK)) {
-			break;
-		} else if(error == -1) {
-			error = 1;
-		} else {
-			offset += error;
-		}
+	parser = httpParserNew(NULL, NULL);
+	if(parser == NULL) {
+		close(sock);
+		return -1;
 	}
-#ifdef DEBUG
-	if(offset > 0)
-		printf("Received %d bytes:\n%s\n", offset, *response);
-#endif
+	while(httpReadAvailable(sock, parser));
 	close(sock);
 
-	if(strstr(*response, "HTTP/1.1") == (*response) && strlen(*response) > 11) {
-#ifdef DEBUG
-		printf("HTTP status code: %d\n", atoi((*response)+9));
-#endif
-		return atoi((*response)+9);
-	}
-	return -1;
+	code = httpTakeResponse(parser, response);
+	httpParserFree(parser);
+	return code;
 }
 
 void iotcServerListDeleteFirst(struct iotcServerList **list) {
@@ -431,3 +484,73 @@ void iotcServerListFree(struct iotcServerList *list) {
 		iotcServerListDeleteFirst(&sl);
 	}
 }
+
+bool iotcServerListSave(const struct iotcServerList *list, const char *file) {
+	const struct iotcServerList *server;
+	int length = strlen(file) + 5;
+	char tmpFile[length];
+	snprintf(tmpFile, length, "%s.tmp", file);
+	// file contains turn credentials: only owner can read it
+	int fd = open(tmpFile, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	FILE *fp = fd >= 0 ? fdopen(fd, "w") : NULL;
+	if(fp == NULL) {
+#ifdef DEBUG
+		printf("[DEBUG] Cannot create %s: %s\n", tmpFile, strerror(errno));
+#endif
+		if(fd >= 0) {
+			close(fd);
+			unlink(tmpFile);
+		}
+		return false;
+	}
+	for(server=list; server!=NULL; server=server->next)
+		fprintf(fp, "%s %s %s %d\n", server->ip, server->username, server->password, server->rtt);
+	// file is replaced only when completely written, a reboot never leaves it truncated
+	if(fflush(fp) != 0 || fsync(fileno(fp)) != 0) {
+		fclose(fp);
+		unlink(tmpFile);
+		return false;
+	}
+	fclose(fp);
+	if(rename(tmpFile, file) != 0) {
+#ifdef DEBUG
+		printf("[DEBUG] Cannot replace %s: %s\n", file, strerror(errno));
+#endif
+		unlink(tmpFile);
+		return false;
+	}
+	return true;
+}
+
+struct iotcServerList *iotcServerListLoad(const char *file) {
+	struct iotcServerList *list = NULL, **prev;
+	char line[512];
+	FILE *fp = fopen(file, "r");
+	if(fp == NULL)
+		return NULL;
+	while(fgets(line, sizeof(line), fp) != NULL) {
+		char ip[INET6_ADDRSTRLEN], user[200], pass[200];
+		int rtt;
+		if(sscanf(line, "%45s %199s %199s %d", ip, user, pass, &rtt) != 4)
+			continue;
+		struct iotcServerList *server = (struct iotcServerList *)malloc(sizeof(struct iotcServerList));
+		if(server == NULL) {
+#ifdef DEBUG
+			printf("Malloc error: server\n");
+#endif
+			break;
+		}
+		server->ip = strdup(ip);
+		server->username = strdup(user);
+		server->password = strdup(pass);
+		server->rtt = rtt > 0 ? rtt : 0;
+		// fastest servers measured last time first, the others keep their order
+		for(prev=&list; *prev!=NULL; prev=&((*prev)->next))
+			if(server->rtt > 0 && ((*prev)->rtt == 0 || (*prev)->rtt > server->rtt))
+				break;
+		server->next = *prev;
+		*prev = server;
+	}
+	fclose(fp);
+	return list;
+}
@@ -28,6 +28,7 @@ struct iotcServerList {
 	char *ip;			/**< The ip (as string) of the server */
 	char *username;			/**< Username used for turn authentication */
 	char *password;			/**< Password used for turn authentication */
+	int rtt;			/**< Milliseconds to connect to the server measured by device, 0 if unknown */
 	struct iotcServerList *next;	/**< Next element of the list (or NULL if this is the last one) */
 };
 
@@ -77,12 +78,32 @@ int webDeviceGetServersAsync(char *CAFile, char *CAPath, char *crtFile, char *ke
  */
 bool webDeviceRegister(char *ip, char *CAFile, char *CAPath, char *crtFile, char *keyFile);
 
+/**
+ * @brief Notify the main server which connection server this device connected to, asynchronously
+ *
+ * The function returns immediatly and invoke callback when server answered.
+ * @see webDeviceRegister()
+ * @param ip The ip of the connection server this device connected to
+ * @param CAFile The full path of CA certificate used to verify server identity.
+ * @param CAPath The path of directory where is contained CA certificate. Only one between
+ * 		CAFile and CAPath is strictly needed.
+ * @param crtFile The full path of my certificate used by server to verify my identity
+ * @param keyFile The full path of my private key used to crypt my messages
+ * @param onFinish The callback invoked when server answered (can be NULL). Params are:
+ *	- registered true if server accepted the registration
+ *	- userData the user data provided as parameter in this funtion
+ * @param userData A pointer to data passed back to callback
+ * @return A negative error code or 0 if ok
+ */
+int webDeviceRegisterAsync(char *ip, char *CAFile, char *CAPath, char *crtFile, char *keyFile,
+		void (*onFinish)(bool, void *), void *userData);
+
 /**
  * @brief Send an http request using POST method
  *
  * @param host The hostname of the server to connect to
  * @param path The path of HTTP request
- * @param[out] response The HTTP response
+ * @param[out] response The HTTP response (header section and decoded body)
  * @param postMsg Data to be sent into the request
  * @return The HTTP status code returned by server, or a negative number if an error occurred
  */
@@ -97,7 +118,7 @@ int httpPost(char *host, char *path, char **response, char *postMsg);
  * @param postMsg Data to be sent into the request
  * @param onResponse The callback invoked when data is ready if the function returns 0. Params are:
  *	- code The HTTP status code
- *	- response The string containing http response
+ *	- response The string containing http response (header section and decoded body)
  *	- userData the user data provided as parameter in this funtion
  * @param userData A pointer to data passed back to callbacks
  * @return A negative error code or 0 if ok
@@ -118,3 +139,24 @@ void iotcServerListDeleteFirst(struct iotcServerList **list);
  * @param list The list to be freed
  */
 void iotcServerListFree(struct iotcServerList *list);
+
+/**
+ * @brief Save server list to a file
+ *
+ * The file is written aside and then renamed, so it is never found incomplete. It contains turn
+ * credentials, so it is readable by owner only.
+ * @param list The list to be saved
+ * @param file The full path of the file
+ * @return true if success, false otherwise
+ */
+bool iotcServerListSave(const struct iotcServerList *list, const char *file);
+
+/**
+ * @brief Load a server list saved using iotcServerListSave()
+ *
+ * Servers whose rtt is known are placed first, from the fastest one. The others follow in the
+ * saved order.
+ * @param file The full path of the file
+ * @return The list, to be deallocated using iotcServerListFree(), or NULL if file is missing or empty
+ */
+struct iotcServerList *iotcServerListLoad(const char *file);